@@ -0,0 +1,342 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Play a WAV file and provide its clock to schedule the subtitles.
+
+#include "audio-player.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef SUBTITLE_WITH_ALSA
+#  include <alsa/asoundlib.h>
+#endif
+
+using rgb_matrix::MutexLock;
+
+// Extrapolating from the last sample only makes sense for a short time;
+// if the player thread stalls, so does the audio.
+static const int64_t kMaxExtrapolationUs = 100000;
+
+// Differences between the audio clock and our estimate larger than this
+// are not drift, but a disruption (e.g. underrun); follow immediately.
+static const int64_t kClockStepThresholdUs = 40000;
+
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifdef SUBTITLE_WITH_ALSA
+namespace {
+class AlsaAudioSink : public AudioSink {
+public:
+  explicit AlsaAudioSink(const char *device) : device_(device), pcm_(NULL) {}
+  virtual ~AlsaAudioSink() {
+    if (pcm_) {
+      snd_pcm_drop(pcm_);
+      snd_pcm_close(pcm_);
+    }
+  }
+
+  virtual bool Open(int rate, int channels) {
+    int err = snd_pcm_open(&pcm_, device_.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) {
+      fprintf(stderr, "Can't open audio device '%s': %s\n", device_.c_str(),
+              snd_strerror(err));
+      pcm_ = NULL;
+      return false;
+    }
+    err = snd_pcm_set_params(pcm_, SND_PCM_FORMAT_S16_LE,
+                             SND_PCM_ACCESS_RW_INTERLEAVED, channels, rate,
+                             1 /* allow resampling */,
+                             100000 /* latency in usec */);
+    if (err < 0) {
+      fprintf(stderr, "Can't set up audio device '%s': %s\n",
+              device_.c_str(), snd_strerror(err));
+      return false;
+    }
+    return true;
+  }
+
+  virtual long Write(const int16_t *frames, long count) {
+    snd_pcm_sframes_t written = snd_pcm_writei(pcm_, frames, count);
+    if (written < 0) {
+      // Underrun or suspend. Recovering restarts the stream, which pauses
+      // the audio clock; our cues follow.
+      const int err = snd_pcm_recover(pcm_, written, 1);
+      if (err < 0) {
+        fprintf(stderr, "Audio playback error: %s\n", snd_strerror(err));
+        return -1;
+      }
+      return 0;
+    }
+    return written;
+  }
+
+  virtual long Delay() {
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(pcm_, &delay) < 0 || delay < 0)
+      return 0;
+    return delay;
+  }
+
+private:
+  const std::string device_;
+  snd_pcm_t *pcm_;
+};
+}  // namespace
+#endif  // SUBTITLE_WITH_ALSA
+
+namespace {
+// A sound card consuming frames at a fixed rate relative to CLOCK_MONOTONIC,
+// with a 100ms buffer. A rate off by some ppm simulates the drift between a
+// real sound card's crystal and the system clock.
+class SimulatedAudioSink : public AudioSink {
+public:
+  explicit SimulatedAudioSink(double ppm)
+    : ppm_(ppm), rate_(0), buffer_frames_(0), written_(0), start_us_(-1) {}
+
+  virtual bool Open(int rate, int channels) {
+    rate_ = rate * (1.0 + ppm_ / 1e6);
+    buffer_frames_ = rate / 10;
+    return true;
+  }
+
+  virtual long Write(const int16_t *frames, long count) {
+    count = std::min(count, buffer_frames_);
+    for (;;) {
+      const long room = buffer_frames_ - Delay();
+      if (room >= count) break;
+      usleep((count - room) * 1e6 / rate_ + 1);
+    }
+    if (start_us_ < 0) start_us_ = GetMonotonicMicros();
+    written_ += count;
+    return count;
+  }
+
+  virtual long Delay() {
+    if (start_us_ < 0) return written_;
+    int64_t consumed = (GetMonotonicMicros() - start_us_) * rate_ / 1e6;
+    if (consumed > written_) {
+      // Underrun: the card stopped until new data arrived.
+      start_us_ += (consumed - written_) * 1e6 / rate_;
+      consumed = written_;
+    }
+    return written_ - consumed;
+  }
+
+private:
+  const double ppm_;
+  double rate_;
+  long buffer_frames_;
+  int64_t written_;
+  int64_t start_us_;
+};
+}  // namespace
+
+AudioSink *CreateAudioSink(const char *device) {
+  if (strncmp(device, "sim", 3) == 0
+      && (device[3] == '\0' || device[3] == ':')) {
+    return new SimulatedAudioSink(device[3] ? atof(device + 4) : 0.0);
+  }
+#ifdef SUBTITLE_WITH_ALSA
+  return new AlsaAudioSink(device);
+#else
+  fprintf(stderr, "Compiled without ALSA support; only the simulated "
+          "audio device 'sim' is available.\n");
+  return NULL;
+#endif
+}
+
+static uint32_t ReadLE32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint16_t ReadLE16(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+// Read exactly count bytes, unless at end of file.
+static ssize_t FullRead(int fd, void *buf, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    const ssize_t r = read(fd, (char*)buf + done, count - done);
+    if (r < 0) return -1;
+    if (r == 0) break;
+    done += r;
+  }
+  return done;
+}
+
+WavReader::WavReader()
+  : fd_(-1), rate_(0), channels_(0), data_start_(0),
+    frame_count_(0), frame_pos_(0) {}
+
+WavReader::~WavReader() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool WavReader::Open(const char *filename) {
+  fd_ = open(filename, O_RDONLY);
+  if (fd_ < 0) {
+    fprintf(stderr, "Can't open audio file '%s'\n", filename);
+    return false;
+  }
+  unsigned char header[12];
+  if (FullRead(fd_, header, 12) != 12
+      || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+    fprintf(stderr, "'%s' is not a WAV file\n", filename);
+    return false;
+  }
+
+  // Walk the chunks until we have the format and found the data.
+  bool have_format = false;
+  unsigned char chunk[8];
+  while (FullRead(fd_, chunk, 8) == 8) {
+    const uint32_t size = ReadLE32(chunk + 4);
+    if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+      unsigned char fmt[16];
+      if (FullRead(fd_, fmt, 16) != 16) break;
+      const int format = ReadLE16(fmt);
+      channels_ = ReadLE16(fmt + 2);
+      rate_ = ReadLE32(fmt + 4);
+      const int bits = ReadLE16(fmt + 14);
+      if (format != 1 || bits != 16 || channels_ < 1 || rate_ < 1) {
+        fprintf(stderr, "'%s': only 16 bit PCM WAV files are supported\n",
+                filename);
+        return false;
+      }
+      have_format = true;
+      lseek(fd_, (size - 16) + (size & 1), SEEK_CUR);
+    } else if (memcmp(chunk, "data", 4) == 0 && have_format) {
+      data_start_ = lseek(fd_, 0, SEEK_CUR);
+      frame_count_ = size / (2 * channels_);
+      frame_pos_ = 0;
+      // Truncated files claim more than there is; only loop over what is.
+      struct stat st;
+      if (fstat(fd_, &st) == 0) {
+        frame_count_ = std::min<int64_t>(
+          frame_count_, (st.st_size - data_start_) / (2 * channels_));
+      }
+      if (frame_count_ <= 0) break;
+      return true;
+    } else {
+      lseek(fd_, size + (size & 1), SEEK_CUR);  // Chunks are 16 bit aligned.
+    }
+  }
+  fprintf(stderr, "'%s': no audio data found\n", filename);
+  return false;
+}
+
+long WavReader::ReadLooping(int16_t *buffer, long count) {
+  const bool rewound = (frame_pos_ >= frame_count_);
+  if (rewound) {
+    lseek(fd_, data_start_, SEEK_SET);
+    frame_pos_ = 0;
+  }
+  count = std::min<int64_t>(count, frame_count_ - frame_pos_);
+  // WAV samples are little endian, just as the Raspberry Pi.
+  const ssize_t r = FullRead(fd_, buffer, count * 2 * channels_);
+  if (r < 0) return -1;
+  const long frames = r / (2 * channels_);
+  if (frames == 0 && rewound) {
+    errno = EIO;   // Shrunk since opened; would just spin starting over.
+    return -1;
+  }
+  if (frames < count) {
+    frame_pos_ = frame_count_;  // Truncated file; start over next time.
+  } else {
+    frame_pos_ += frames;
+  }
+  return frames;
+}
+
+AudioPlayer::AudioPlayer(WavReader *wav, AudioSink *sink)
+  : wav_(wav), sink_(sink), running_(true),
+    sample_played_frames_(0), sample_monotonic_us_(-1) {}
+
+AudioPlayer::~AudioPlayer() {
+  Stop();
+  delete sink_;
+}
+
+bool AudioPlayer::Init() {
+  return sink_->Open(wav_->rate(), wav_->channels());
+}
+
+void AudioPlayer::Stop() {
+  {
+    MutexLock l(&mutex_);
+    running_ = false;
+  }
+  WaitStopped();
+}
+
+int64_t AudioPlayer::length_us() const {
+  return wav_->frame_count() * 1000000 / wav_->rate();
+}
+
+int64_t AudioPlayer::PositionUs(int64_t monotonic_us) {
+  MutexLock l(&mutex_);
+  if (sample_monotonic_us_ < 0) return -1;
+  const int64_t since_sample = std::min(monotonic_us - sample_monotonic_us_,
+                                        kMaxExtrapolationUs);
+  return sample_played_frames_ * 1000000 / wav_->rate() + since_sample;
+}
+
+void AudioPlayer::Run() {
+  // Small chunks, so that we sample the sound card state often.
+  const long chunk_frames = wav_->rate() / 100;
+  std::vector<int16_t> buffer(chunk_frames * wav_->channels());
+  int64_t frames_written = 0;
+  for (;;) {
+    {
+      MutexLock l(&mutex_);
+      if (!running_) return;
+    }
+    const long frames = wav_->ReadLooping(&buffer[0], chunk_frames);
+    if (frames < 0) {
+      perror("Reading audio file");
+      return;
+    }
+    for (long done = 0; done < frames; ) {
+      const long written = sink_->Write(&buffer[done * wav_->channels()],
+                                        frames - done);
+      if (written < 0) return;
+      done += written;
+    }
+    frames_written += frames;
+
+    const long delay = sink_->Delay();
+    const int64_t now_us = GetMonotonicMicros();
+    MutexLock l(&mutex_);
+    sample_played_frames_ = std::max<int64_t>(0, frames_written - delay);
+    sample_monotonic_us_ = now_us;
+  }
+}
+
+AudioClockFollower::AudioClockFollower(AudioPlayer *player)
+  : player_(player), start_us_(-1) {}
+
+int64_t AudioClockFollower::StartTimeUs(int64_t now_us) {
+  const int64_t position_us = player_->PositionUs(now_us);
+  if (position_us < 0) return -1;
+  const int64_t measured_us = now_us - position_us;
+  const int64_t error_us = measured_us - start_us_;
+  if (start_us_ < 0 || error_us > kClockStepThresholdUs
+      || error_us < -kClockStepThresholdUs) {
+    start_us_ = measured_us;
+  } else {
+    start_us_ += error_us / 16;
+  }
+  return start_us_;
+}
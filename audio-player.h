@@ -0,0 +1,123 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Play a WAV file and provide its clock to schedule the subtitles.
+//
+// The position of the audio that is heard right now is the number of frames
+// handed to the sound card minus the ones still queued in it (snd_pcm_delay()).
+// The player thread samples that after every write together with the
+// CLOCK_MONOTONIC time, so the render loop can ask for the audio position at
+// any point in time without making any ALSA calls itself.
+//
+// The sound card is abstracted as an AudioSink: the real one is ALSA; a
+// simulated one, which consumes the samples at a configurable clock skew,
+// allows to test synchronization without a sound card.
+
+#ifndef SUBTITLE_AUDIO_PLAYER_H
+#define SUBTITLE_AUDIO_PLAYER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include "thread.h"
+
+// Where the samples go.
+class AudioSink {
+public:
+  virtual ~AudioSink() {}
+
+  // Prepare for interleaved signed 16 bit samples.
+  virtual bool Open(int rate, int channels) = 0;
+
+  // Write "count" frames, blocking as long as the device buffer is full.
+  // Returns number of frames written or -1 on unrecoverable error.
+  virtual long Write(const int16_t *frames, long count) = 0;
+
+  // Number of frames written, but not heard yet.
+  virtual long Delay() = 0;
+};
+
+// Create the sink for the given device. Device names are passed to ALSA;
+// the special name "sim" or "sim:<ppm>" creates a simulated sound card
+// whose clock runs <ppm> parts per million fast (negative: slow) compared
+// to CLOCK_MONOTONIC. Returns NULL if not available.
+AudioSink *CreateAudioSink(const char *device);
+
+// Signed 16 bit PCM WAV file, read in chunks while playing.
+class WavReader {
+public:
+  WavReader();
+  ~WavReader();
+
+  bool Open(const char *filename);
+
+  int rate() const { return rate_; }
+  int channels() const { return channels_; }
+  int64_t frame_count() const { return frame_count_; }
+
+  // Read up to "count" frames. Starts over at the end of the file.
+  // Returns number of frames read, -1 on error.
+  long ReadLooping(int16_t *buffer, long count);
+
+private:
+  int fd_;
+  int rate_;
+  int channels_;
+  off_t data_start_;
+  int64_t frame_count_;
+  int64_t frame_pos_;
+};
+
+class AudioPlayer : public rgb_matrix::Thread {
+public:
+  // Takes ownership of the sink, not of the reader.
+  AudioPlayer(WavReader *wav, AudioSink *sink);
+  virtual ~AudioPlayer();
+
+  bool Init();
+
+  // Stop playing. Returns once the thread is finished.
+  void Stop();
+
+  // Length of one pass through the file.
+  int64_t length_us() const;
+
+  // Audio position heard at the given CLOCK_MONOTONIC time, in microseconds
+  // since start of playing. Counts on when the file starts over, so it never
+  // jumps back. Extrapolated from the last sample of the sound card state.
+  // Returns -1 before the first samples have been written.
+  int64_t PositionUs(int64_t monotonic_us);
+
+  virtual void Run();
+
+private:
+  WavReader *const wav_;
+  AudioSink *const sink_;
+
+  rgb_matrix::Mutex mutex_;
+  bool running_;
+  int64_t sample_played_frames_;   // Frames heard at ...
+  int64_t sample_monotonic_us_;    // ... this time.
+};
+
+// Tracks the relation between the audio clock and CLOCK_MONOTONIC.
+//
+// The delay reported by the sound card has some jitter, so the raw audio
+// position would make cue changes jump around by a few milliseconds. We
+// follow slow drift between the two clocks with a low-pass filter and only
+// step on larger disruptions such as underruns.
+class AudioClockFollower {
+public:
+  explicit AudioClockFollower(AudioPlayer *player);
+
+  // CLOCK_MONOTONIC time at which audio position 0 was heard, updated with
+  // the audio clock at "now_us". Returns -1 if audio has not started yet.
+  int64_t StartTimeUs(int64_t now_us);
+
+private:
+  AudioPlayer *const player_;
+  int64_t start_us_;
+};
+
+#endif  // SUBTITLE_AUDIO_PLAYER_H
@@ -1,2 +1,2 @@
 #!/bin/bash
-sudo ./subtitle -f fonts/7x13B.bdf -C 255,255,255 -s -0 --led-slowdown-gpio=5 --led-cols=64 --led-rows=32 --led-chain=6 --led-row-addr-type=0 -x -11 -y 1 -e 4 --led-brightness=80 --led-no-hardware-pulse --led-pixel-mapper "Rotate:180" -i ./input.txt
\ No newline at end of file
+sudo ./subtitle -f fonts/7x13B.bdf -C 255,255,255 -s -0 --led-slowdown-gpio=5 --led-cols=64 --led-rows=32 --led-chain=6 --led-row-addr-type=0 -y 1 -e 4 --led-brightness=80 --led-no-hardware-pulse --led-pixel-mapper "Rotate:180" -T files/subtitles.srt -A files/audio.wav
\ No newline at end of file
@@ -0,0 +1,194 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Compile a subtitle show into a content stream.
+//
+// Renders every cue of a *.srt file (and every gap between cues) exactly
+// like the subtitle binary would, and writes the resulting frames with
+// their display time to a stream file. Playing it with "subtitle -S" then
+// needs no text rendering at all at show time.
+//
+// The frames are in the internal representation of the library, so the
+// stream has to be compiled with the same --led-* options (geometry,
+// multiplexing, pixel mapper) as used for playing.
+
+#include "led-matrix.h"
+#include "graphics.h"
+#include "content-streamer.h"
+#include "srt-timeline.h"
+#include "subtitle-render.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace rgb_matrix;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] -o <stream-file> <srt-file>\n",
+          progname);
+  fprintf(stderr, "Pre-renders subtitles to a stream to be played with "
+          "'subtitle -S <stream-file>'\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-o <stream-file>  : Output file.\n"
+          "\t-f <font-file>    : Path to *.bdf-font to be used.\n"
+          "\t-x <x-origin>     : Shift X-Origin of displaying text (Default: 0)\n"
+          "\t-y <y-origin>     : Shift Y-Origin of displaying text (Default: 0)\n"
+          "\t-t <track-spacing>: Spacing pixels between letters (Default: 0)\n"
+          "\t-e <line-spacing> : Extra pixels between two lines (Default: 0)\n"
+          "\n"
+          "\t-C <r,g,b>        : Text Color. Default 255,255,255 (white)\n"
+          "\t-B <r,g,b>        : Background-Color. Default 0,0,0\n"
+          "\t-O <r,g,b>        : Outline-Color, e.g. to increase contrast.\n"
+          );
+  fprintf(stderr, "\nGeneral LED matrix options (use the same as for "
+          "playing):\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static bool parseColor(Color *c, const char *str) {
+  return sscanf(str, "%hhu,%hhu,%hhu", &c->r, &c->g, &c->b) == 3;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+  // We only render to memory, no need to access the hardware; so also no
+  // reason to drop privileges.
+  runtime_opt.do_gpio_init = false;
+  runtime_opt.drop_privileges = 0;
+
+  SubtitleStyle style;
+  const char *bdf_font_file = NULL;
+  const char *output_file = NULL;
+  bool with_outline = false;
+  bool xorigin_configured = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "x:y:f:C:B:O:t:e:o:")) != -1) {
+    switch (opt) {
+    case 'x': style.x = atoi(optarg); xorigin_configured = true; break;
+    case 'y': style.y = atoi(optarg); break;
+    case 'f': bdf_font_file = strdup(optarg); break;
+    case 't': style.letter_spacing = atoi(optarg); break;
+    case 'e': style.linespace = atoi(optarg); break;
+    case 'o': output_file = strdup(optarg); break;
+    case 'C':
+      if (!parseColor(&style.color, optarg)) {
+        fprintf(stderr, "Invalid color spec: %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'B':
+      if (!parseColor(&style.bg_color, optarg)) {
+        fprintf(stderr, "Invalid background color spec: %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'O':
+      if (!parseColor(&style.outline_color, optarg)) {
+        fprintf(stderr, "Invalid outline color spec: %s\n", optarg);
+        return usage(argv[0]);
+      }
+      with_outline = true;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "Expected exactly one *.srt file.\n");
+    return usage(argv[0]);
+  }
+  if (output_file == NULL) {
+    fprintf(stderr, "Need to specify output file with -o\n");
+    return usage(argv[0]);
+  }
+  if (bdf_font_file == NULL) {
+    fprintf(stderr, "Need to specify BDF font-file with -f\n");
+    return usage(argv[0]);
+  }
+
+  SrtTimeline timeline;
+  if (!timeline.LoadFile(argv[optind])) {
+    fprintf(stderr, "Couldn't read subtitles from '%s'\n", argv[optind]);
+    return 1;
+  }
+
+  rgb_matrix::Font font;
+  if (!font.LoadFont(bdf_font_file)) {
+    fprintf(stderr, "Couldn't load font '%s'\n", bdf_font_file);
+    return 1;
+  }
+  style.font = &font;
+  style.outline = with_outline;
+  if (!xorigin_configured) {
+    style.x = with_outline ? 1 : 0;   // Same as non-scrolling subtitle.
+  }
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
+  if (matrix == NULL)
+    return 1;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  style.width = canvas->width() - (with_outline ? 2 : 0);
+
+  const int fd = open(output_file, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open output '%s': %s\n", output_file,
+            strerror(errno));
+    return 1;
+  }
+  rgb_matrix::FileStreamIO stream_io(fd);
+  rgb_matrix::StreamWriter writer(&stream_io);
+
+  // Walk the timeline from change to change; each stretch in between is one
+  // frame: either a cue or an empty gap.
+  int frames = 0;
+  int64_t t = 0;
+  while (t < timeline.duration_us()) {
+    int64_t next = timeline.NextChangeAfter(t);
+    if (next < 0 || next > timeline.duration_us())
+      next = timeline.duration_us();
+
+    const int cue = timeline.Seek(t);
+    if (cue >= 0) {
+      const SrtCue &c = timeline.cue(cue);
+      TextLayout layout;
+      LayoutSubtitle(style, c.lines[1].empty()
+                     ? c.lines[0] : c.lines[0] + "\n" + c.lines[1], &layout);
+      DrawSubtitle(canvas, style, layout);
+    } else {
+      canvas->Fill(style.bg_color.r, style.bg_color.g, style.bg_color.b);
+    }
+
+    // Hold time is 32 bit; very long gaps need more than one frame.
+    for (int64_t remaining = next - t; remaining > 0; ) {
+      const uint32_t hold_us = (remaining > UINT32_MAX)
+        ? UINT32_MAX : (uint32_t)remaining;
+      if (!writer.Stream(*canvas, hold_us)) {
+        fprintf(stderr, "Failed to write to '%s'\n", output_file);
+        return 1;
+      }
+      remaining -= hold_us;
+      ++frames;
+    }
+    t = next;
+  }
+
+  fprintf(stderr, "Wrote %d frames (%d cues, %.1f seconds) to '%s'\n",
+          frames, (int)timeline.size(), timeline.duration_us() / 1e6,
+          output_file);
+  delete matrix;
+  return 0;
+}
@@ -0,0 +1,317 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Commands to the subtitle display over a Unix domain socket.
+
+#include "control-server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+using rgb_matrix::MutexLock;
+
+static const size_t kHeaderSize = 16;      // Without the length field.
+static const size_t kAckSize = 24;
+static const uint32_t kMaxMessageSize = 64 * 1024;
+// A client not reading its acks is dropped once this many are unsent.
+static const size_t kMaxUnsentAckBytes = 64 * 1024;
+
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+ControlServer::ControlServer(const char *socket_path)
+  : socket_path_(socket_path), listen_fd_(-1), stop_fd_(-1), ack_fd_(-1),
+    command_fd_(-1), next_client_(0) {}
+
+ControlServer::~ControlServer() {
+  Stop();
+  while (!client_fds_.empty()) CloseClient(client_fds_.begin()->first);
+  if (listen_fd_ >= 0) close(listen_fd_);
+  if (stop_fd_ >= 0) close(stop_fd_);
+  if (ack_fd_ >= 0) close(ack_fd_);
+  if (command_fd_ >= 0) close(command_fd_);
+}
+
+bool ControlServer::Init() {
+  struct sockaddr_un addr;
+  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' too long\n", socket_path_.c_str());
+    return false;
+  }
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  ack_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  command_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (stop_fd_ < 0 || ack_fd_ < 0 || command_fd_ < 0 || listen_fd_ < 0) {
+    perror("Can't set up control socket");
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(socket_path_.c_str());   // Left over from a previous run.
+  if (bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(listen_fd_, 4) < 0) {
+    fprintf(stderr, "Can't listen on '%s': %s\n", socket_path_.c_str(),
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void ControlServer::Stop() {
+  if (stop_fd_ < 0) return;
+  Signal(stop_fd_);
+  WaitStopped();
+  if (listen_fd_ >= 0) unlink(socket_path_.c_str());
+}
+
+void ControlServer::Signal(int event_fd) {
+  const uint64_t one = 1;
+  if (write(event_fd, &one, sizeof(one)) < 0) {
+    perror("Signalling control server event");
+  }
+}
+
+void ControlServer::TakeDue(int64_t due_us, std::vector<ControlCommand> *out) {
+  MutexLock l(&mutex_);
+  while (!pending_.empty() && pending_.front().at_us <= due_us) {
+    out->push_back(pending_.front());
+    pending_.pop_front();
+  }
+}
+
+int64_t ControlServer::NextDueUs() {
+  MutexLock l(&mutex_);
+  return pending_.empty() ? -1 : pending_.front().at_us;
+}
+
+void ControlServer::WaitForCommand(int64_t timeout_us) {
+  struct pollfd pfd;
+  pfd.fd = command_fd_;
+  pfd.events = POLLIN;
+  const int timeout_ms = (timeout_us < 0) ? -1 : (timeout_us + 999) / 1000;
+  if (poll(&pfd, 1, timeout_ms) > 0) {
+    uint64_t count;
+    if (read(command_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      perror("Reading control command notification");
+    }
+  }
+}
+
+void ControlServer::Acknowledge(const ControlCommand &command,
+                                ControlCommand::Status status,
+                                int64_t presented_us) {
+  char buffer[4 + kAckSize] = {0};
+  const uint32_t len = kAckSize;
+  const uint8_t status_byte = status;
+  memcpy(buffer + 0, &len, 4);
+  memcpy(buffer + 4, &command.id, 4);
+  memcpy(buffer + 8, &status_byte, 1);
+  memcpy(buffer + 12, &command.received_us, 8);
+  memcpy(buffer + 20, &presented_us, 8);
+  Ack ack;
+  ack.client = command.client;
+  ack.data.assign(buffer, sizeof(buffer));
+  {
+    MutexLock l(&mutex_);
+    acks_.push_back(ack);
+  }
+  Signal(ack_fd_);
+}
+
+void ControlServer::Accept() {
+  // Non-blocking, so that a client not reading its acks can't stall us.
+  const int fd = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0) return;
+  client_fds_[next_client_++] = fd;
+}
+
+void ControlServer::CloseClient(int client) {
+  std::map<int, int>::iterator found = client_fds_.find(client);
+  if (found == client_fds_.end()) return;
+  close(found->second);
+  client_fds_.erase(found);
+  client_buffers_.erase(client);
+  client_output_.erase(client);
+}
+
+bool ControlServer::ReadFrom(int client, int fd) {
+  char buffer[4096];
+  const ssize_t r = read(fd, buffer, sizeof(buffer));
+  if (r < 0 && (errno == EINTR || errno == EAGAIN)) return true;
+  if (r <= 0) return false;
+  const int64_t received_us = GetMonotonicMicros();
+
+  std::string &pending = client_buffers_[client];
+  pending.append(buffer, r);
+  size_t pos = 0;
+  while (pending.size() - pos >= 4) {
+    uint32_t len;
+    memcpy(&len, pending.data() + pos, 4);
+    if (len > kMaxMessageSize) {
+      fprintf(stderr, "Control message of %u bytes; closing connection.\n",
+              len);
+      return false;
+    }
+    if (pending.size() - pos - 4 < len) break;   // Not complete yet.
+    ParseCommand(client, pending.data() + pos + 4, len, received_us);
+    pos += 4 + len;
+  }
+  pending.erase(0, pos);
+  return true;
+}
+
+void ControlServer::ParseCommand(int client, const char *msg, uint32_t len,
+                                 int64_t received_us) {
+  ControlCommand command;
+  command.id = 0;
+  command.client = client;
+  command.received_us = received_us;
+  command.has_bg_color = false;
+  command.brightness = 100;
+  command.fade_ms = 0;
+  if (len < kHeaderSize) {
+    Acknowledge(command, ControlCommand::INVALID, 0);
+    return;
+  }
+  uint8_t type;
+  memcpy(&command.id, msg + 0, 4);
+  memcpy(&type, msg + 4, 1);
+  memcpy(&command.at_us, msg + 8, 8);
+  const uint8_t *payload = (const uint8_t *)msg + kHeaderSize;
+  const uint32_t payload_len = len - kHeaderSize;
+
+  bool valid = true;
+  command.type = (ControlCommand::Type)type;
+  switch (type) {
+  case ControlCommand::SHOW_TEXT:
+    command.text.assign((const char *)payload, payload_len);
+    break;
+  case ControlCommand::CLEAR:
+    break;
+  case ControlCommand::SET_COLOR:
+    valid = (payload_len == 3 || payload_len == 6);
+    if (valid) {
+      command.color = rgb_matrix::Color(payload[0], payload[1], payload[2]);
+      command.has_bg_color = (payload_len == 6);
+      if (command.has_bg_color) {
+        command.bg_color = rgb_matrix::Color(payload[3], payload[4],
+                                             payload[5]);
+      }
+    }
+    break;
+  case ControlCommand::SET_BRIGHTNESS:
+    valid = ((payload_len == 1 || payload_len == 5)
+             && payload[0] >= 1 && payload[0] <= 100);
+    if (valid) command.brightness = payload[0];
+    if (valid && payload_len == 5) memcpy(&command.fade_ms, payload + 1, 4);
+    break;
+  default:
+    valid = false;
+  }
+  if (!valid) {
+    Acknowledge(command, ControlCommand::INVALID, 0);
+    return;
+  }
+
+  // Anything not in the future is due right away, in order of arrival.
+  if (command.at_us < received_us) command.at_us = received_us;
+  {
+    MutexLock l(&mutex_);
+    std::deque<ControlCommand>::iterator it = pending_.end();
+    while (it != pending_.begin() && (it - 1)->at_us > command.at_us)
+      --it;
+    pending_.insert(it, command);
+  }
+  Signal(command_fd_);
+}
+
+void ControlServer::SendAcks() {
+  uint64_t count;
+  if (read(ack_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("Reading control ack notification");
+  }
+  std::vector<Ack> acks;
+  {
+    MutexLock l(&mutex_);
+    acks.swap(acks_);
+  }
+  for (size_t i = 0; i < acks.size(); ++i) {
+    const int client = acks[i].client;
+    if (client_fds_.find(client) == client_fds_.end())
+      continue;   // Gone in the meantime.
+    std::string &output = client_output_[client];
+    output.append(acks[i].data);
+    if (output.size() > kMaxUnsentAckBytes) {
+      fprintf(stderr, "Control client not reading acks; closing connection.\n");
+      CloseClient(client);
+    } else if (!WriteTo(client)) {
+      CloseClient(client);
+    }
+  }
+}
+
+bool ControlServer::WriteTo(int client) {
+  std::string &output = client_output_[client];
+  size_t pos = 0;
+  while (pos < output.size()) {
+    const ssize_t w = write(client_fds_[client], output.data() + pos,
+                            output.size() - pos);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && errno == EAGAIN) break;   // Rest once it is writable again.
+    if (w <= 0) return false;
+    pos += w;
+  }
+  output.erase(0, pos);
+  return true;
+}
+
+void ControlServer::Run() {
+  for (;;) {
+    std::vector<struct pollfd> fds;
+    std::vector<int> clients;
+    const int fixed_fds[] = { stop_fd_, ack_fd_, listen_fd_ };
+    for (int i = 0; i < 3; ++i) {
+      struct pollfd pfd = { fixed_fds[i], POLLIN, 0 };
+      fds.push_back(pfd);
+    }
+    for (std::map<int, int>::iterator it = client_fds_.begin();
+         it != client_fds_.end(); ++it) {
+      const bool unsent = !client_output_[it->first].empty();
+      struct pollfd pfd = { it->second,
+                            (short)(POLLIN | (unsent ? POLLOUT : 0)), 0 };
+      fds.push_back(pfd);
+      clients.push_back(it->first);
+    }
+
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll() on control socket");
+      return;
+    }
+    if (fds[0].revents) return;   // Asked to stop.
+
+    for (size_t i = 0; i < clients.size(); ++i) {
+      const short revents = fds[3 + i].revents;
+      if (revents == 0) continue;
+      if (((revents & POLLOUT) && !WriteTo(clients[i]))
+          || ((revents & ~POLLOUT) && !ReadFrom(clients[i], fds[3 + i].fd))) {
+        CloseClient(clients[i]);
+      }
+    }
+    if (fds[1].revents) SendAcks();
+    if (fds[2].revents) Accept();
+  }
+}
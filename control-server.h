@@ -0,0 +1,141 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Commands to the subtitle display over a Unix domain socket.
+//
+// Producers connect to a SOCK_STREAM socket and send length-prefixed
+// messages. Every command can be scheduled for a CLOCK_MONOTONIC time, and
+// is acknowledged with the time of the refresh that actually made it
+// visible, so producers can measure end-to-end latency. Unlike writing a
+// file, a command is never seen half-written.
+//
+// All integers are in host byte order (the socket is local); times are
+// CLOCK_MONOTONIC microseconds.
+//
+// Command:
+//   uint32  length        bytes following this field: 16 + payload
+//   uint32  id            chosen by the producer, returned in the ack
+//   uint8   type          see ControlCommand::Type
+//   uint8   reserved[3]
+//   int64   at_us         when to show; 0 or past: as soon as possible
+//   ...     payload       SHOW_TEXT: UTF-8 text, '\n' separating lines
+//                         SET_COLOR: r,g,b of the text; optionally followed
+//                                    by r,g,b of the background
+//                         SET_BRIGHTNESS: one byte, percent 1..100;
+//                                    optionally followed by a uint32 of
+//                                    milliseconds to fade to it
+//                         CLEAR: none
+//
+// Acknowledgement, sent back on the same connection:
+//   uint32  length        always 24
+//   uint32  id
+//   uint8   status        see ControlCommand::Status
+//   uint8   reserved[3]
+//   int64   received_us   when the command arrived
+//   int64   presented_us  start of the refresh showing it; 0 if not shown
+//
+// A connection that doesn't read its acknowledgements is closed once 64k of
+// them are unsent.
+
+#ifndef SUBTITLE_CONTROL_SERVER_H
+#define SUBTITLE_CONTROL_SERVER_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "graphics.h"
+#include "thread.h"
+
+struct ControlCommand {
+  enum Type {
+    SHOW_TEXT = 1,
+    CLEAR = 2,
+    SET_COLOR = 3,
+    SET_BRIGHTNESS = 4,
+  };
+  enum Status {
+    PRESENTED = 0,
+    INVALID = 1,      // Malformed command or unknown type.
+    SUPERSEDED = 2,   // Replaced by a later text before it was visible.
+  };
+
+  Type type;
+  uint32_t id;
+  int64_t at_us;
+  int64_t received_us;
+  int client;                   // Connection to acknowledge to.
+
+  std::string text;             // SHOW_TEXT
+  rgb_matrix::Color color;      // SET_COLOR
+  bool has_bg_color;
+  rgb_matrix::Color bg_color;
+  uint8_t brightness;           // SET_BRIGHTNESS
+  uint32_t fade_ms;
+};
+
+class ControlServer : public rgb_matrix::Thread {
+public:
+  explicit ControlServer(const char *socket_path);
+  virtual ~ControlServer();
+
+  // Create the socket, replacing a stale one. Returns 'false' on failure.
+  // Call before Start().
+  bool Init();
+
+  // Stop the server thread and remove the socket. Returns once finished.
+  void Stop();
+
+  // Move all commands due at "due_us" to "out", in order of their time.
+  // Never blocks on I/O.
+  void TakeDue(int64_t due_us, std::vector<ControlCommand> *out);
+
+  // Time of the earliest pending command, -1 if there is none.
+  int64_t NextDueUs();
+
+  // Block until a new command arrives, a signal is received or the timeout
+  // (-1: none) passes.
+  void WaitForCommand(int64_t timeout_us);
+
+  // Send the acknowledgement for a command. Never blocks on I/O; the server
+  // thread sends it.
+  void Acknowledge(const ControlCommand &command,
+                   ControlCommand::Status status, int64_t presented_us);
+
+  virtual void Run();
+
+private:
+  struct Ack {
+    int client;
+    std::string data;
+  };
+
+  void Accept();
+  void CloseClient(int client);
+  bool ReadFrom(int client, int fd);   // Returns 'false' to close.
+  void ParseCommand(int client, const char *msg, uint32_t len,
+                    int64_t received_us);
+  void SendAcks();
+  bool WriteTo(int client);            // Returns 'false' to close.
+  static void Signal(int event_fd);
+
+  const std::string socket_path_;
+  int listen_fd_;
+  int stop_fd_;      // eventfd to wake up the thread to finish.
+  int ack_fd_;       // eventfd signalled when acks are queued.
+  int command_fd_;   // eventfd signalled after each new command.
+
+  // Only used by the server thread.
+  int next_client_;
+  std::map<int, int> client_fds_;              // client -> fd
+  std::map<int, std::string> client_buffers_;  // client -> partial input
+  std::map<int, std::string> client_output_;   // client -> unsent acks
+
+  rgb_matrix::Mutex mutex_;
+  std::deque<ControlCommand> pending_;   // Sorted by at_us.
+  std::vector<Ack> acks_;
+};
+
+#endif  // SUBTITLE_CONTROL_SERVER_H
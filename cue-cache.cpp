@@ -0,0 +1,181 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Cache of pre-rasterized cues.
+
+#include "cue-cache.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::MutexLock;
+
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+CueCache::CueCache(int cue_count, size_t budget_bytes, int lookahead,
+                   FrameCanvas *scratch, const Renderer &renderer)
+  : cue_count_(cue_count), budget_bytes_(budget_bytes), scratch_(scratch),
+    renderer_(renderer), running_(true), position_(0), bytes_used_(0),
+    hits_(0), misses_(0), evictions_(0), budget_misses_(0), installs_(0),
+    install_total_us_(0), install_max_us_(0) {
+  pthread_cond_init(&wakeup_, NULL);
+
+  // Always leave room for the cue currently shown, otherwise the
+  // background thread would evict what it has just prepared.
+  const char *data;
+  size_t frame_bytes;
+  scratch_->Serialize(&data, &frame_bytes);
+  const int max_entries = budget_bytes_ / frame_bytes;
+  lookahead_ = std::max(0, std::min(lookahead, max_entries - 1));
+  lookahead_ = std::min(lookahead_, cue_count_);
+}
+
+CueCache::~CueCache() {
+  Stop();
+  pthread_cond_destroy(&wakeup_);
+}
+
+void CueCache::Stop() {
+  {
+    MutexLock l(&mutex_);
+    running_ = false;
+    pthread_cond_signal(&wakeup_);
+  }
+  WaitStopped();
+}
+
+void CueCache::Prefetch(int cue) {
+  if (cue_count_ == 0) return;
+  MutexLock l(&mutex_);
+  position_ = cue % cue_count_;
+  pthread_cond_signal(&wakeup_);
+}
+
+bool CueCache::Install(int cue, FrameCanvas *canvas) {
+  const int64_t start_us = GetMonotonicMicros();
+  Blob data;
+  {
+    MutexLock l(&mutex_);
+    std::map<int, Entry>::iterator found = entries_.find(cue);
+    if (found != entries_.end()) {
+      data = found->second.data;
+      lru_.splice(lru_.begin(), lru_, found->second.lru_pos);
+    }
+  }
+  // The copy happens outside the lock; 'data' is kept alive by us even if
+  // the entry gets evicted in the meantime.
+  const bool hit = data && canvas->Deserialize(data->data(), data->size());
+  if (!hit) {
+    renderer_(canvas, cue);
+  }
+  const int64_t duration_us = GetMonotonicMicros() - start_us;
+
+  if (!hit) {
+    // Keep it; we might loop back to it.
+    const char *raw;
+    size_t len;
+    canvas->Serialize(&raw, &len);
+    Blob rendered = std::make_shared<const std::string>(raw, len);
+    MutexLock l(&mutex_);
+    InsertLocked(cue, rendered);
+  }
+
+  MutexLock l(&mutex_);
+  if (hit) ++hits_; else ++misses_;
+  ++installs_;
+  install_total_us_ += duration_us;
+  install_max_us_ = std::max(install_max_us_, duration_us);
+  return hit;
+}
+
+void CueCache::PrintStats(FILE *out) {
+  MutexLock l(&mutex_);
+  fprintf(out, "Cue cache: %llu hits, %llu misses, %llu evictions, "
+          "%llu not kept; %d cues in %.1fKiB of %.1fKiB budget; "
+          "cue install time avg %lldusec, max %lldusec\n",
+          (unsigned long long)hits_, (unsigned long long)misses_,
+          (unsigned long long)evictions_, (unsigned long long)budget_misses_,
+          (int)entries_.size(), bytes_used_ / 1024.0, budget_bytes_ / 1024.0,
+          (long long)(installs_ ? install_total_us_ / (int64_t)installs_ : 0),
+          (long long)install_max_us_);
+}
+
+int CueCache::NextToRenderLocked() const {
+  for (int i = 0; i < lookahead_; ++i) {
+    const int cue = (position_ + i) % cue_count_;
+    if (entries_.find(cue) == entries_.end())
+      return cue;
+  }
+  return -1;
+}
+
+bool CueCache::InsertLocked(int cue, const Blob &data) {
+  if (entries_.find(cue) != entries_.end()) return true;
+  if (data->size() > budget_bytes_) {
+    ++budget_misses_;
+    return false;
+  }
+
+  while (bytes_used_ + data->size() > budget_bytes_) {
+    // Evict the least recently used, but not what we're about to show. If
+    // that is all there is, rather don't keep this one; evicting one of
+    // them would only have it rendered again.
+    std::list<int>::iterator victim = lru_.end();
+    for (std::list<int>::reverse_iterator it = lru_.rbegin();
+         it != lru_.rend(); ++it) {
+      const int distance = (*it - position_ + cue_count_) % cue_count_;
+      if (distance >= lookahead_) {
+        victim = std::prev(it.base());
+        break;
+      }
+    }
+    if (victim == lru_.end()) {
+      ++budget_misses_;
+      return false;
+    }
+    std::map<int, Entry>::iterator found = entries_.find(*victim);
+    bytes_used_ -= found->second.data->size();
+    entries_.erase(found);
+    lru_.erase(victim);
+    ++evictions_;
+  }
+
+  lru_.push_front(cue);
+  Entry &entry = entries_[cue];
+  entry.data = data;
+  entry.lru_pos = lru_.begin();
+  bytes_used_ += data->size();
+  return true;
+}
+
+void CueCache::Run() {
+  for (;;) {
+    int cue;
+    {
+      MutexLock l(&mutex_);
+      while (running_ && (cue = NextToRenderLocked()) < 0) {
+        mutex_.WaitOn(&wakeup_);
+      }
+      if (!running_) return;
+    }
+
+    renderer_(scratch_, cue);
+    const char *raw;
+    size_t len;
+    scratch_->Serialize(&raw, &len);
+    Blob rendered = std::make_shared<const std::string>(raw, len);
+
+    MutexLock l(&mutex_);
+    if (!InsertLocked(cue, rendered)) {
+      // No room; wait until we're further in the show, instead of
+      // rendering the same cue over and over.
+      const int position = position_;
+      while (running_ && position_ == position) mutex_.WaitOn(&wakeup_);
+    }
+  }
+}
@@ -0,0 +1,99 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Cache of pre-rasterized cues.
+//
+// All cues of a show are known ahead of time, so there is no need to
+// rasterize text at the moment a cue has to appear. A background thread
+// renders the next few cues into a scratch FrameCanvas and keeps the
+// serialized bitplanes. Installing a cue into the offscreen canvas is then
+// a single memcpy with FrameCanvas::Deserialize().
+//
+// A serialized frame is rows/2 * columns * kBitPlanes * sizeof(gpio_bits_t)
+// bytes; roughly 270KB for a 384x32 display. The cache is kept within a
+// memory budget by evicting the least recently used cue.
+
+#ifndef SUBTITLE_CUE_CACHE_H
+#define SUBTITLE_CUE_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "led-matrix.h"
+#include "thread.h"
+
+class CueCache : public rgb_matrix::Thread {
+public:
+  // Renders the given cue into the canvas, including the background.
+  // Called from the background thread, as well as in Install() on a miss.
+  typedef std::function<void(rgb_matrix::FrameCanvas *canvas, int cue)>
+    Renderer;
+
+  // Cache for cues 0..cue_count-1 of at most "budget_bytes". The background
+  // thread keeps up to "lookahead" cues ahead of the current position ready.
+  // The "scratch" canvas, created by the same matrix as the canvases to
+  // install into, is used exclusively by the background thread.
+  CueCache(int cue_count, size_t budget_bytes, int lookahead,
+           rgb_matrix::FrameCanvas *scratch, const Renderer &renderer);
+  virtual ~CueCache();
+
+  // Stop the background thread. Returns once it is finished.
+  void Stop();
+
+  // Tell the cache that "cue" is the next one coming up; the background
+  // thread starts preparing it and the ones following. Wraps around at the
+  // end, as the show is looped. Never blocks on rendering.
+  void Prefetch(int cue);
+
+  // Fill "canvas" with the given cue. Returns 'true' if it was taken from
+  // the cache, 'false' if it had to be rendered right now.
+  bool Install(int cue, rgb_matrix::FrameCanvas *canvas);
+
+  void PrintStats(FILE *out);
+
+  virtual void Run();
+
+private:
+  typedef std::shared_ptr<const std::string> Blob;
+  struct Entry {
+    Blob data;
+    std::list<int>::iterator lru_pos;
+  };
+
+  // All these need mutex_ to be held.
+  int NextToRenderLocked() const;
+  // Returns 'false' if there was no room without evicting one of the cues
+  // coming up.
+  bool InsertLocked(int cue, const Blob &data);
+
+  const int cue_count_;
+  const size_t budget_bytes_;
+  rgb_matrix::FrameCanvas *const scratch_;
+  const Renderer renderer_;
+  int lookahead_;
+
+  rgb_matrix::Mutex mutex_;
+  pthread_cond_t wakeup_;
+  bool running_;
+  int position_;                  // Next cue coming up.
+  std::map<int, Entry> entries_;
+  std::list<int> lru_;            // Most recently used first.
+  size_t bytes_used_;
+
+  // Statistics.
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+  uint64_t budget_misses_;        // Not kept for lack of room.
+  uint64_t installs_;
+  int64_t install_total_us_;
+  int64_t install_max_us_;
+};
+
+#endif  // SUBTITLE_CUE_CACHE_H
@@ -0,0 +1,116 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Compile *.bdf fonts into the binary cache files that Font::LoadFont()
+// maps into memory instead of parsing the bdf file (see "make fonts").
+//
+// Each cache is written next to its font, with ".cache" appended. It is used
+// only as long as the bdf file is unchanged, and only on machines with the
+// same byte order, so it is best created on the Raspberry Pi itself.
+//
+// With -e, the fonts are written into a C++ source file instead, which
+// registers them with RegisterEmbeddedFont() when linked into a program.
+// The program then loads them without any file (see EMBEDDED_FONTS in the
+// Makefile).
+
+#include "graphics.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using rgb_matrix::Font;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-e <source-file>] <bdf-font-file>...\n",
+          progname);
+  fprintf(stderr, "Writes <bdf-font-file>.cache for each font, which is "
+          "then used to load it.\n");
+  fprintf(stderr, "\t-e <source-file> : Instead, write a C++ file that embeds "
+          "all fonts in the program it is linked into.\n");
+  return 1;
+}
+
+static bool WriteEmbeddedFonts(const char *source_file,
+                               const std::vector<const char*> &fonts) {
+  const std::string tmp_file = std::string(source_file) + ".tmp";
+  FILE *out = fopen(tmp_file.c_str(), "w");
+  if (out == NULL) {
+    perror(source_file);
+    return false;
+  }
+  fprintf(out, "// Generated by font-cache; do not edit.\n"
+          "// Fonts compiled into the program, which Font::LoadFont() loads\n"
+          "// without reading any file.\n\n"
+          "#include \"graphics.h\"\n\n"
+          "#include <stdint.h>\n\n"
+          "namespace {\n");
+  bool success = true;
+  for (size_t f = 0; success && f < fonts.size(); ++f) {
+    Font font;
+    if (!font.LoadFont(fonts[f])) {
+      fprintf(stderr, "Couldn't load font '%s'\n", fonts[f]);
+      success = false;
+      break;
+    }
+    const char *data;
+    size_t len;
+    font.Serialize(&data, &len);
+    fprintf(out, "\n// %s\nconstexpr uint64_t kFont%zu[] = {", fonts[f], f);
+    for (size_t i = 0; i < len / sizeof(uint64_t); ++i) {
+      uint64_t word;
+      memcpy(&word, data + i * sizeof(uint64_t), sizeof(word));
+      fprintf(out, "%s0x%016llxULL,", (i % 4 == 0) ? "\n  " : " ",
+              (unsigned long long)word);
+    }
+    fprintf(out, "\n};\n");
+  }
+  fprintf(out, "\nstruct Registration {\n  Registration() {\n");
+  for (size_t f = 0; success && f < fonts.size(); ++f) {
+    const char *slash = strrchr(fonts[f], '/');
+    fprintf(out, "    rgb_matrix::RegisterEmbeddedFont(\"%s\", kFont%zu, "
+            "sizeof(kFont%zu));\n", slash ? slash + 1 : fonts[f], f, f);
+  }
+  fprintf(out, "  }\n} registration;\n}  // anonymous namespace\n");
+  success &= (fclose(out) == 0);
+  if (!success || rename(tmp_file.c_str(), source_file) != 0) {
+    unlink(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const char *source_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:")) != -1) {
+    switch (opt) {
+    case 'e': source_file = optarg; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    return usage(argv[0]);
+  const std::vector<const char*> fonts(argv + optind, argv + argc);
+
+  if (source_file) {
+    if (!WriteEmbeddedFonts(source_file, fonts)) {
+      fprintf(stderr, "Couldn't write embedded fonts to '%s'\n", source_file);
+      return 1;
+    }
+    return 0;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < fonts.size(); ++i) {
+    if (!Font::CreateCacheFile(fonts[i])) {
+      fprintf(stderr, "Couldn't create font cache for '%s'\n", fonts[i]);
+      ++failed;
+    }
+  }
+  return failed == 0 ? 0 : 1;
+}
@@ -6,6 +6,7 @@
 // (but note, that the led-matrix library this depends on is GPL v2)
 
 #include "led-matrix.h"
+#include "graphics.h"
 
 #include <math.h>
 #include <signal.h>
@@ -16,7 +17,7 @@
 #define FPS 60
 
 using rgb_matrix::RGBMatrix;
-using rgb_matrix::Canvas;
+using rgb_matrix::FrameCanvas;
 
 volatile bool interrupt_received = false;
 static void InterruptHandler(int signo) {
@@ -29,10 +30,13 @@ int main(int argc, char *argv[]) {
   defaults.rows = 32;
   defaults.chain_length = 1;
   defaults.parallel = 1;
-  Canvas *canvas = RGBMatrix::CreateFromFlags(&argc, &argv, &defaults);
-  if (canvas == NULL) {
+  RGBMatrix *matrix = RGBMatrix::CreateFromFlags(&argc, &argv, &defaults);
+  if (matrix == NULL) {
     return 1;
   }
+  // Each frame is set in the offscreen canvas at once and swapped in on the
+  // next refresh.
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
 
   // It is always good to set up a signal handler to cleanly exit when we
   // receive a CTRL-C for instance. The DrawOnCanvas() routine is looking
@@ -59,13 +63,9 @@ int main(int argc, char *argv[]) {
       break;
     }
 
-    for (int y = 0; y < canvas->height(); y++) {
-      for (int x = 0; x < canvas->width(); x++) {
-        uint8_t *p = &buf[(y * canvas->width() + x) * 3];
-        uint8_t r = *(p+0), g = *(p+1), b = *(p+2);
-        canvas->SetPixel(x, y, r, g, b);
-      }
-    }
+    rgb_matrix::SetImage(canvas, 0, 0, buf, frame_size,
+                         canvas->width(), canvas->height(), false);
+    canvas = matrix->SwapOnVSync(canvas);
 
     struct timespec end;
     timespec_get(&end, TIME_UTC);
@@ -76,7 +76,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Animation finished. Shut down the RGB matrix.
-  canvas->Clear();
-  delete canvas;
+  matrix->Clear();
+  delete matrix;
   return 0;
 }
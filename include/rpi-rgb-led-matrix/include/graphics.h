@@ -13,8 +13,13 @@
 #include <stddef.h>
 
 #include <map>
+#include <vector>
+
+struct stat;
 
 namespace rgb_matrix {
+class FrameCanvas;
+
 struct Color {
   Color() : r(0), g(0), b(0) {}
   Color(uint8_t rr, uint8_t gg, uint8_t bb) : r(rr), g(gg), b(bb) {}
@@ -31,8 +36,24 @@ public:
   Font();
   ~Font();
 
+  // Load the bdf font file at "path". If a font with the same file name is
+  // compiled into the program (see RegisterEmbeddedFont()) and the file is
+  // missing or unchanged, that is used. Otherwise, if there is a cache file
+  // for it (see CreateCacheFile()) that is still up to date, that is mapped
+  // into memory and used as it is. Only then the bdf file is parsed.
   bool LoadFont(const char *path);
 
+  // Compile the bdf font file at "path" into the binary cache file used by
+  // LoadFont(), which is written next to it with ".cache" appended. The cache
+  // records the size and modification time of the bdf file; it is ignored
+  // once the bdf file changes. It needs to be created on a machine with the
+  // same byte order as the one using it.
+  static bool CreateCacheFile(const char *path);
+
+  // The data of the loaded font, in the format of the cache file. Valid as
+  // long as the font is.
+  void Serialize(const char **data, size_t *len) const;
+
   // Return height of font in pixels. Returns -1 if font has not been loaded.
   int height() const { return font_height_; }
 
@@ -67,21 +88,81 @@ public:
   // The ownership of the returned pointer is passed to the caller.
   Font *CreateOutlineFont() const;
 
+  // A glyph with its rows packed into words of 8, 16, 32 or 64 bits,
+  // whichever fits its width, for canvases that can blit bitmaps directly
+  // instead of setting pixel by pixel. Use GetBitmapRow() to read a row.
+  struct PackedGlyph {
+    const void *rows;      // "height" rows; leftmost pixel is the MSB.
+    int row_bits;          // Bits of each row: 8, 16, 32 or 64.
+    // The outline of the glyph as created by CreateOutlineFont(): "height"+2
+    // rows, starting one pixel left of and above "rows". NULL if the glyph
+    // is too wide for an outline (more than 62 pixels).
+    const void *outline_rows;
+    int outline_row_bits;
+    int height;
+    int top;               // First row relative to the baseline.
+    int advance;           // Pixels to advance, same as DrawGlyph() returns.
+  };
+
+  // Get the packed version of the unicode character; falls back to the
+  // replacement character like DrawGlyph(). Returns 'false' if there is none
+  // or if the glyph is too wide to be packed (more than 64 pixels).
+  bool GetPackedGlyph(uint32_t unicode_codepoint, PackedGlyph *result) const;
+
 private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
   struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  bool ReadBDF(const char *path);
+  bool MapCacheFile(const char *path, const struct stat &source);
+  bool UseEmbeddedFont(const char *path, const struct stat *source);
+  static bool IsValidData(const void *data, size_t size);
+  void SetGlyphs(int font_height, int base_line,
+                 const std::vector<Glyph> &glyphs,
+                 const std::vector<uint64_t> &bitmaps);
+  void UseData(const void *data, size_t size);
+  void Unload();
 
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+  // The glyphs, sorted by codepoint, the index of the ones for the first
+  // codepoints and the rows of their bitmaps. All are in one block of memory,
+  // laid out just like the cache file: the mapped cache file, an embedded
+  // font or malloc()ed.
+  const void *block_;
+  size_t block_size_;
+  const int16_t *direct_glyphs_;  // Glyph index by codepoint or -1.
+  const Glyph *glyphs_;
+  size_t glyph_count_;
+  size_t direct_count_;           // Glyphs in "direct_glyphs_".
+  const uint8_t *rows_;
+  void *data_;          // The block if we own it; NULL for embedded fonts.
+  size_t mapped_size_;  // Size of the mapping; 0 if "data_" is malloc()ed.
 };
 
+// Make a font available to Font::LoadFont() without reading any file: a font
+// file with the same "name" (without directory, e.g. "7x13B.bdf") is loaded
+// from "data" instead, if missing or unchanged since. "data" is the content
+// of a cache file (see Font::CreateCacheFile()), aligned to 8 bytes, and
+// needs to stay valid; usually it is an array in a source file generated
+// from Font::Serialize().
+void RegisterEmbeddedFont(const char *name, const void *data, size_t size);
+
 // -- Some utility functions.
 
+// Row "row" of a bitmap with rows of "row_bits" (8, 16, 32 or 64) bits, as
+// in Font::PackedGlyph, with the leftmost pixel in the most significant bit.
+inline uint64_t GetBitmapRow(const void *rows, int row_bits, int row) {
+  switch (row_bits) {
+  case 8:  return (uint64_t)static_cast<const uint8_t*>(rows)[row] << 56;
+  case 16: return (uint64_t)static_cast<const uint16_t*>(rows)[row] << 48;
+  case 32: return (uint64_t)static_cast<const uint32_t*>(rows)[row] << 32;
+  default: return static_cast<const uint64_t*>(rows)[row];
+  }
+}
+
 // Utility function: set an image from the given buffer containting pixels.
 //
 // Draw image of size "image_width" and "image_height" from pixel at
@@ -106,6 +187,13 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
               int image_width, int image_height,
               bool is_bgr);
 
+// Same result, but each row is set with FrameCanvas::SetPixelRow(), which
+// converts it in bulk instead of pixel by pixel.
+bool SetImage(FrameCanvas *c, int canvas_offset_x, int canvas_offset_y,
+              const uint8_t *image_buffer, size_t buffer_size_bytes,
+              int image_width, int image_height,
+              bool is_bgr);
+
 // Draw text, a standard NUL terminated C-string encoded in UTF-8,
 // with given "font" at "x","y" with "color".
 // "color" always needs to be set (hence it is a reference),
@@ -121,6 +209,27 @@ int DrawText(Canvas *c, const Font &font, int x, int y,
 int DrawText(Canvas *c, const Font &font, int x, int y, const Color &color,
              const char *utf8_text);
 
+// Same result, but the glyphs are written straight into the frame buffer
+// with FrameCanvas::DrawBitmaps(), so the color is converted only once
+// instead of for every pixel. Texts with "background_color" take the
+// regular path.
+int DrawText(FrameCanvas *c, const Font &font, int x, int y,
+             const Color &color, const Color *background_color,
+             const char *utf8_text, int kerning_offset = 0);
+
+// Draw text as above, with a one pixel outline around each glyph in
+// "outline_color", e.g. to increase contrast. Looks the same as first drawing
+// the text with the CreateOutlineFont() font one pixel to the left with
+// "kerning_offset" - 2, and then the text on top; but takes a single pass
+// over the text and needs no second font. Glyphs wider than 62 pixels are
+// drawn without outline.
+int DrawOutlinedText(Canvas *c, const Font &font, int x, int y,
+                     const Color &color, const Color &outline_color,
+                     const char *utf8_text, int kerning_offset = 0);
+int DrawOutlinedText(FrameCanvas *c, const Font &font, int x, int y,
+                     const Color &color, const Color &outline_color,
+                     const char *utf8_text, int kerning_offset = 0);
+
 // Draw text, a standard NUL terminated C-string encoded in UTF-8,
 // with given "font" at "x","y" with "color".
 // Draw text as above, but vertically (top down).
@@ -133,6 +242,72 @@ int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int kerning_offset = 0);
 
+// Width in pixels of the text drawn with DrawText() with the same
+// "kerning_offset"; that is from the left edge of the first to the right edge
+// of the last character.
+int MeasureText(const Font &font, const char *utf8_text,
+                int kerning_offset = 0);
+
+// Text broken into lines and aligned with pixel accuracy.
+//
+// The result is the position of each glyph, so drawing a layout does neither
+// need to decode UTF-8 nor to measure anything; keep the layout around to
+// draw the same text repeatedly.
+class TextLayout {
+public:
+  enum Alignment { ALIGN_LEFT, ALIGN_CENTER, ALIGN_RIGHT };
+
+  struct Glyph {
+    uint32_t codepoint;
+    int x;       // Relative to the origin of the layout.
+    int line;
+  };
+
+  TextLayout() {}
+
+  // Lay out UTF-8 text with "font" in lines of at most "max_width" pixels,
+  // replacing the current content. Lines are broken at '\n' and, if needed,
+  // between words; words wider than a line are broken between characters.
+  // Spaces around line breaks are dropped. Each line is aligned within
+  // "max_width". "kerning_offset" is the same as in DrawText().
+  void Layout(const Font &font, const char *utf8_text, int max_width,
+              int kerning_offset = 0, Alignment align = ALIGN_CENTER);
+
+  int line_count() const { return line_widths_.size(); }
+
+  // Width in pixels of the given line, as MeasureText() would return.
+  int line_width(int line) const { return line_widths_[line]; }
+
+  const std::vector<Glyph> &glyphs() const { return glyphs_; }
+
+private:
+  std::vector<Glyph> glyphs_;
+  std::vector<int> line_widths_;
+};
+
+// Draw a text layout with its origin at "x". Line n has its baseline at
+// "y" + n * "line_height". "color" and "background_color" are the same as
+// in DrawText(). The "font" needs to be the one the layout was created with
+// or one with the same character pitch, such as its outline font.
+void DrawTextLayout(Canvas *c, const Font &font, const TextLayout &layout,
+                    int x, int y, int line_height,
+                    const Color &color, const Color *background_color);
+
+// Same, with the fast path of DrawText() for a FrameCanvas.
+void DrawTextLayout(FrameCanvas *c, const Font &font, const TextLayout &layout,
+                    int x, int y, int line_height,
+                    const Color &color, const Color *background_color);
+
+// Draw a text layout with an outline, see DrawOutlinedText().
+void DrawOutlinedTextLayout(Canvas *c, const Font &font,
+                            const TextLayout &layout,
+                            int x, int y, int line_height,
+                            const Color &color, const Color &outline_color);
+void DrawOutlinedTextLayout(FrameCanvas *c, const Font &font,
+                            const TextLayout &layout,
+                            int x, int y, int line_height,
+                            const Color &color, const Color &outline_color);
+
 // Draw a circle centered at "x", "y", with a radius of "radius" and with "color"
 void DrawCircle(Canvas *c, int x, int y, int radius, const Color &color);
 
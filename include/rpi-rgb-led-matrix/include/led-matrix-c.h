@@ -194,6 +194,45 @@ struct RGBLedRuntimeOptions {
   // to. Unless chosen otherwise, the default is "daemon" for user and group.
   const char *drop_priv_user;
   const char *drop_priv_group;
+
+  // Where the output goes: "gpio" (default), "virtual:<directory>" to write
+  // each frame as PPM image, or "null". Flag: --led-backend
+  const char *output_backend;
+
+  // Real-time priority of the refresh thread, 1..99; -1 for normal
+  // scheduling, 0 for automatic. Flag: --led-refresh-priority
+  int refresh_priority;
+  // Bitmask of the CPU cores the refresh thread may run on; 0 for
+  // automatic. Flag: --led-refresh-cpus
+  uint32_t refresh_cpu_mask;
+};
+
+/**
+ * Statistics of the refresh, see led_matrix_get_refresh_stats() and
+ * RGBMatrix::RefreshStats for the details.
+ */
+#define LED_REFRESH_OVERSHOOT_BUCKETS 64
+struct RGBLedRefreshStats {
+  uint64_t refreshes;        // Refresh passes counted.
+
+  // Duration of the passes in microseconds.
+  uint32_t min_refresh_us;
+  uint32_t avg_refresh_us;
+  uint32_t p99_refresh_us;
+  uint32_t max_refresh_us;
+
+  // Microseconds spent in all, sending to the panels and waiting for the
+  // limit_refresh_rate_hz.
+  uint64_t total_refresh_us;
+  uint64_t output_us;
+  uint64_t limit_wait_us;
+
+  uint64_t slow_refreshes;   // Passes longer than limit_refresh_rate_hz.
+  uint64_t late_frames;      // Queued frames shown later than due.
+  uint64_t dropped_frames;   // Queued frames dropped as they were late.
+
+  // Waits for the end of a pulse that overshot by 0, 1, ... microseconds.
+  uint64_t pulse_overshoot[LED_REFRESH_OVERSHOOT_BUCKETS];
 };
 
 /**
@@ -350,8 +389,36 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas);
 
+/**
+ * Queue the canvas to be shown at "present_at_us", a CLOCK_MONOTONIC time in
+ * microseconds; without waiting. If "drop_if_late", it is skipped if the
+ * time of the canvas queued after it has come as well.
+ * Returns false if the queue is full. Don't touch the canvas until you get
+ * it back from led_matrix_reclaim_frame().
+ */
+bool led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                            struct LedCanvas *canvas, int64_t present_at_us,
+                            bool drop_if_late);
+
+/**
+ * Return a canvas that is not shown anymore, waiting up to "timeout_ms"
+ * for one (< 0: forever). NULL if there is none.
+ */
+struct LedCanvas *led_matrix_reclaim_frame(struct RGBLedMatrix *matrix,
+                                           int timeout_ms);
+
+/**
+ * Get the refresh statistics since the start or since the last call with
+ * "reset" set. Returns false if the refresh is not running.
+ */
+bool led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                  struct RGBLedRefreshStats *stats,
+                                  bool reset);
+
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
+void led_matrix_fade_brightness(struct RGBLedMatrix *matrix, uint8_t brightness,
+                                int duration_ms);
 
 // Utility function: set an image from the given buffer containting pixels.
 //
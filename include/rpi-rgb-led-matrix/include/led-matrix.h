@@ -234,6 +234,86 @@ public:
   // time-correct animations.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // -- Presentation queue.
+  // Instead of waiting for each swap, frames can be rendered ahead of time
+  // and queued with the time they are to be shown. A producer that
+  // sometimes takes longer than a frame then doesn't miss the time of the
+  // frames already queued.
+
+  // The number of frames that can be queued and not yet reclaimed.
+  static const int kMaxQueuedFrames = 16;
+
+  // What to do with a frame whose time has come, but so has the time of the
+  // frame queued after it.
+  enum LateFramePolicy {
+    kShowLateFrame,    // Show it for one refresh anyway.
+    kDropLateFrame     // Skip it; it is returned by ReclaimFrame() unshown.
+  };
+
+  // Queue "frame" to be shown at "present_at_us", a CLOCK_MONOTONIC time in
+  // microseconds (e.g. from clock_gettime()). It replaces the frame shown at
+  // the first frame boundary at or after that time. Frames are shown in the
+  // order they are queued, so times should not decrease.
+  //
+  // Returns right away; 'false' if there are already kMaxQueuedFrames
+  // queued frames that have not been reclaimed.
+  //
+  // Don't modify the frame until you get it back from ReclaimFrame(). Also,
+  // don't mix with SwapOnVSync() while frames are queued.
+  bool QueueFrame(FrameCanvas *frame, int64_t present_at_us,
+                  LateFramePolicy late_policy = kShowLateFrame);
+
+  // Returns a frame that is no longer shown, or was dropped, so that it can
+  // be drawn again and queued. That is each queued frame, and also the one
+  // that was shown when the first queued frame replaced it.
+  // If there is none, waits up to "timeout_ms" for one (< 0: forever).
+  // Returns NULL if there is none (yet).
+  FrameCanvas *ReclaimFrame(int timeout_ms = 0);
+
+  // -- Refresh statistics.
+  // To find out how well the panels are refreshed, e.g. to report flicker
+  // problems. The refresh thread keeps these up to date as it goes; that
+  // costs next to nothing, whether they are read or not.
+  struct RefreshStats {
+    RefreshStats();
+
+    uint64_t refreshes;        // Refresh passes counted.
+
+    // Time one refresh pass took in microseconds: the shortest, average,
+    // 99th percentile (rounded up, within 1/16 of it) and the longest.
+    uint32_t min_refresh_us;
+    uint32_t avg_refresh_us;
+    uint32_t p99_refresh_us;
+    uint32_t max_refresh_us;
+
+    // Where the time of the passes went, in microseconds: all of it, sending
+    // the frame to the panels, and waiting to keep to
+    // Options::limit_refresh_rate_hz.
+    uint64_t total_refresh_us;
+    uint64_t output_us;
+    uint64_t limit_wait_us;
+
+    // Passes that took longer than Options::limit_refresh_rate_hz allows.
+    uint64_t slow_refreshes;
+
+    // Queued frames (QueueFrame()) that were not shown at the refresh they
+    // were due at, but later: shown late, or dropped with kDropLateFrame.
+    uint64_t late_frames;
+    uint64_t dropped_frames;
+
+    // How many times waiting for the end of an output enable pulse overshot
+    // by 0, 1, ... and kOvershootBuckets - 1 or more microseconds, as the
+    // operating system woke us up late. Longer pulses show as brighter rows.
+    static const int kOvershootBuckets = 64;
+    uint64_t pulse_overshoot[kOvershootBuckets];
+  };
+
+  // Get the statistics since the refresh started or since the last call
+  // with "reset" set. As the refresh thread is not stopped for this, the
+  // values can be off by the pass that is going on.
+  // Returns 'false' if there is no refresh thread (stats are all 0 then).
+  bool GetRefreshStats(RefreshStats *stats, bool reset = false);
+
   // -- Setting shape and behavior of matrix.
 
   // Apply a pixel mapper. This is used to re-map pixels according to some
@@ -261,11 +341,19 @@ public:
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
 
-  // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // Set brightness in percent, 1%..100%. It is applied while sending the
+  // frames to the panels, so it changes whatever is shown with the next
+  // refresh and does not need anything to be re-drawn; also, the full color
+  // resolution of the PWM bits remains available.
+  // (FrameCanvas::SetBrightness() instead scales colors as they are set.)
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Fade from the current to the given brightness in percent, linearly over
+  // "duration_ms". Runs in the refresh thread, so it is smooth regardless of
+  // what the caller does; returns right away. brightness() is the target.
+  void FadeBrightness(uint8_t brightness, int duration_ms);
+
   //-- GPIO interaction.
   // This library uses the GPIO pins to drive the matrix; this is a safe way
   // to request the 'remaining' bits to be used for user purposes.
@@ -373,6 +461,32 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // -- Fast path for one-colored bitmaps, such as text.
+  //
+  // A bitmap is "height" rows of 8, 16, 32 or 64 bit, the leftmost pixel
+  // being the most significant bit (see Font::PackedGlyph). All set pixels of
+  // all bitmaps are drawn in the given color, which is converted to the
+  // internal representation only once; unset pixels are left alone.
+  struct Bitmap {
+    const void *rows;
+    int row_bits;
+    int height;
+    int x, y;     // Top left corner.
+  };
+  void DrawBitmaps(const Bitmap *bitmaps, int count,
+                   uint8_t red, uint8_t green, uint8_t blue);
+
+  // -- Fast path for images.
+  //
+  // Set "width" pixels of row "y", starting at "x", from "pixels": three
+  // bytes per pixel, red, green, blue (or blue, green, red if "is_bgr").
+  // Same result as SetPixel() for each of them, but wherever the pixel
+  // mapping keeps neighboring pixels next to each other, these are
+  // converted to the internal representation all at once, using vector
+  // instructions where available. Also used by SetPixels().
+  void SetPixelRow(int x, int y, int width, const uint8_t *pixels,
+                   bool is_bgr = false);
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -435,6 +549,26 @@ struct RuntimeOptions {
   // to. Unless chosen otherwise, the default is "daemon" for user and group.
   const char *drop_priv_user;
   const char *drop_priv_group;
+
+  // Where the output goes. Default "gpio": the panels connected to the GPIO.
+  // Without hardware, e.g. to run or benchmark on any Linux machine:
+  //   "virtual:<directory>" : refresh with the timing of real panels, write
+  //                           each new frame as shown as PPM image to the
+  //                           directory (which needs to be writable after
+  //                           dropping privileges).
+  //   "null"                : refresh as fast as possible, output discarded.
+  const char *output_backend;   // Flag: --led-backend
+
+  // Placement of the thread refreshing the panels.
+  //
+  // Real-time priority (SCHED_FIFO) of the refresh thread, 1..99.
+  // -1 for normal scheduling. 0 (default) chooses automatically: 99 if
+  // panels are connected, normal scheduling with the other backends.
+  int refresh_priority;   // Flag: --led-refresh-priority
+  // Bitmask of the CPU cores the refresh thread may run on, e.g. (1<<3) for
+  // core 3. 0 (default) chooses automatically: the last core of a Raspberry
+  // Pi with 4 cores if panels are connected, any core otherwise.
+  uint32_t refresh_cpu_mask;  // Flag: --led-refresh-cpus
 };
 
 // Convenience utility functions to read standard rgb-matrix flags and create
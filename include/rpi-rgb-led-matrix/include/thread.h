@@ -19,6 +19,8 @@
 #include <stdint.h>
 #include <pthread.h>
 
+#include <atomic>
+
 namespace rgb_matrix {
 // Simple thread abstraction.
 class Thread {
@@ -81,6 +83,29 @@ private:
   Mutex *const mutex_;
 };
 
+// A counter that other threads can wait on to change. Notify() never
+// blocks and only enters the kernel if someone is actually waiting, so it can
+// be called from a real-time thread.
+class EventCounter {
+public:
+  EventCounter() : count_(0), waiters_(0) {}
+
+  // The current count, to pass to WaitChange().
+  uint32_t count() const { return count_.load(); }
+
+  // Increment the count and wake up all waiting threads.
+  void Notify();
+
+  // Wait until the count differs from "seen". If "timeout_ms" is < 0, waits
+  // forever, otherwise until the timeout is reached.
+  // Returns 'true' if the count changed, 'false' if the wait timed out.
+  bool WaitChange(uint32_t seen, long timeout_ms = -1);
+
+private:
+  std::atomic<uint32_t> count_;    // The futex word.
+  std::atomic<uint32_t> waiters_;
+};
+
 }  // end namespace rgb_matrix
 
 #endif  // RPI_THREAD_H
@@ -21,30 +21,142 @@
 
 #include "graphics.h"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <bitset>
+#include <map>
+#include <string>
 #include <vector>
 
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 
 namespace rgb_matrix {
-// Bitmap for one row. This limits the number of available columns.
-// Make wider if running into trouble.
+// Widest bitmap we read from a bdf file. Make wider if running into trouble.
 static constexpr int kMaxFontWidth = 196;
-typedef std::bitset<kMaxFontWidth> rowbitmap_t;
 
+// Widest glyph we can represent in a PackedGlyph row.
+static constexpr int kMaxPackedWidth = 64;
+
+// Width of the outline around glyphs, see CreateOutlineFont().
+static constexpr int kOutlineBorder = 1;
+
+// Codepoints below this are looked up in a table, the others with a binary
+// search.
+static constexpr uint32_t kDirectCodepoints = 256;
+
+// The glyphs are stored as they are in the cache file, so this must not
+// change without changing kCacheVersion.
 struct Font::Glyph {
-  int device_width, device_height;
-  int width, height;
-  int x_offset, y_offset;
-  std::vector<rowbitmap_t> bitmap;  // contains 'height' elements.
+  uint32_t codepoint;
+  int16_t device_width, device_height;
+  int16_t width, height;
+  int16_t x_offset, y_offset;
+  int16_t bitmap_width;   // Pixels in each row of "bitmap".
+  int16_t unused;
+  // Byte offsets of the rows, which are 8, 16, 32 bit or a number of 64 bit
+  // words wide, whatever fits the width (see RowBytes()). The leftmost pixel
+  // is the most significant bit (of the first word).
+  int32_t bitmap;         // "height" rows of the whole bitmap.
+  int32_t packed;         // "height" rows, cut to device_width, or -1 if too
+                          // wide to pack.
+  int32_t outline;        // The "height"+2 rows of the outline, cut to
+                          // device_width+2, or -1.
 };
 
+// The cache file is this header, followed by the index of the glyphs of the
+// codepoints below kDirectCodepoints, the glyphs and then the rows. The same
+// layout is used in memory.
+struct FontCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;        // kByteOrderMark as written on this machine.
+  uint64_t checksum;          // Of everything following the header.
+  uint64_t source_size;       // Size and modification time of the bdf file,
+  int64_t source_mtime_sec;   // to tell if the cache is still up to date.
+  int64_t source_mtime_nsec;
+  int32_t font_height;
+  int32_t base_line;
+  uint32_t glyph_count;
+  uint32_t row_bytes;         // Size of all rows, padded to 8 bytes.
+};
+
+static const char kCacheMagic[8] = "BDFFONT";
+static const uint32_t kCacheVersion = 2;
+static const uint32_t kByteOrderMark = 0x01020304;
+static const char kCacheSuffix[] = ".cache";
+
+static int WordsFor(int pixels) { return (pixels + 63) / 64; }
+
+// Bytes needed for a row of "pixels".
+static int RowBytes(int pixels) {
+  if (pixels <= 8) return 1;
+  if (pixels <= 16) return 2;
+  if (pixels <= 32) return 4;
+  return 8 * WordsFor(pixels);
+}
+
+// Only keep the leftmost "width" pixels of a row.
+static uint64_t LeftmostPixels(int width) {
+  if (width <= 0) return 0;
+  return width >= 64 ? ~0ULL : ~(~0ULL >> width);
+}
+
+// 64 bit word "i" of a row that is "row_bytes" wide.
+static uint64_t RowWord(const uint8_t *row, int row_bytes, int i) {
+  if (row_bytes < 8) return GetBitmapRow(row, 8 * row_bytes, 0);
+  return ((const uint64_t*)row)[i];
+}
+
+// Word "i" of "words" long "row" shifted right by 0 or more pixels.
+static uint64_t ShiftedWord(const uint64_t *row, int words, int i, int shift) {
+  uint64_t result = (i < words) ? row[i] >> shift : 0;
+  if (shift > 0 && i > 0 && i - 1 < words)
+    result |= row[i - 1] << (64 - shift);
+  return result;
+}
+
+// Append the rows given as "words" long 64 bit words, cut to "width" pixels,
+// in the width RowBytes() chooses. Returns their offset.
+static int32_t AppendRows(const uint64_t *rows, int height, int words,
+                          int width, std::vector<uint8_t> *out) {
+  const int row_bytes = RowBytes(width);
+  const int alignment = std::min(row_bytes, 8);
+  out->resize((out->size() + alignment - 1) / alignment * alignment);
+  const int32_t offset = out->size();
+  out->resize(offset + height * row_bytes);
+  uint8_t *dest = out->data() + offset;
+  for (int y = 0; y < height; ++y, dest += row_bytes) {
+    const uint64_t *row = rows + y * words;
+    const uint64_t first = row[0] & LeftmostPixels(width);
+    switch (row_bytes) {
+    case 1: *dest = first >> 56; break;
+    case 2: *(uint16_t*)dest = first >> 48; break;
+    case 4: *(uint32_t*)dest = first >> 32; break;
+    default:
+      for (int i = 0; i < row_bytes / 8; ++i)
+        ((uint64_t*)dest)[i] = row[i] & LeftmostPixels(width - 64 * i);
+    }
+  }
+  return offset;
+}
+
+// FNV-1a, but taking a whole word at a time.
+static uint64_t Checksum(const uint64_t *words, size_t count) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < count; ++i) {
+    hash ^= words[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
 static bool readNibble(char c, uint8_t* val) {
   if (c >= '0' && c <= '9') { *val = c - '0'; return true; }
   if (c >= 'a' && c <= 'f') { *val = c - 'a' + 0xa; return true; }
@@ -52,127 +164,455 @@ static bool readNibble(char c, uint8_t* val) {
   return false;
 }
 
-static bool parseBitmap(const char *buffer, rowbitmap_t* result) {
+static bool parseBitmap(const char *buffer, int width, uint64_t *result) {
   // Read the bitmap left-aligned to our buffer.
-  for (int pos = result->size() - 1; *buffer && pos >= 3; buffer+=1) {
+  for (int pos = 0; *buffer && pos + 4 <= width; buffer+=1, pos += 4) {
     uint8_t val;
     if (!readNibble(*buffer, &val))
       break;
-    (*result)[pos--] = val & 0x8;
-    (*result)[pos--] = val & 0x4;
-    (*result)[pos--] = val & 0x2;
-    (*result)[pos--] = val & 0x1;
+    result[pos / 64] |= (uint64_t)val << (60 - pos % 64);
   }
   return true;
 }
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+Font::Font() : font_height_(-1), base_line_(0), block_(NULL), block_size_(0),
+               direct_glyphs_(NULL), glyphs_(NULL), glyph_count_(0),
+               direct_count_(0), rows_(NULL), data_(NULL), mapped_size_(0) {}
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    delete it->second;
-  }
+  Unload();
+}
+
+void Font::Unload() {
+  if (mapped_size_ > 0)
+    munmap(data_, mapped_size_);
+  else
+    free(data_);
+  font_height_ = -1;
+  base_line_ = 0;
+  block_ = NULL;
+  block_size_ = 0;
+  direct_glyphs_ = NULL;
+  glyphs_ = NULL;
+  glyph_count_ = 0;
+  direct_count_ = 0;
+  rows_ = NULL;
+  data_ = NULL;
+  mapped_size_ = 0;
+}
+
+namespace {
+struct EmbeddedFont {
+  const void *data;
+  size_t size;
+};
+typedef std::map<std::string, EmbeddedFont> EmbeddedFontByName;
+
+static EmbeddedFontByName *GetEmbeddedFonts() {
+  static EmbeddedFontByName *singleton_instance = new EmbeddedFontByName();
+  return singleton_instance;
+}
+}  // anonymous namespace
+
+void RegisterEmbeddedFont(const char *name, const void *data, size_t size) {
+  const EmbeddedFont font = { data, size };
+  (*GetEmbeddedFonts())[name] = font;
+}
+
+// If the cache made from a bdf file with "source" status is up to date.
+static bool IsFresh(const FontCacheHeader *header, const struct stat &source) {
+  return header->source_size == (uint64_t)source.st_size
+    && header->source_mtime_sec == source.st_mtim.tv_sec
+    && header->source_mtime_nsec == source.st_mtim.tv_nsec;
 }
 
-// TODO: that might not be working for all input files yet.
 bool Font::LoadFont(const char *path) {
   if (!path || !*path) return false;
+  Unload();
+  struct stat source;
+  const bool have_source = (stat(path, &source) == 0);
+  return UseEmbeddedFont(path, have_source ? &source : NULL)
+    || (have_source && MapCacheFile(path, source))
+    || ReadBDF(path);
+}
+
+bool Font::UseEmbeddedFont(const char *path, const struct stat *source) {
+  const char *const slash = strrchr(path, '/');
+  const EmbeddedFontByName *fonts = GetEmbeddedFonts();
+  EmbeddedFontByName::const_iterator found
+    = fonts->find(slash ? slash + 1 : path);
+  if (found == fonts->end())
+    return false;
+  const EmbeddedFont &font = found->second;
+  if ((source && !IsFresh((const FontCacheHeader*) font.data, *source))
+      || !IsValidData(font.data, font.size)) {
+    return false;
+  }
+  UseData(font.data, font.size);
+  return true;
+}
+
+void Font::Serialize(const char **data, size_t *len) const {
+  *data = (const char*) block_;
+  *len = block_size_;
+}
+
+// TODO: that might not be working for all input files yet.
+bool Font::ReadBDF(const char *path) {
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
+  struct stat source;
+  if (fstat(fileno(f), &source) != 0) {
+    fclose(f);
+    return false;
+  }
   uint32_t codepoint;
   char buffer[1024];
   int dummy;
-  Glyph tmp;
-  Glyph *current_glyph = NULL;
+  int font_height = -1, base_line = 0;
+  int device_width = 0, device_height = 0;
+  int width = 0, height = 0, x_offset = 0, y_offset = 0;
+  std::vector<Glyph> glyphs;
+  std::vector<uint64_t> bitmaps;
+  Glyph current_glyph = Glyph();
+  int words_per_row = 0;
+  bool in_glyph = false;
   int row = 0;
 
   while (fgets(buffer, sizeof(buffer), f)) {
     if (sscanf(buffer, "FONTBOUNDINGBOX %d %d %d %d",
-               &dummy, &font_height_, &dummy, &base_line_) == 4) {
-      base_line_ += font_height_;
+               &dummy, &font_height, &dummy, &base_line) == 4) {
+      base_line += font_height;
     }
     else if (sscanf(buffer, "ENCODING %ud", &codepoint) == 1) {
       // parsed.
     }
-    else if (sscanf(buffer, "DWIDTH %d %d", &tmp.device_width, &tmp.device_height
+    else if (sscanf(buffer, "DWIDTH %d %d", &device_width, &device_height
                     ) == 2) {
-      // Limit to width we can actually display, limited by rowbitmap_t
-      tmp.device_width = std::min(tmp.device_width, kMaxFontWidth);
+      // Limit to width we can actually display, limited by kMaxFontWidth
+      device_width = std::min(device_width, kMaxFontWidth);
       // parsed.
     }
-    else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
-                    &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = new Glyph();
-      *current_glyph = tmp;
-      current_glyph->bitmap.resize(tmp.height);
+    else if (sscanf(buffer, "BBX %d %d %d %d", &width, &height,
+                    &x_offset, &y_offset) == 4) {
+      Glyph &g = current_glyph;
+      g.device_width = device_width;
+      g.device_height = device_height;
+      g.width = width;
+      g.height = std::max(height, 0);
+      g.x_offset = x_offset;
+      g.y_offset = y_offset;
+      // Bitmap rows in the file are padded to full bytes.
+      g.bitmap_width = std::min(kMaxFontWidth,
+                                std::max(device_width, (width + 7) / 8 * 8));
+      words_per_row = WordsFor(g.bitmap_width);
+      g.bitmap = bitmaps.size();
+      bitmaps.resize(bitmaps.size() + g.height * words_per_row, 0);
+      in_glyph = true;
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && parseBitmap(buffer, &current_glyph->bitmap[row])) {
+    else if (in_glyph && row >= 0 && row < current_glyph.height
+             && parseBitmap(buffer, current_glyph.bitmap_width,
+                            &bitmaps[current_glyph.bitmap
+                                     + row * words_per_row])) {
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        delete glyphs_[codepoint];  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
-        current_glyph = NULL;
+      if (in_glyph && row == current_glyph.height) {
+        current_glyph.codepoint = codepoint;
+        glyphs.push_back(current_glyph);
+        in_glyph = false;
       }
     }
   }
   fclose(f);
+  SetGlyphs(font_height, base_line, glyphs, bitmaps);
+  // Recorded so that a cache file made from this can tell if it is fresh.
+  // The checksum doesn't include the header, so is still valid.
+  FontCacheHeader *header = (FontCacheHeader*) data_;
+  header->source_size = source.st_size;
+  header->source_mtime_sec = source.st_mtim.tv_sec;
+  header->source_mtime_nsec = source.st_mtim.tv_nsec;
+  return true;
+}
+
+// The pixels tracing around the given bitmap. The outline is 2*kOutlineBorder
+// rows higher and wider than the bitmap and starts kOutlineBorder pixels left
+// of and above it.
+static void TraceOutline(const uint64_t *bitmap, int height, int words,
+                         uint64_t *outline, int outline_words) {
+  std::fill(outline, outline + (height + 2*kOutlineBorder) * outline_words, 0);
+  for (int h = 0; h < height; ++h) {
+    const uint64_t *row = bitmap + h * words;
+    for (int i = 0; i < outline_words; ++i) {
+      const uint64_t fill = ShiftedWord(row, words, i, 0)
+        | ShiftedWord(row, words, i, 1) | ShiftedWord(row, words, i, 2);
+      outline[(h + kOutlineBorder - 1) * outline_words + i] |= fill;
+      outline[(h + kOutlineBorder + 0) * outline_words + i] |= fill;
+      outline[(h + kOutlineBorder + 1) * outline_words + i] |= fill;
+    }
+  }
+  // Remove original font again.
+  for (int h = 0; h < height; ++h) {
+    for (int i = 0; i < outline_words; ++i) {
+      outline[(h + kOutlineBorder) * outline_words + i]
+        &= ~ShiftedWord(bitmap + h * words, words, i, kOutlineBorder);
+    }
+  }
+}
+
+// Set the font to the given glyphs. While building, their bitmaps are
+// indices into "bitmaps", with rows of as many 64 bit words as needed.
+// The glyphs are sorted and their rows are stored as narrow as their width
+// allows; for the ones that are narrow enough, also cut to their device
+// width and together with their outline. Done once when the font is
+// created, so lookups don't need any locking.
+void Font::SetGlyphs(int font_height, int base_line,
+                     const std::vector<Glyph> &glyphs,
+                     const std::vector<uint64_t> &bitmaps) {
+  std::vector<Glyph> sorted(glyphs);
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const Glyph &a, const Glyph &b) {
+                     return a.codepoint < b.codepoint;
+                   });
+  std::vector<Glyph> unique;  // If a codepoint is repeated, the last wins.
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    if (i + 1 == sorted.size() || sorted[i+1].codepoint != sorted[i].codepoint)
+      unique.push_back(sorted[i]);
+  }
+
+  std::vector<int16_t> direct(kDirectCodepoints, -1);
+  std::vector<uint8_t> rows;
+  std::vector<uint64_t> outline;
+  for (size_t i = 0; i < unique.size(); ++i) {
+    Glyph &g = unique[i];
+    if (g.codepoint < kDirectCodepoints)
+      direct[g.codepoint] = i;
+    const int words = WordsFor(g.bitmap_width);
+    const uint64_t *bitmap = bitmaps.data() + g.bitmap;
+    g.bitmap = AppendRows(bitmap, g.height, words, g.bitmap_width, &rows);
+    g.packed = g.outline = -1;
+    if (g.device_width > kMaxPackedWidth)
+      continue;
+
+    // Without pixels right of the device width, the bitmap is packed already.
+    const uint64_t mask = LeftmostPixels(g.device_width);
+    bool already_packed = (RowBytes(g.bitmap_width)
+                           == RowBytes(g.device_width));
+    for (int y = 0; already_packed && y < g.height; ++y)
+      already_packed = ((bitmap[y * words] & ~mask) == 0);
+    g.packed = already_packed
+      ? g.bitmap
+      : AppendRows(bitmap, g.height, words, g.device_width, &rows);
+
+    const int outline_width = g.device_width + 2 * kOutlineBorder;
+    if (outline_width > kMaxPackedWidth)
+      continue;
+    const int outline_words = WordsFor(g.bitmap_width + 2 * kOutlineBorder);
+    outline.resize((g.height + 2 * kOutlineBorder) * outline_words);
+    TraceOutline(bitmap, g.height, words, outline.data(), outline_words);
+    g.outline = AppendRows(outline.data(), g.height + 2 * kOutlineBorder,
+                           outline_words, outline_width, &rows);
+  }
+  rows.resize((rows.size() + 7) / 8 * 8, 0);
+
+  const size_t direct_bytes = direct.size() * sizeof(int16_t);
+  const size_t glyph_bytes = unique.size() * sizeof(Glyph);
+  const size_t size = sizeof(FontCacheHeader) + direct_bytes + glyph_bytes
+    + rows.size();
+  char *data = (char*) malloc(size);
+  FontCacheHeader *header = (FontCacheHeader*) data;
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, kCacheMagic, sizeof(header->magic));
+  header->version = kCacheVersion;
+  header->byte_order = kByteOrderMark;
+  header->font_height = font_height;
+  header->base_line = base_line;
+  header->glyph_count = unique.size();
+  header->row_bytes = rows.size();
+  char *pos = data + sizeof(*header);
+  memcpy(pos, direct.data(), direct_bytes);
+  pos += direct_bytes;
+  memcpy(pos, unique.data(), glyph_bytes);
+  pos += glyph_bytes;
+  memcpy(pos, rows.data(), rows.size());
+  header->checksum = Checksum((const uint64_t*)(data + sizeof(*header)),
+                              (size - sizeof(*header)) / sizeof(uint64_t));
+  UseData(data, size);
+  data_ = data;
+}
+
+void Font::UseData(const void *data, size_t size) {
+  const FontCacheHeader *header = (const FontCacheHeader*) data;
+  block_ = data;
+  block_size_ = size;
+  font_height_ = header->font_height;
+  base_line_ = header->base_line;
+  direct_glyphs_ = (const int16_t*)(header + 1);
+  glyphs_ = (const Glyph*)(direct_glyphs_ + kDirectCodepoints);
+  glyph_count_ = header->glyph_count;
+  rows_ = (const uint8_t*)(glyphs_ + glyph_count_);
+  direct_count_ = 0;
+  while (direct_count_ < glyph_count_
+         && glyphs_[direct_count_].codepoint < kDirectCodepoints) {
+    ++direct_count_;
+  }
+}
+
+// Check that all rows of "rows_count" rows of "width" pixels at "offset" are
+// within "row_bytes".
+static bool RowsInRange(int32_t offset, int rows_count, int width,
+                        uint32_t row_bytes) {
+  const int bytes = RowBytes(width);
+  return offset >= 0 && offset % std::min(bytes, 8) == 0
+    && offset + (int64_t)rows_count * bytes <= row_bytes;
+}
+
+bool Font::MapCacheFile(const char *path, const struct stat &source) {
+  const std::string cache_path = std::string(path) + kCacheSuffix;
+  const int fd = open(cache_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat cache;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &cache) == 0
+      && cache.st_size >= (off_t)sizeof(FontCacheHeader))
+    data = mmap(NULL, cache.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  const size_t size = cache.st_size;
+  if (!IsFresh((const FontCacheHeader*) data, source)
+      || !IsValidData(data, size)) {
+    munmap(data, size);
+    return false;
+  }
+  UseData(data, size);
+  data_ = data;
+  mapped_size_ = size;
+  return true;
+}
+
+// Check a cache file or embedded font, making sure that all indices and
+// rows are within "size".
+bool Font::IsValidData(const void *data, size_t size) {
+  if (size < sizeof(FontCacheHeader) || size % sizeof(uint64_t) != 0)
+    return false;
+  const FontCacheHeader *header = (const FontCacheHeader*) data;
+  const size_t payload_words = (size - sizeof(*header)) / sizeof(uint64_t);
+  bool valid = memcmp(header->magic, kCacheMagic, sizeof(header->magic)) == 0
+    && header->version == kCacheVersion
+    && header->byte_order == kByteOrderMark
+    && size == (sizeof(*header) + kDirectCodepoints * sizeof(int16_t)
+                + header->glyph_count * sizeof(Glyph) + header->row_bytes)
+    && header->checksum == Checksum((const uint64_t*)(header + 1),
+                                    payload_words);
+  const int16_t *direct = (const int16_t*)(header + 1);
+  const Glyph *glyphs = (const Glyph*)(direct + kDirectCodepoints);
+  const uint32_t glyph_count = valid ? header->glyph_count : 0;
+  for (uint32_t c = 0; valid && c < kDirectCodepoints; ++c) {
+    valid = direct[c] == -1
+      || (direct[c] >= 0 && (uint32_t)direct[c] < glyph_count
+          && glyphs[direct[c]].codepoint == c);
+  }
+  for (uint32_t i = 0; valid && i < glyph_count; ++i) {
+    const Glyph &g = glyphs[i];
+    valid = g.height >= 0 && g.bitmap_width <= kMaxFontWidth
+      && g.device_width <= g.bitmap_width
+      && RowsInRange(g.bitmap, g.height, g.bitmap_width, header->row_bytes)
+      && (g.packed == -1
+          || (g.device_width <= kMaxPackedWidth
+              && RowsInRange(g.packed, g.height, g.device_width,
+                             header->row_bytes)))
+      && (g.outline == -1
+          || (g.device_width + 2 * kOutlineBorder <= kMaxPackedWidth
+              && RowsInRange(g.outline, g.height + 2 * kOutlineBorder,
+                             g.device_width + 2 * kOutlineBorder,
+                             header->row_bytes)))
+      && (i == 0 || glyphs[i-1].codepoint < g.codepoint)
+      && (g.codepoint >= kDirectCodepoints || direct[g.codepoint] == (int)i);
+  }
+  return valid;
+}
+
+bool Font::CreateCacheFile(const char *path) {
+  Font font;
+  if (!path || !font.ReadBDF(path))
+    return false;
+
+  // Write to a temporary file and rename, so that LoadFont() never sees a
+  // partial file.
+  const std::string cache_path = std::string(path) + kCacheSuffix;
+  const std::string tmp_path = cache_path + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "wb");
+  if (out == NULL)
+    return false;
+  bool success = (fwrite(font.block_, 1, font.block_size_, out)
+                  == font.block_size_);
+  success &= (fclose(out) == 0);
+  if (!success || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
   return true;
 }
 
 Font *Font::CreateOutlineFont() const {
   Font *r = new Font();
-  const int kBorder = 1;
-  r->font_height_ = font_height_ + 2*kBorder;
-  r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    const Glyph *orig = it->second;
+  const int kBorder = kOutlineBorder;
+  std::vector<Glyph> glyphs;
+  std::vector<uint64_t> bitmaps;
+  std::vector<uint64_t> orig_bitmap;
+  for (size_t i = 0; i < glyph_count_; ++i) {
+    const Glyph *orig = &glyphs_[i];
     const int height = orig->height + 2 * kBorder;
-    Glyph *const tmp_glyph = new Glyph();
-    tmp_glyph->bitmap.resize(height);
-    tmp_glyph->width  = orig->width  + 2*kBorder;
-    tmp_glyph->height = height;
-    tmp_glyph->device_width  = orig->device_width + 2*kBorder;
-    tmp_glyph->device_height = height;
-    tmp_glyph->y_offset = orig->y_offset - kBorder;
+    Glyph tmp_glyph = *orig;
+    tmp_glyph.width  = orig->width  + 2*kBorder;
+    tmp_glyph.height = height;
+    tmp_glyph.device_width  = orig->device_width + 2*kBorder;
+    tmp_glyph.device_height = height;
     // TODO: we don't really need bounding box, right ?
-    const rowbitmap_t fill_pattern = 0b111;
-    const rowbitmap_t start_mask   = 0b010;
-    // Fill the border
-    for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t fill = fill_pattern;
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      for (rowbitmap_t m = start_mask; m.any(); m <<= 1, fill <<= 1) {
-        if ((orig_bitmap & m).any()) {
-          tmp_glyph->bitmap[h+kBorder-1] |= fill;
-          tmp_glyph->bitmap[h+kBorder+0] |= fill;
-          tmp_glyph->bitmap[h+kBorder+1] |= fill;
-        }
-      }
-    }
-    // Remove original font again.
-    for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
+    tmp_glyph.x_offset = orig->x_offset - kBorder;
+    tmp_glyph.y_offset = orig->y_offset - kBorder;
+    tmp_glyph.bitmap_width = orig->bitmap_width + 2*kBorder;
+
+    const int words = WordsFor(orig->bitmap_width);
+    const int row_bytes = RowBytes(orig->bitmap_width);
+    orig_bitmap.resize(orig->height * words);
+    for (int y = 0; y < orig->height; ++y) {
+      const uint8_t *row = rows_ + orig->bitmap + y * row_bytes;
+      for (int w = 0; w < words; ++w)
+        orig_bitmap[y * words + w] = RowWord(row, row_bytes, w);
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    const int outline_words = WordsFor(tmp_glyph.bitmap_width);
+    tmp_glyph.bitmap = bitmaps.size();
+    bitmaps.resize(bitmaps.size() + height * outline_words);
+    TraceOutline(orig_bitmap.data(), orig->height, words,
+                 &bitmaps[tmp_glyph.bitmap], outline_words);
+    glyphs.push_back(tmp_glyph);
   }
+  r->SetGlyphs(font_height_ + 2*kBorder, base_line_ + kBorder,
+               glyphs, bitmaps);
   return r;
 }
 
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  if (unicode_codepoint < kDirectCodepoints) {
+    if (direct_glyphs_ == NULL) return NULL;
+    const int index = direct_glyphs_[unicode_codepoint];
+    return index < 0 ? NULL : &glyphs_[index];
+  }
+  const Glyph *begin = glyphs_ + direct_count_;
+  const Glyph *end = glyphs_ + glyph_count_;
+  const Glyph *found = std::lower_bound(
+    begin, end, unicode_codepoint,
+    [](const Glyph &g, uint32_t codepoint) { return g.codepoint < codepoint; });
+  if (found == end || found->codepoint != unicode_codepoint)
     return NULL;
-  return found->second;
+  return found;
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -180,6 +620,54 @@ int Font::CharacterWidth(uint32_t unicode_codepoint) const {
   return g ? g->device_width : -1;
 }
 
+bool Font::GetPackedGlyph(uint32_t unicode_codepoint,
+                          PackedGlyph *result) const {
+  const Glyph *g = FindGlyph(unicode_codepoint);
+  if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
+  if (g == NULL || g->packed < 0) return false;
+  result->rows = rows_ + g->packed;
+  result->row_bits = 8 * RowBytes(g->device_width);
+  if (g->outline < 0) {
+    result->outline_rows = NULL;
+    result->outline_row_bits = 0;
+  } else {
+    result->outline_rows = rows_ + g->outline;
+    result->outline_row_bits
+      = 8 * RowBytes(g->device_width + 2 * kOutlineBorder);
+  }
+  result->height = g->height;
+  result->top = -g->height - g->y_offset;
+  result->advance = g->device_width;
+  return true;
+}
+
+// Set the pixels of the 64 pixels starting at "x" that are set in "pixels".
+static inline void SetRowPixels(Canvas *c, uint64_t pixels, int x, int y,
+                                const Color &color) {
+  while (pixels) {
+    const int col = __builtin_clzll(pixels);
+    pixels &= ~(0x8000000000000000ULL >> col);
+    c->SetPixel(x + col, y, color.r, color.g, color.b);
+  }
+}
+
+// Draw "height" rows that are one "Row" each, cut to "width" pixels. Made
+// for each width of rows, so that reading them needs no case distinction.
+template <typename Row>
+static void DrawGlyphRows(Canvas *c, const uint8_t *rows, int height,
+                          int width, int x, int y, const Color &color,
+                          const Color *bgcolor) {
+  const Row *row = (const Row*) rows;
+  const uint64_t mask = LeftmostPixels(width);
+  for (int r = 0; r < height; ++r) {
+    const uint64_t pixels = ((uint64_t)row[r] << (64 - 8 * sizeof(Row)))
+      & mask;
+    if (bgcolor)
+      SetRowPixels(c, ~pixels & mask, x, y + r, *bgcolor);
+    SetRowPixels(c, pixels, x, y + r, color);
+  }
+}
+
 int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
                     const Color &color, const Color *bgcolor,
                     uint32_t unicode_codepoint) const {
@@ -193,16 +681,39 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
     return g->device_width;  // Outside canvas border. Bail out early.
   }
 
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t& row = g->bitmap[y];
-    for (int x = 0; x < g->device_width; ++x) {
-      if (row.test(kMaxFontWidth - 1 - x)) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-        c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
+  const uint8_t *const rows = rows_ + g->bitmap;
+  const int row_bytes = RowBytes(g->bitmap_width);
+  switch (row_bytes) {
+  case 1:
+    DrawGlyphRows<uint8_t>(c, rows, g->height, g->device_width,
+                           x_pos, y_pos, color, bgcolor);
+    break;
+  case 2:
+    DrawGlyphRows<uint16_t>(c, rows, g->height, g->device_width,
+                            x_pos, y_pos, color, bgcolor);
+    break;
+  case 4:
+    DrawGlyphRows<uint32_t>(c, rows, g->height, g->device_width,
+                            x_pos, y_pos, color, bgcolor);
+    break;
+  case 8:
+    DrawGlyphRows<uint64_t>(c, rows, g->height, g->device_width,
+                            x_pos, y_pos, color, bgcolor);
+    break;
+  default: {  // Wider than 64 pixels: several words per row.
+    const int words = WordsFor(g->device_width);
+    const uint64_t *row = (const uint64_t*) rows;
+    for (int y = 0; y < g->height; ++y, row += row_bytes / 8) {
+      for (int w = 0; w < words; ++w) {
+        const uint64_t mask = LeftmostPixels(g->device_width - 64 * w);
+        const uint64_t pixels = row[w] & mask;
+        if (bgcolor)
+          SetRowPixels(c, ~pixels & mask, x_pos + 64 * w, y_pos + y, *bgcolor);
+        SetRowPixels(c, pixels, x_pos + 64 * w, y_pos + y, color);
       }
     }
   }
+  }
   return g->device_width;
 }
 
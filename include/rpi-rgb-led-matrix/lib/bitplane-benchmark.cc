@@ -0,0 +1,267 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Benchmark of converting images to bitplanes: SetBitplanes() with the
+// vector instructions of this machine against its scalar version, and
+// SetImage() and SetPixels() on a FrameCanvas, which use it, against setting
+// each pixel with Canvas::SetPixel(). Also verifies that all of them result
+// in exactly the same bits, with different pixel mappers, color mappings
+// and clipping at the borders.
+//
+// Runs without hardware access:
+//   make bench
+//   ./bitplane-benchmark
+
+#include "led-matrix.h"
+#include "graphics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "bitplane-kernel.h"
+#include "framebuffer-internal.h"
+
+using namespace rgb_matrix;
+using internal::Framebuffer;
+using internal::ColorBits;
+
+static int64_t GetMonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static std::string Content(const FrameCanvas *c) {
+  const char *data;
+  size_t len;
+  c->Serialize(&data, &len);
+  return std::string(data, len);
+}
+
+static std::vector<uint8_t> RandomImage(int width, int height) {
+  std::vector<uint8_t> image(3 * width * height);
+  for (size_t i = 0; i < image.size(); ++i) image[i] = random();
+  return image;
+}
+
+// SetBitplanes() needs to write the same as the scalar version for any run
+// length, bitplane range, colors (including inverted ones, with the bits
+// above the bitplanes set) and designator.
+static bool CheckKernel() {
+  const int kStride = 80;
+  std::vector<gpio_bits_t> reference(kStride * Framebuffer::kBitPlanes);
+  std::vector<gpio_bits_t> test(reference.size());
+  uint16_t red[kStride], green[kStride], blue[kStride];
+  for (int count = 0; count <= 67; ++count) {
+    for (int first_plane = 0; first_plane < Framebuffer::kBitPlanes;
+         ++first_plane) {
+      ColorBits d;
+      d.r_bit = random();
+      d.g_bit = random();
+      d.b_bit = random();
+      d.mask = ~(d.r_bit | d.g_bit | d.b_bit);
+      for (int i = 0; i < count; ++i) {
+        red[i] = random();
+        green[i] = random();
+        blue[i] = random();
+      }
+      for (size_t i = 0; i < reference.size(); ++i)
+        reference[i] = test[i] = random();
+      const int offset = count % 5;   // Also unaligned.
+      internal::SetBitplanesScalar(red, green, blue, count, d, first_plane,
+                                   Framebuffer::kBitPlanes,
+                                   reference.data() + offset, kStride);
+      internal::SetBitplanes(red, green, blue, count, d, first_plane,
+                             Framebuffer::kBitPlanes,
+                             test.data() + offset, kStride);
+      if (reference != test) {
+        fprintf(stderr, "MISMATCH: SetBitplanes() (%s) count=%d "
+                "first-plane=%d\n", internal::BitplaneKernelName(),
+                count, first_plane);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+struct Setup {
+  int cols, rows, chain, parallel, multiplexing;
+  bool inverse_colors;
+  const char *pixel_mapper;
+};
+static const Setup kSetups[] = {
+  { 64, 32, 6, 1, 0, false, "" },
+  { 64, 64, 1, 3, 0, false, "" },
+  { 32, 16, 4, 2, 0, true, "" },
+  { 32, 32, 4, 1, 0, false, "U-mapper" },
+  { 64, 32, 2, 1, 0, false, "Rotate:90" },
+  { 64, 32, 2, 2, 0, false, "Mirror:H;Rotate:180" },
+  { 32, 16, 3, 1, 1, false, "" },
+};
+
+static RGBMatrix *CreateMatrix(const Setup &s) {
+  RGBMatrix::Options options;
+  options.cols = s.cols;
+  options.rows = s.rows;
+  options.chain_length = s.chain;
+  options.parallel = s.parallel;
+  options.multiplexing = s.multiplexing;
+  options.inverse_colors = s.inverse_colors;
+  options.pixel_mapper_config = s.pixel_mapper;
+  options.hardware_mapping = "regular";   // Supports parallel chains.
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;   // Only render to memory.
+  runtime.drop_privileges = 0;
+  return RGBMatrix::CreateFromOptions(options, runtime);
+}
+
+// The bulk paths need to produce the same bits as setting each pixel.
+static bool CheckImages(const Setup &s) {
+  RGBMatrix *matrix = CreateMatrix(s);
+  if (matrix == NULL) {
+    fprintf(stderr, "Couldn't create matrix for '%s'\n", s.pixel_mapper);
+    return false;
+  }
+  FrameCanvas *reference = matrix->CreateFrameCanvas();
+  FrameCanvas *test = matrix->CreateFrameCanvas();
+  const int width = reference->width() + 9;
+  const int height = reference->height() + 5;
+  const std::vector<uint8_t> image = RandomImage(width, height);
+  const int offsets[][2] = { {0, 0}, {-7, -3}, {5, 9}, {-20, 2} };
+  const int pwm_bits[] = { 11, 7, 1 };
+  bool success = true;
+  for (int lum = 0; success && lum < 2; ++lum) {
+    for (size_t p = 0; p < sizeof(pwm_bits) / sizeof(pwm_bits[0]); ++p) {
+      FrameCanvas *canvases[] = { reference, test };
+      for (int i = 0; i < 2; ++i) {
+        canvases[i]->set_luminance_correct(lum);
+        canvases[i]->SetPWMBits(pwm_bits[p]);
+        canvases[i]->SetBrightness(lum ? 100 : 60);
+      }
+      for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); ++o) {
+        for (int bgr = 0; bgr < 2; ++bgr) {
+          reference->Fill(0, 0, 80);
+          test->Fill(0, 0, 80);
+          SetImage(static_cast<Canvas*>(reference), offsets[o][0],
+                   offsets[o][1], image.data(), image.size(), width, height,
+                   bgr);
+          SetImage(test, offsets[o][0], offsets[o][1], image.data(),
+                   image.size(), width, height, bgr);
+          if (Content(reference) != Content(test)) {
+            fprintf(stderr, "MISMATCH: SetImage() %dx%d chain=%d "
+                    "parallel=%d mapper='%s'; luminance-correct=%d "
+                    "pwm-bits=%d offset=%d,%d bgr=%d\n", s.cols, s.rows,
+                    s.chain, s.parallel, s.pixel_mapper, lum, pwm_bits[p],
+                    offsets[o][0], offsets[o][1], bgr);
+            success = false;
+          }
+        }
+
+        // SetPixels() from the same colors.
+        const int x = offsets[o][0], y = offsets[o][1];
+        const Color *colors = (const Color*) image.data();
+        reference->Clear();
+        test->Clear();
+        for (int iy = 0; iy < height; ++iy) {
+          for (int ix = 0; ix < width; ++ix, ++colors) {
+            reference->SetPixel(x + ix, y + iy,
+                                colors->r, colors->g, colors->b);
+          }
+        }
+        test->SetPixels(x, y, width, height, (Color*) image.data());
+        if (Content(reference) != Content(test)) {
+          fprintf(stderr, "MISMATCH: SetPixels() mapper='%s' offset=%d,%d\n",
+                  s.pixel_mapper, x, y);
+          success = false;
+        }
+      }
+    }
+  }
+  delete matrix;
+  return success;
+}
+
+template <typename Function>
+static double NanosPerCall(int iterations, const Function &f) {
+  const int64_t start = GetMonotonicNanos();
+  for (int i = 0; i < iterations; ++i) f();
+  return (GetMonotonicNanos() - start) / (double)iterations;
+}
+
+static void Print(const char *name, double ns, double baseline_ns) {
+  printf("  %-42s %8.1f usec  (%.1fx)\n", name, ns / 1000, baseline_ns / ns);
+}
+
+int main(int argc, char *argv[]) {
+  srandom(42);
+  if (!CheckKernel())
+    return 1;
+  for (size_t s = 0; s < sizeof(kSetups) / sizeof(kSetups[0]); ++s) {
+    if (!CheckImages(kSetups[s]))
+      return 1;
+  }
+
+  // The bitplanes of one chain of 64x32 panels, 64 pixels at a time.
+  const int kColumns = 384;
+  const int kRows = 16;
+  std::vector<gpio_bits_t> bits(kColumns * Framebuffer::kBitPlanes * kRows);
+  std::vector<uint16_t> colors(3 * kColumns * kRows);
+  for (size_t i = 0; i < colors.size(); ++i) colors[i] = random() & 0x7ff;
+  ColorBits d;
+  d.r_bit = 1 << 5;
+  d.g_bit = 1 << 13;
+  d.b_bit = 1 << 6;
+  d.mask = ~(d.r_bit | d.g_bit | d.b_bit);
+  const uint16_t *const red = colors.data();
+  const uint16_t *const green = red + kColumns * kRows;
+  const uint16_t *const blue = green + kColumns * kRows;
+  const int plane_row = kColumns * Framebuffer::kBitPlanes;
+  printf("%dx%d bitplanes, pwm-bits=11, SetBitplanes() using %s:\n",
+         kColumns, kRows, internal::BitplaneKernelName());
+  const double scalar_ns = NanosPerCall(2000, [&]() {
+      for (int i = 0; i < kColumns * kRows; i += 64) {
+        internal::SetBitplanesScalar(red + i, green + i, blue + i, 64, d,
+                                     0, Framebuffer::kBitPlanes,
+                                     bits.data() + (i / kColumns) * plane_row
+                                     + i % kColumns, kColumns);
+      }
+    });
+  Print("SetBitplanesScalar()", scalar_ns, scalar_ns);
+  Print("SetBitplanes()", NanosPerCall(2000, [&]() {
+        for (int i = 0; i < kColumns * kRows; i += 64) {
+          internal::SetBitplanes(red + i, green + i, blue + i, 64, d,
+                                 0, Framebuffer::kBitPlanes,
+                                 bits.data() + (i / kColumns) * plane_row
+                                 + i % kColumns, kColumns);
+        }
+      }), scalar_ns);
+
+  RGBMatrix *matrix = CreateMatrix(kSetups[0]);
+  if (matrix == NULL)
+    return 1;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+  const std::vector<uint8_t> image = RandomImage(width, height);
+  printf("%dx%d image, pwm-bits=11:\n", width, height);
+  const double generic_ns = NanosPerCall(200, [&]() {
+      SetImage(static_cast<Canvas*>(canvas), 0, 0, image.data(),
+               image.size(), width, height, false);
+    });
+  Print("SetImage(), Canvas::SetPixel()", generic_ns, generic_ns);
+  Print("SetImage(), FrameCanvas::SetPixelRow()", NanosPerCall(200, [&]() {
+        SetImage(canvas, 0, 0, image.data(), image.size(), width, height,
+                 false);
+      }), generic_ns);
+  Print("FrameCanvas::SetPixels()", NanosPerCall(200, [&]() {
+        canvas->SetPixels(0, 0, width, height, (Color*) image.data());
+      }), generic_ns);
+
+  delete matrix;
+  return 0;
+}
@@ -0,0 +1,221 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// The vector versions keep a few pixels' colors in registers and write all
+// their bitplanes from there: for each bitplane, the lanes with the bit set
+// in a color become all ones, are masked with that color's gpio bit and
+// merged into the gpio words of the neighboring pixels in one go. Pixels
+// left over at the end of a run take the scalar path.
+//
+// Only implemented for 32 bit gpio words; with the wide gpio words of the
+// compute module, everything goes through the scalar version.
+
+#include "bitplane-kernel.h"
+
+#include "framebuffer-internal.h"
+
+#if !defined(ENABLE_WIDE_GPIO_COMPUTE_MODULE)
+#  if defined(__x86_64__) || defined(__i386__)
+#    if defined(__SSE2__)
+#      define BITPLANE_KERNEL_X86 1
+#      include <immintrin.h>
+#    endif
+#  elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    define BITPLANE_KERNEL_NEON 1
+#    include <arm_neon.h>
+#  endif
+#endif
+
+namespace rgb_matrix {
+namespace internal {
+
+void SetBitplanesScalar(const uint16_t *red, const uint16_t *green,
+                        const uint16_t *blue, int count,
+                        const ColorBits &color,
+                        int first_plane, int end_plane,
+                        gpio_bits_t *bits, int plane_stride) {
+  const gpio_bits_t r_bits = color.r_bit;
+  const gpio_bits_t g_bits = color.g_bit;
+  const gpio_bits_t b_bits = color.b_bit;
+  const gpio_bits_t designator_mask = color.mask;
+  for (int i = 0; i < count; ++i) {
+    gpio_bits_t *out = bits + i + plane_stride * first_plane;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const uint16_t mask = 1 << p;
+      gpio_bits_t color_bits = 0;
+      if (red[i] & mask)   color_bits |= r_bits;
+      if (green[i] & mask) color_bits |= g_bits;
+      if (blue[i] & mask)  color_bits |= b_bits;
+      *out = (*out & designator_mask) | color_bits;
+      out += plane_stride;
+    }
+  }
+}
+
+#ifdef BITPLANE_KERNEL_X86
+// Four pixels at a time.
+static void SetBitplanesSSE2(const uint16_t *red, const uint16_t *green,
+                             const uint16_t *blue, int count,
+                             const ColorBits &color,
+                             int first_plane, int end_plane,
+                             gpio_bits_t *bits, int plane_stride) {
+  const __m128i r_bits = _mm_set1_epi32(color.r_bit);
+  const __m128i g_bits = _mm_set1_epi32(color.g_bit);
+  const __m128i b_bits = _mm_set1_epi32(color.b_bit);
+  const __m128i keep = _mm_set1_epi32(color.mask);
+  const __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  for (/**/; i + 4 <= count; i += 4) {
+    const __m128i r = _mm_unpacklo_epi16(
+      _mm_loadl_epi64((const __m128i*)(red + i)), zero);
+    const __m128i g = _mm_unpacklo_epi16(
+      _mm_loadl_epi64((const __m128i*)(green + i)), zero);
+    const __m128i b = _mm_unpacklo_epi16(
+      _mm_loadl_epi64((const __m128i*)(blue + i)), zero);
+    gpio_bits_t *out = bits + i + plane_stride * first_plane;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const __m128i plane = _mm_set1_epi32(1 << p);
+      __m128i color = _mm_and_si128(
+        _mm_cmpeq_epi32(_mm_and_si128(r, plane), plane), r_bits);
+      color = _mm_or_si128(color, _mm_and_si128(
+        _mm_cmpeq_epi32(_mm_and_si128(g, plane), plane), g_bits));
+      color = _mm_or_si128(color, _mm_and_si128(
+        _mm_cmpeq_epi32(_mm_and_si128(b, plane), plane), b_bits));
+      const __m128i old = _mm_loadu_si128((const __m128i*)out);
+      _mm_storeu_si128((__m128i*)out,
+                       _mm_or_si128(_mm_and_si128(old, keep), color));
+      out += plane_stride;
+    }
+  }
+  SetBitplanesScalar(red + i, green + i, blue + i, count - i, color,
+                     first_plane, end_plane, bits + i, plane_stride);
+}
+
+// Eight pixels at a time; only called if the CPU supports it.
+__attribute__((target("avx2")))
+static void SetBitplanesAVX2(const uint16_t *red, const uint16_t *green,
+                             const uint16_t *blue, int count,
+                             const ColorBits &color,
+                             int first_plane, int end_plane,
+                             gpio_bits_t *bits, int plane_stride) {
+  const __m256i r_bits = _mm256_set1_epi32(color.r_bit);
+  const __m256i g_bits = _mm256_set1_epi32(color.g_bit);
+  const __m256i b_bits = _mm256_set1_epi32(color.b_bit);
+  const __m256i keep = _mm256_set1_epi32(color.mask);
+  int i = 0;
+  for (/**/; i + 8 <= count; i += 8) {
+    const __m256i r = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128((const __m128i*)(red + i)));
+    const __m256i g = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128((const __m128i*)(green + i)));
+    const __m256i b = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128((const __m128i*)(blue + i)));
+    gpio_bits_t *out = bits + i + plane_stride * first_plane;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const __m256i plane = _mm256_set1_epi32(1 << p);
+      __m256i color = _mm256_and_si256(
+        _mm256_cmpeq_epi32(_mm256_and_si256(r, plane), plane), r_bits);
+      color = _mm256_or_si256(color, _mm256_and_si256(
+        _mm256_cmpeq_epi32(_mm256_and_si256(g, plane), plane), g_bits));
+      color = _mm256_or_si256(color, _mm256_and_si256(
+        _mm256_cmpeq_epi32(_mm256_and_si256(b, plane), plane), b_bits));
+      const __m256i old = _mm256_loadu_si256((const __m256i*)out);
+      _mm256_storeu_si256((__m256i*)out,
+                          _mm256_or_si256(_mm256_and_si256(old, keep), color));
+      out += plane_stride;
+    }
+  }
+  SetBitplanesSSE2(red + i, green + i, blue + i, count - i, color,
+                   first_plane, end_plane, bits + i, plane_stride);
+}
+#endif  // BITPLANE_KERNEL_X86
+
+#ifdef BITPLANE_KERNEL_NEON
+// Four pixels at a time.
+static void SetBitplanesNEON(const uint16_t *red, const uint16_t *green,
+                             const uint16_t *blue, int count,
+                             const ColorBits &color,
+                             int first_plane, int end_plane,
+                             gpio_bits_t *bits, int plane_stride) {
+  const uint32x4_t r_bits = vdupq_n_u32(color.r_bit);
+  const uint32x4_t g_bits = vdupq_n_u32(color.g_bit);
+  const uint32x4_t b_bits = vdupq_n_u32(color.b_bit);
+  const uint32x4_t keep = vdupq_n_u32(color.mask);
+  int i = 0;
+  for (/**/; i + 4 <= count; i += 4) {
+    const uint32x4_t r = vmovl_u16(vld1_u16(red + i));
+    const uint32x4_t g = vmovl_u16(vld1_u16(green + i));
+    const uint32x4_t b = vmovl_u16(vld1_u16(blue + i));
+    gpio_bits_t *out = bits + i + plane_stride * first_plane;
+    for (int p = first_plane; p < end_plane; ++p) {
+      const uint32x4_t plane = vdupq_n_u32(1 << p);
+      uint32x4_t color = vandq_u32(vtstq_u32(r, plane), r_bits);
+      color = vorrq_u32(color, vandq_u32(vtstq_u32(g, plane), g_bits));
+      color = vorrq_u32(color, vandq_u32(vtstq_u32(b, plane), b_bits));
+      vst1q_u32(out, vorrq_u32(vandq_u32(vld1q_u32(out), keep), color));
+      out += plane_stride;
+    }
+  }
+  SetBitplanesScalar(red + i, green + i, blue + i, count - i, color,
+                     first_plane, end_plane, bits + i, plane_stride);
+}
+#endif  // BITPLANE_KERNEL_NEON
+
+namespace {
+typedef void (*BitplaneKernel)(const uint16_t *red, const uint16_t *green,
+                               const uint16_t *blue, int count,
+                               const ColorBits &color,
+                               int first_plane, int end_plane,
+                               gpio_bits_t *bits, int plane_stride);
+struct KernelChoice {
+  BitplaneKernel kernel;
+  const char *name;
+};
+
+KernelChoice ChooseKernel() {
+#if defined(BITPLANE_KERNEL_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    const KernelChoice avx2 = { &SetBitplanesAVX2, "avx2" };
+    return avx2;
+  }
+  const KernelChoice choice = { &SetBitplanesSSE2, "sse2" };
+#elif defined(BITPLANE_KERNEL_NEON)
+  const KernelChoice choice = { &SetBitplanesNEON, "neon" };
+#else
+  const KernelChoice choice = { &SetBitplanesScalar, "scalar" };
+#endif
+  return choice;
+}
+
+const KernelChoice &Kernel() {
+  static const KernelChoice choice = ChooseKernel();
+  return choice;
+}
+}  // anonymous namespace
+
+void SetBitplanes(const uint16_t *red, const uint16_t *green,
+                  const uint16_t *blue, int count,
+                  const ColorBits &color,
+                  int first_plane, int end_plane,
+                  gpio_bits_t *bits, int plane_stride) {
+  Kernel().kernel(red, green, blue, count, color,
+                  first_plane, end_plane, bits, plane_stride);
+}
+
+const char *BitplaneKernelName() { return Kernel().name; }
+
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -0,0 +1,58 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_BITPLANE_KERNEL_H
+#define RPI_BITPLANE_KERNEL_H
+
+#include <stdint.h>
+
+#include "gpio-bits.h"
+
+namespace rgb_matrix {
+namespace internal {
+struct ColorBits;
+
+// Converts a run of "count" pixels into their bitplanes at once.
+//
+// "red", "green" and "blue" are the colors of the pixels as mapped by the
+// Framebuffer (one bit per bitplane). The pixels are the consecutive gpio
+// words starting at "bits", all with the same gpio bits "color" for their
+// colors; the words of one bitplane are followed by the next one
+// "plane_stride" words further. Bitplanes "first_plane" up to, but not
+// including, "end_plane" are written, with exactly the result SetPixel()
+// has for each pixel.
+//
+// Uses the vector instructions available on the machine (see
+// BitplaneKernelName()).
+void SetBitplanes(const uint16_t *red, const uint16_t *green,
+                  const uint16_t *blue, int count,
+                  const ColorBits &color,
+                  int first_plane, int end_plane,
+                  gpio_bits_t *bits, int plane_stride);
+
+// The same, one pixel after another; the reference for SetBitplanes().
+void SetBitplanesScalar(const uint16_t *red, const uint16_t *green,
+                        const uint16_t *blue, int count,
+                        const ColorBits &color,
+                        int first_plane, int end_plane,
+                        gpio_bits_t *bits, int plane_stride);
+
+// The instruction set SetBitplanes() uses: "avx2", "sse2", "neon" or
+// "scalar".
+const char *BitplaneKernelName();
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_BITPLANE_KERNEL_H
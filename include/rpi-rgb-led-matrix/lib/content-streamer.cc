@@ -113,8 +113,7 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   h.magic = kFrameMagicValue;
   h.size = len;
   h.hold_time_us = hold_time_us;
-  FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  return FullAppend(io_, &h, sizeof(h)) && FullAppend(io_, data, len);
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
@@ -18,6 +18,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <vector>
+
 #include "hardware-mapping.h"
 #include "../include/graphics.h"
 
@@ -25,38 +28,69 @@ namespace rgb_matrix {
 class GPIO;
 class PinPulser;
 namespace internal {
+class OutputBackend;
 class RowAddressSetter;
 
-// An opaque type used within the framebuffer that can be used
-// to copy between PixelMappers.
-struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0u){}
-  long gpio_word;
+// The gpio bits that set the red, green and blue of a pixel, and the mask
+// of the bits to keep when setting them. Shared by all pixels on the same
+// half of a panel in the same parallel chain.
+struct ColorBits {
+  ColorBits() : r_bit(0), g_bit(0), b_bit(0), mask(~(gpio_bits_t)0) {}
   gpio_bits_t r_bit;
   gpio_bits_t g_bit;
   gpio_bits_t b_bit;
   gpio_bits_t mask;
 };
 
+// An opaque type used within the framebuffer that can be used
+// to copy between PixelMappers. Kept small, as there is one for every
+// pixel: the colors it refers to are looked up with
+// PixelDesignatorMap::color_bits().
+struct PixelDesignator {
+  PixelDesignator() : gpio_word(-1), color(0) {}
+  int32_t gpio_word;  // In the first bitplane; -1 for pixels not shown.
+  uint16_t color;     // Index of its ColorBits in the PixelDesignatorMap.
+};
+
 class PixelDesignatorMap {
 public:
-  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+  PixelDesignatorMap(int width, int height, const ColorBits &fill_bits);
+  // A map with the same ColorBits as "other", so that PixelDesignators of
+  // "other" can be copied into it; e.g. to re-arrange them with a
+  // PixelMapper.
+  PixelDesignatorMap(int width, int height, const PixelDesignatorMap &other);
   ~PixelDesignatorMap();
 
   // Get a writable version of the PixelDesignator. Outside Framebuffer used
   // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
-  PixelDesignator *get(int x, int y);
+  inline PixelDesignator *get(int x, int y) {
+    if (x < 0 || y < 0 || x >= width_ || y >= height_)
+      return NULL;
+    return buffer_ + (y*width_) + x;
+  }
 
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
+  // The color bits of "designator".
+  inline const ColorBits &color_bits(const PixelDesignator &designator) const {
+    return colors_[designator.color];
+  }
+
+  // Index of "bits" for PixelDesignator::color; added if not known yet.
+  uint16_t AddColorBits(const ColorBits &bits);
+
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const ColorBits &GetFillColorBits() { return fill_bits_; }
+
+  // Bytes of memory used by the map.
+  size_t MemoryUsed() const;
 
 private:
   const int width_;
   const int height_;
-  const PixelDesignator fill_bits_;  // Precalculated for fill.
+  const ColorBits fill_bits_;  // Precalculated for fill.
+  std::vector<ColorBits> colors_;  // First for pixels that are not shown.
   PixelDesignator *const buffer_;
 };
 
@@ -99,6 +133,10 @@ public:
                        int row_address_type);
   static void InitializePanels(GPIO *io, const char *panel_type, int columns);
 
+  // Send the output to "backend" instead of the hardware; call before
+  // InitGPIO(), with a headless GPIO.
+  static void SetOutputBackend(OutputBackend *backend);
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
@@ -111,6 +149,7 @@ public:
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
+  // See SetOutputBrightness() for dimming everything shown.
   void SetBrightness(uint8_t b) {
     brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
   }
@@ -118,6 +157,28 @@ public:
 
   void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
 
+  // Finds the bitplanes of each double row that are the same as the next
+  // one, which DumpToMatrix() then clocks in only once and shows with one
+  // output enable pulse as long as all of theirs; for white text on black,
+  // that is all of them. Only does work if the content changed since the
+  // last call. Called before the frame is handed to the refresh thread;
+  // DumpToMatrix() calls it for frames that are drawn on while shown.
+  void UpdatePlaneRuns();
+
+  // Brightness in percent (0..100, fractions for smooth fades) applied while
+  // sending frames to the panels, by shortening the output enable pulses.
+  // Unlike SetBrightness(), affects whatever is shown, with the next
+  // DumpToMatrix(). Only call from the thread calling DumpToMatrix().
+  static void SetOutputBrightness(float percent, bool luminance_correct);
+
+  // The pulser of the output enable; NULL before InitGPIO().
+  static PinPulser *output_enable_pulser();
+
+  // Decode the colors as they are shown into width() * height() RGB
+  // triplets, with "light_scale" (0..1) the fraction of the output enable
+  // time used (as PinPulser::SetPulseScale()).
+  void Decode(float light_scale, uint8_t *rgb) const;
+
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
@@ -128,10 +189,39 @@ public:
   int height() const;
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   void SetPixels(int x, int y, int width, int height, Color *colors);
+  // Set "width" pixels of row "y", starting at "x", from "pixels": three
+  // bytes per pixel, red, green, blue (blue first if "is_bgr"). Pixels that
+  // the mapping puts into consecutive gpio words are converted together
+  // with SetBitplanes().
+  void SetPixelRow(int x, int y, int width, const uint8_t *pixels,
+                   bool is_bgr);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // A color converted to its per-bitplane GPIO bits, to set many pixels of
+  // the same color without converting it for each of them.
+  struct PlaneColor {
+    uint16_t red, green, blue;
+    // Plane bits for the designator colors they were last computed for
+    // (PixelDesignator::color, -1 for none yet); neighboring pixels mostly
+    // share the same.
+    int color_bits;
+    gpio_bits_t plane_bits[kBitPlanes];
+  };
+  void PreparePlaneColor(uint8_t r, uint8_t g, uint8_t b, PlaneColor *color);
+
+  // Set all pixels that have their bit set in the "height" rows of a bitmap
+  // with its top left corner at "x","y". Rows are "row_bits" wide (see
+  // GetBitmapRow()), leftmost pixel is the most significant bit.
+  void DrawBitmap(const void *rows, int row_bits, int height, int x, int y,
+                  PlaneColor *color);
+
 private:
+  // DrawBitmap() for rows of type "Row".
+  template <typename Row>
+  void DrawBitmapRows(const Row *rows, int height, int x, int y,
+                      PlaneColor *color);
+
   static const struct HardwareMapping *hardware_mapping_;
   static RowAddressSetter *row_setter_;
 
@@ -146,6 +236,15 @@ private:
                              PixelDesignator *designator);
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  // After each change of the bitplanes.
+  inline void MarkChanged() {
+    planes_changed_.store(true, std::memory_order_release);
+  }
+  // Whether mapped colors leave a pixel dark in all bitplanes shown.
+  inline bool IsDark(uint16_t red, uint16_t green, uint16_t blue) const;
+  // Before setting a pixel that is not dark at "gpio_word".
+  inline void MarkLit(int32_t gpio_word);
+  void SetAllRowsDark(bool dark);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -170,6 +269,17 @@ private:
   gpio_bits_t *bitplane_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // For each double row, bit "b" is set if bitplane b is the same as
+  // bitplane b + 1. See UpdatePlaneRuns().
+  std::atomic<uint16_t> *same_as_next_;
+  std::atomic<bool> planes_changed_;
+
+  // For each double row, whether it is dark: no pixel was set to anything
+  // but black since the last Clear() or Fill() with black. DumpToMatrix()
+  // doesn't clock in dark rows again while the panels still have the
+  // previous dark row.
+  std::atomic<bool> *row_dark_;
+
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
 };
 }  // namespace internal
@@ -29,7 +29,9 @@
 
 #include <algorithm>
 
+#include "bitplane-kernel.h"
 #include "gpio.h"
+#include "output-backend.h"
 #include "../include/graphics.h"
 
 namespace rgb_matrix {
@@ -38,28 +40,62 @@ namespace internal {
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
 
+// If set, where the output goes instead of the panels on the GPIO.
+static OutputBackend *sOutputBackend = NULL;
+
+// The pulse spec of sOutputEnablePulser to show bitplanes "b" up to, but not
+// including, "end" with: [b][end].
+static int sPlanesPulse[Framebuffer::kBitPlanes][Framebuffer::kBitPlanes + 1];
+
+// Showing bitplanes together and not clocking in dark rows again make a pass
+// shorter, depending on the content, and the shorter the pass, the brighter
+// the panels. So such a pass is padded to the length of one that shows each
+// bitplane of each row on its own: for passes
+// starting at bitplane [b], measured every so often; 0 while unknown.
+static uint32_t sFullPassUsec[Framebuffer::kBitPlanes];
+static int sPassesSinceFull = 0;
+static const int kFullPassInterval = 16;
+
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
 #else
 #  define SUB_PANELS_ 2
 #endif
 
-PixelDesignator *PixelDesignatorMap::get(int x, int y) {
-  if (x < 0 || y < 0 || x >= width_ || y >= height_)
-    return NULL;
-  return buffer_ + (y*width_) + x;
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const ColorBits &fill_bits)
+  : width_(width), height_(height), fill_bits_(fill_bits),
+    colors_(1), buffer_(new PixelDesignator[width * height]) {
 }
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
-  : width_(width), height_(height), fill_bits_(fill_bits),
-    buffer_(new PixelDesignator[width * height]) {
+                                       const PixelDesignatorMap &other)
+  : width_(width), height_(height), fill_bits_(other.fill_bits_),
+    colors_(other.colors_), buffer_(new PixelDesignator[width * height]) {
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
   delete [] buffer_;
 }
 
+uint16_t PixelDesignatorMap::AddColorBits(const ColorBits &bits) {
+  for (size_t i = 0; i < colors_.size(); ++i) {
+    const ColorBits &c = colors_[i];
+    if (c.r_bit == bits.r_bit && c.g_bit == bits.g_bit
+        && c.b_bit == bits.b_bit && c.mask == bits.mask)
+      return i;
+  }
+  // At most two per parallel chain, for the halves of the panels.
+  assert(colors_.size() <= UINT16_MAX);
+  colors_.push_back(bits);
+  return colors_.size() - 1;
+}
+
+size_t PixelDesignatorMap::MemoryUsed() const {
+  return sizeof(*this) + sizeof(PixelDesignator) * width_ * height_
+    + sizeof(ColorBits) * colors_.capacity();
+}
+
 // Different panel types use different techniques to set the row address.
 // We abstract that away with different implementations of RowAddressSetter
 class RowAddressSetter {
@@ -311,6 +347,10 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   assert(parallel >= 1 && parallel <= 6);
 
   bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  same_as_next_ = new std::atomic<uint16_t>[double_rows_];
+  for (int row = 0; row < double_rows_; ++row) same_as_next_[row] = 0;
+  planes_changed_ = true;
+  row_dark_ = new std::atomic<bool>[double_rows_];
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -327,7 +367,7 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2 | h.p3_r1 | h.p3_r2 | h.p4_r1 | h.p4_r2 | h.p5_r1 | h.p5_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2 | h.p3_g1 | h.p3_g2 | h.p4_g1 | h.p4_g2 | h.p5_g1 | h.p5_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2 | h.p3_b1 | h.p3_b2 | h.p4_b1 | h.p4_b2 | h.p5_b1 | h.p5_b2;
-    PixelDesignator fill_bits;
+    ColorBits fill_bits;
     fill_bits.r_bit = GetGpioFromLedSequence('R', led_sequence, r, g, b);
     fill_bits.g_bit = GetGpioFromLedSequence('G', led_sequence, r, g, b);
     fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
@@ -345,6 +385,8 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
 
 Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
+  delete [] same_as_next_;
+  delete [] row_dark_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -460,9 +502,28 @@ Framebuffer::~Framebuffer() {
     bitplane_timings.push_back(timing_ns);
     if (b >= dither_bits) timing_ns *= 2;
   }
-  sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
-                                          allow_hardware_pulsing,
-                                          bitplane_timings);
+  // Followed by the sums of all runs of consecutive bitplanes, for the ones
+  // with the same content.
+  for (int b = 0; b < kBitPlanes; ++b) {
+    sPlanesPulse[b][b + 1] = b;
+    int run_ns = bitplane_timings[b];
+    for (int end = b + 2; end <= kBitPlanes; ++end) {
+      run_ns += bitplane_timings[end - 1];
+      sPlanesPulse[b][end] = bitplane_timings.size();
+      bitplane_timings.push_back(run_ns);
+    }
+  }
+  if (sOutputBackend != NULL) {
+    sOutputEnablePulser = sOutputBackend->CreatePulser(bitplane_timings);
+  } else {
+    sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
+                                            allow_hardware_pulsing,
+                                            bitplane_timings);
+  }
+}
+
+/* static */ void Framebuffer::SetOutputBackend(OutputBackend *backend) {
+  sOutputBackend = backend;
 }
 
 // NOTE: first version for panel initialization sequence, need to refine
@@ -569,6 +630,8 @@ static void InitFM6127(GPIO *io, const struct HardwareMapping &h, int columns) {
 bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
+  // The bitplanes that are shown now were not looked at.
+  if (value > pwm_bits_) SetAllRowsDark(false);
   pwm_bits_ = value;
   return true;
 }
@@ -579,6 +642,26 @@ inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
                             + column ];
 }
 
+inline bool Framebuffer::IsDark(uint16_t red, uint16_t green,
+                                uint16_t blue) const {
+  const uint16_t shown
+    = ((1 << kBitPlanes) - 1) & ~((1 << (kBitPlanes - pwm_bits_)) - 1);
+  return inverse_color_
+    ? (red & green & blue & shown) == shown
+    : ((red | green | blue) & shown) == 0;
+}
+
+inline void Framebuffer::MarkLit(int32_t gpio_word) {
+  std::atomic<bool> &dark = row_dark_[gpio_word / (columns_ * kBitPlanes)];
+  if (dark.load(std::memory_order_relaxed))
+    dark.store(false, std::memory_order_relaxed);
+}
+
+void Framebuffer::SetAllRowsDark(bool dark) {
+  for (int row = 0; row < double_rows_; ++row)
+    row_dark_[row].store(dark, std::memory_order_relaxed);
+}
+
 void Framebuffer::Clear() {
   if (inverse_color_) {
     Fill(0, 0, 0);
@@ -586,14 +669,26 @@ void Framebuffer::Clear() {
     // Cheaper.
     memset(bitplane_buffer_, 0,
            sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    SetAllRowsDark(true);
+    MarkChanged();
   }
 }
 
 // Do CIE1931 luminance correction and scale to output bitplanes
+// Relative luminance 0..1 of the perceived lightness "v" 0..100
+static float cie1931(float v) {
+  return (v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3);
+}
+
+// The inverse: perceived lightness 0..100 of the relative luminance "y".
+static float inverse_cie1931(float y) {
+  return (y <= 8 / 902.3) ? y * 902.3 : 116 * cbrtf(y) - 16;
+}
+
 static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
   float out_factor = ((1 << internal::Framebuffer::kBitPlanes) - 1);
   float v = (float) c * brightness / 255.0;
-  return roundf(out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3)));
+  return roundf(out_factor * cie1931(v));
 }
 
 struct ColorLookup {
@@ -647,7 +742,9 @@ inline void Framebuffer::MapColors(
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
-  const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  const ColorBits &fill = (*shared_mapper_)->GetFillColorBits();
+  const bool dark = IsDark(red, green, blue);
+  if (!dark) SetAllRowsDark(false);
 
   for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
     uint16_t mask = 1 << b;
@@ -663,27 +760,32 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
       }
     }
   }
+  if (dark) SetAllRowsDark(true);
+  MarkChanged();
 }
 
 int Framebuffer::width() const { return (*shared_mapper_)->width(); }
 int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  const PixelDesignator *designator = mapper->get(x, y);
   if (designator == NULL) return;
   const long pos = designator->gpio_word;
   if (pos < 0) return;  // non-used pixel marker.
+  const ColorBits &color_bits = mapper->color_bits(*designator);
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  if (!IsDark(red, green, blue)) MarkLit(pos);
 
   gpio_bits_t *bits = bitplane_buffer_ + pos;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
   bits += (columns_ * min_bit_plane);
-  const gpio_bits_t r_bits = designator->r_bit;
-  const gpio_bits_t g_bits = designator->g_bit;
-  const gpio_bits_t b_bits = designator->b_bit;
-  const gpio_bits_t designator_mask = designator->mask;
+  const gpio_bits_t r_bits = color_bits.r_bit;
+  const gpio_bits_t g_bits = color_bits.g_bit;
+  const gpio_bits_t b_bits = color_bits.b_bit;
+  const gpio_bits_t designator_mask = color_bits.mask;
   for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
     gpio_bits_t color_bits = 0;
     if (red & mask)   color_bits |= r_bits;
@@ -692,14 +794,130 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
     *bits = (*bits & designator_mask) | color_bits;
     bits += columns_;
   }
+  MarkChanged();
+}
+
+void Framebuffer::PreparePlaneColor(uint8_t r, uint8_t g, uint8_t b,
+                                    PlaneColor *color) {
+  MapColors(r, g, b, &color->red, &color->green, &color->blue);
+  color->color_bits = -1;
+}
+
+template <typename Row>
+void Framebuffer::DrawBitmapRows(const Row *rows, int height, int x, int y,
+                                 PlaneColor *color) {
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  if (x >= mapper->width() || x + 8 * (int)sizeof(Row) <= 0) return;
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const bool lit = !IsDark(color->red, color->green, color->blue);
+  const int first_row = std::max(0, -y);
+  const int last_row = std::min(height, mapper->height() - y);
+  for (int row = first_row; row < last_row; ++row) {
+    uint64_t pixels = (uint64_t)rows[row] << (64 - 8 * sizeof(Row));
+    while (pixels) {
+      const int col = __builtin_clzll(pixels);
+      pixels &= ~(0x8000000000000000ULL >> col);
+      const PixelDesignator *designator = mapper->get(x + col, y + row);
+      if (designator == NULL || designator->gpio_word < 0) continue;
+      if (lit) MarkLit(designator->gpio_word);
+
+      const ColorBits &color_bits = mapper->color_bits(*designator);
+      if (designator->color != color->color_bits) {
+        color->color_bits = designator->color;
+        for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+          const uint16_t mask = 1 << b;
+          gpio_bits_t plane_bits = 0;
+          if (color->red & mask)   plane_bits |= color_bits.r_bit;
+          if (color->green & mask) plane_bits |= color_bits.g_bit;
+          if (color->blue & mask)  plane_bits |= color_bits.b_bit;
+          color->plane_bits[b] = plane_bits;
+        }
+      }
+
+      gpio_bits_t *bits = bitplane_buffer_ + designator->gpio_word
+        + columns_ * min_bit_plane;
+      const gpio_bits_t designator_mask = color_bits.mask;
+      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+        *bits = (*bits & designator_mask) | color->plane_bits[b];
+        bits += columns_;
+      }
+    }
+  }
+  MarkChanged();
+}
+
+void Framebuffer::DrawBitmap(const void *rows, int row_bits, int height,
+                             int x, int y, PlaneColor *color) {
+  switch (row_bits) {
+  case 8:
+    DrawBitmapRows((const uint8_t*) rows, height, x, y, color);
+    break;
+  case 16:
+    DrawBitmapRows((const uint16_t*) rows, height, x, y, color);
+    break;
+  case 32:
+    DrawBitmapRows((const uint32_t*) rows, height, x, y, color);
+    break;
+  default:
+    DrawBitmapRows((const uint64_t*) rows, height, x, y, color);
+  }
+}
+
+// Whether "d" is the pixel "n" gpio words after "first" and set the same way.
+static inline bool IsInRun(const PixelDesignator &first, int n,
+                           const PixelDesignator &d) {
+  return d.gpio_word == first.gpio_word + n && d.color == first.color;
+}
+
+void Framebuffer::SetPixelRow(int x, int y, int width, const uint8_t *pixels,
+                              bool is_bgr) {
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  if (y < 0 || y >= mapper->height()) return;
+  if (x < 0) {
+    pixels += 3 * -x;
+    width += x;
+    x = 0;
+  }
+  width = std::min(width, mapper->width() - x);
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const int red_byte = is_bgr ? 2 : 0;
+  const int blue_byte = is_bgr ? 0 : 2;
+
+  // Mapped colors of a run of pixels in consecutive gpio words.
+  static const int kMaxRun = 64;
+  uint16_t red[kMaxRun], green[kMaxRun], blue[kMaxRun];
+  int i = 0;
+  while (i < width) {
+    const PixelDesignator &first = *mapper->get(x + i, y);
+    if (first.gpio_word < 0) {  // non-used pixel marker.
+      ++i;
+      continue;
+    }
+    int run = 0;
+    bool dark = true;
+    do {
+      const uint8_t *p = pixels + 3 * (i + run);
+      MapColors(p[red_byte], p[1], p[blue_byte],
+                &red[run], &green[run], &blue[run]);
+      dark &= IsDark(red[run], green[run], blue[run]);
+      ++run;
+    } while (i + run < width && run < kMaxRun
+             && IsInRun(first, run, *mapper->get(x + i + run, y)));
+    // All pixels of a run are in the same double row.
+    if (!dark) MarkLit(first.gpio_word);
+    SetBitplanes(red, green, blue, run, mapper->color_bits(first),
+                 min_bit_plane, kBitPlanes,
+                 bitplane_buffer_ + first.gpio_word, columns_);
+    i += run;
+  }
+  MarkChanged();
 }
 
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
+  static_assert(sizeof(Color) == 3, "Color needs to be three bytes r, g, b");
   for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
-    }
+    SetPixelRow(x, y + iy, width, &colors->r, false);
+    colors += width;
   }
 }
 // Strange LED-mappings such as RBG or so are handled here.
@@ -728,76 +946,108 @@ void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
   const struct HardwareMapping &h = *hardware_mapping_;
   gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
   d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
+  ColorBits color;
   if (y < rows_) {
     if (y < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
     }
   }
   else if (y >= rows_ && y < 2 * rows_) {
     if (y - rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
     }
   }
   else if (y >= 2*rows_ && y < 3 * rows_) {
     if (y - 2*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
     }
   }
   else if (y >= 3*rows_ && y < 4 * rows_) {
     if (y - 3*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
     }
   }
   else if (y >= 4*rows_ && y < 5 * rows_){
     if (y - 4*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
     }
 
   }
   else {
     if (y - 5*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
     } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+      color.r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+      color.g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+      color.b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
     }
   }
 
-  d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+  color.mask = ~(color.r_bit | color.g_bit | color.b_bit);
+  d->color = (*shared_mapper_)->AddColorBits(color);
+}
+
+void Framebuffer::Decode(float light_scale, uint8_t *rgb) const {
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const uint16_t used_bits
+    = ((1 << kBitPlanes) - 1) & ~((1 << min_bit_plane) - 1);
+  // Fewer bitplanes are shown for correspondingly shorter, so all of the
+  // ones shown are full light, just as all of them would be.
+  const float full_level = used_bits;
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  for (int y = 0; y < mapper->height(); ++y) {
+    for (int x = 0; x < mapper->width(); ++x) {
+      const PixelDesignator *designator = mapper->get(x, y);
+      const ColorBits &bits = mapper->color_bits(*designator);
+      const gpio_bits_t color_bits[3] = { bits.r_bit, bits.g_bit, bits.b_bit };
+      for (int c = 0; c < 3; ++c) {
+        uint16_t level = 0;
+        if (designator->gpio_word >= 0) {
+          const gpio_bits_t *bits = bitplane_buffer_ + designator->gpio_word;
+          for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+            if (bits[b * columns_] & color_bits[c]) level |= 1 << b;
+          }
+          if (inverse_color_) level = ~level & used_bits;
+        }
+        const float light = level / full_level * light_scale;
+        const float value = do_luminance_correct_
+          ? 255 * inverse_cie1931(light) / 100 : 255 * light;
+        *rgb++ = std::min(255L, lroundf(value));
+      }
+    }
+  }
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
@@ -808,12 +1058,59 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
   memcpy(bitplane_buffer_, data, len);
+  // Dark rows have no color bits set; with inverse colors, where these
+  // would depend on the pixel, none are assumed to be dark.
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  for (int row = 0; row < double_rows_; ++row) {
+    bool dark = !inverse_color_;
+    const gpio_bits_t *bits = ValueAt(row, 0, min_bit_plane);
+    const gpio_bits_t *const end = ValueAt(row, 0, kBitPlanes);
+    for (/**/; dark && bits < end; ++bits) dark = (*bits == 0);
+    row_dark_[row].store(dark, std::memory_order_relaxed);
+  }
+  MarkChanged();
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  for (int row = 0; row < double_rows_; ++row) {
+    row_dark_[row].store(other->row_dark_[row].load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+  }
+  MarkChanged();
+}
+
+void Framebuffer::UpdatePlaneRuns() {
+  // Whoever changes the bitplanes after this point marks them again, so
+  // that they are looked at again.
+  if (!planes_changed_.exchange(false, std::memory_order_acq_rel))
+    return;
+  const size_t plane_bytes = columns_ * sizeof(gpio_bits_t);
+  for (int row = 0; row < double_rows_; ++row) {
+    uint16_t same = 0;
+    for (int b = 0; b + 1 < kBitPlanes; ++b) {
+      if (memcmp(ValueAt(row, 0, b), ValueAt(row, 0, b + 1), plane_bytes) == 0)
+        same |= 1 << b;
+    }
+    same_as_next_[row].store(same, std::memory_order_relaxed);
+  }
+}
+
+/* static */ PinPulser *Framebuffer::output_enable_pulser() {
+  return sOutputEnablePulser;
+}
+
+/* static */ void Framebuffer::SetOutputBrightness(float percent,
+                                                  bool luminance_correct) {
+  if (sOutputEnablePulser == NULL) return;
+  // Other pulse lengths make other passes; measure these again.
+  memset(sFullPassUsec, 0, sizeof(sFullPassUsec));
+  percent = std::min(100.0f, std::max(0.0f, percent));
+  // Same light output for full colors as SetBrightness() would give.
+  sOutputEnablePulser->SetPulseScale(luminance_correct
+                                     ? cie1931(percent) : percent / 100);
 }
 
 void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
@@ -841,6 +1138,19 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
   // Depending if we do dithering, we might not always show the lowest bits.
   const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
 
+  UpdatePlaneRuns();
+
+  // Take shortcuts only once we know how long the pass would be without.
+  const bool shortcuts = (sFullPassUsec[start_bit] != 0
+                          && ++sPassesSinceFull < kFullPassInterval);
+  if (!shortcuts) sPassesSinceFull = 0;
+  bool shortened = false;
+  const uint32_t start_us = GetMicrosecondCounter();
+
+  // Whether the data last clocked in was of a dark row, as it is still in
+  // the shift registers of the panels then.
+  bool clocked_in_dark = false;
+
   const uint8_t half_double = double_rows_/2;
   for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
     uint8_t d_row;
@@ -858,16 +1168,34 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
 
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
-    for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
+    const uint16_t same = same_as_next_[d_row].load(std::memory_order_relaxed);
+    const bool dark
+      = shortcuts && row_dark_[d_row].load(std::memory_order_relaxed);
+    for (int b = start_bit; b < kBitPlanes; /**/) {
+      // The bitplanes that are the same as this one are shown with it.
+      int end = b + 1;
+      while (shortcuts && end < kBitPlanes
+             && (dark || (same & (1 << (end - 1)))))
+        ++end;
+      if (end > b + 1) shortened = true;
+
+      // A dark row is still shown for as long as the others, and the pass
+      // padded, so that they keep their share of the time, but it doesn't
+      // need to be clocked in again after another one.
+      if (!dark || !clocked_in_dark) {
+        gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+        // While the output enable is still on, we can already clock in the
+        // next data.
+        for (int col = 0; col < columns_; ++col) {
+          const gpio_bits_t &out = *row_data++;
+          io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
+          io->SetBits(h.clock);               // Rising edge: clock color in.
+        }
+        io->ClearBits(color_clk_mask);    // clock back to normal.
+        clocked_in_dark = dark;
+      } else {
+        shortened = true;
       }
-      io->ClearBits(color_clk_mask);    // clock back to normal.
 
       // OE of the previous row-data must be finished before strobe.
       sOutputEnablePulser->WaitPulseFinished();
@@ -878,10 +1206,25 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
       io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
       io->ClearBits(h.strobe);
 
-      // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+      // Now switch on for the sleep time necessary for these bit-planes.
+      sOutputEnablePulser->SendPulse(sPlanesPulse[b][end]);
+      b = end;
     }
   }
+
+  const uint32_t pass_us = GetMicrosecondCounter() - start_us;
+  uint32_t &full_pass_us = sFullPassUsec[start_bit];
+  if (shortened) {
+    while (GetMicrosecondCounter() - start_us < full_pass_us) {
+      // busy wait, as the refresh thread does to limit the refresh rate.
+    }
+  } else {
+    // Smoothed, so that a single slow pass doesn't make the next ones dim.
+    full_pass_us = std::max(1u, full_pass_us ? (3 * full_pass_us + pass_us) / 4
+                                              : pass_us);
+  }
+
+  if (sOutputBackend != NULL) sOutputBackend->FrameShown(*this);
 }
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -20,6 +20,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 /*
  * nanosleep() takes longer than requested because of OS jitter.
  * In about 99.9% of the cases, this is <= 25 microcseconds on
@@ -34,7 +37,9 @@
  * we substract this value whenever we do nanosleep(); the remaining time
  * we then busy wait to get a good accurate result.
  *
- * You can measure the overhead using DEBUG_SLEEP_JITTER below.
+ * You can measure the overhead with the histogram of pulse overshoots from
+ * RGBMatrix::GetRefreshStats() while using the hardware pin-pulser (it is
+ * shifted by this value; to see all of the OS overhead, set it to 0 first).
  *
  * Note: A higher value here will result in more CPU use because of more busy
  * waiting inching towards the real value (for all the cases that nanosleep()
@@ -52,15 +57,6 @@
  */
 #define MINIMUM_NANOSLEEP_TIME_US 5
 
-/* In order to determine useful values for above, set this to 1 and use the
- * hardware pin-pulser.
- * It will output a histogram atexit() of how much how often we were over
- * the requested time.
- * (The full histogram will be shifted by the EMPIRICAL_NANOSLEEP_OVERHEAD_US
- *  value above. To get a full histogram of OS overhead, set it to 0 first).
- */
-#define DEBUG_SLEEP_JITTER 0
-
 // Raspberry 1 and 2 have different base addresses for the periphery
 #define BCM2708_PERI_BASE        0x20000000
 #define BCM2709_PERI_BASE        0x3F000000
@@ -144,7 +140,7 @@ static bool LinuxHasModuleLoaded(const char *name) {
 #define GPIO_BIT(x) (1ull << x)
 
 GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
-               slowdown_(1)
+               slowdown_(1), headless_(false)
 #ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
              , uses_64_bit_(false)
 #endif
@@ -153,6 +149,11 @@ GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
 
 gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
                               bool adafruit_pwm_transition_hack_needed) {
+  if (headless_) {
+    outputs &= ~(output_bits_ | input_bits_ | reserved_bits_);
+    output_bits_ |= outputs;
+    return outputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
     return 0;
@@ -204,6 +205,11 @@ gpio_bits_t GPIO::InitOutputs(gpio_bits_t outputs,
 }
 
 gpio_bits_t GPIO::RequestInputs(gpio_bits_t inputs) {
+  if (headless_) {
+    inputs &= ~(output_bits_ | input_bits_ | reserved_bits_);
+    input_bits_ |= inputs;
+    return inputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
     return 0;
@@ -386,6 +392,24 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+bool GPIO::InitHeadless(int slowdown) {
+  slowdown_ = slowdown;
+  headless_ = true;
+  memset(headless_registers_, 0, sizeof(headless_registers_));
+
+  gpio_set_bits_low_ = &headless_registers_[0];
+  gpio_clr_bits_low_ = &headless_registers_[1];
+  gpio_read_bits_low_ = &headless_registers_[2];
+
+#ifdef ENABLE_WIDE_GPIO_COMPUTE_MODULE
+  gpio_set_bits_high_ = &headless_registers_[3];
+  gpio_clr_bits_high_ = &headless_registers_[4];
+  gpio_read_bits_high_ = &headless_registers_[5];
+#endif
+
+  return true;
+}
+
 bool GPIO::IsPi4() {
   return GetPiModel() == PI_MODEL_4;
 }
@@ -402,7 +426,8 @@ namespace {
 class Timers {
 public:
   static bool Init();
-  static void sleep_nanos(long t);
+  // Returns how many nanoseconds longer it took, if that is known.
+  static long sleep_nanos(long t);
 };
 
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
@@ -411,7 +436,8 @@ class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, gpio_bits_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {
+    : io_(io), bits_(bits), nano_specs_(nano_specs),
+      scaled_specs_(nano_specs) {
     if (!s_Timer1Mhz) {
       fprintf(stderr, "FYI: not running as root which means we can't properly "
               "control timing unless this is a real-time kernel. Expect color "
@@ -421,14 +447,23 @@ public:
 
   virtual void SendPulse(int time_spec_number) {
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    const long overshoot_ns
+      = Timers::sleep_nanos(scaled_specs_[time_spec_number]);
     io_->SetBits(bits_);
+    if (overshoot_ns >= 0) RecordOvershoot(overshoot_ns / 1000);
+  }
+
+  virtual void SetPulseScale(float factor) {
+    for (size_t i = 0; i < nano_specs_.size(); ++i) {
+      scaled_specs_[i] = lroundf(nano_specs_[i] * factor);
+    }
   }
 
 private:
   GPIO *const io_;
   const gpio_bits_t bits_;
   const std::vector<int> nano_specs_;
+  std::vector<int> scaled_specs_;
 };
 
 // Check that 3 shows up in isolcpus
@@ -505,7 +540,7 @@ static uint32_t JitterAllowanceMicroseconds() {
   return EMPIRICAL_NANOSLEEP_OVERHEAD_US;
 }
 
-void Timers::sleep_nanos(long nanos) {
+long Timers::sleep_nanos(long nanos) {
   // For smaller durations, we go straight to busy wait.
 
   // For larger duration, we use nanosleep() to give the operating system
@@ -525,9 +560,11 @@ void Timers::sleep_nanos(long nanos) {
       const uint32_t after = *s_Timer1Mhz;
       const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
       if (nanoseconds_passed > nanos) {
-        return;  // darn, missed it.
+        return nanoseconds_passed - nanos;  // darn, missed it.
       } else {
         nanos -= nanoseconds_passed; // remaining time with busy-loop
+        busy_wait_impl(nanos);
+        return 0;
       }
     }
   } else {
@@ -537,11 +574,12 @@ void Timers::sleep_nanos(long nanos) {
       struct timespec sleep_time
         = { 0, nanos - EMPIRICAL_NANOSLEEP_OVERHEAD_US*1000 };
       nanosleep(&sleep_time, NULL);
-      return;
+      return -1;
     }
   }
 
   busy_wait_impl(nanos);  // Use model-specific busy-loop for remaining time.
+  return -1;
 }
 
 static void busy_wait_nanos_rpi_1(long nanos) {
@@ -575,25 +613,6 @@ static void busy_wait_nanos_rpi_4(long nanos) {
   }
 }
 
-#if DEBUG_SLEEP_JITTER
-static int overshoot_histogram_us[256] = {0};
-static void print_overshoot_histogram() {
-  fprintf(stderr, "Overshoot histogram >= empirical overhead of %dus\n"
-          "%6s | %7s | %7s\n",
-          JitterAllowanceMicroseconds(), "usec", "count", "accum");
-  int total_count = 0;
-  for (int i = 0; i < 256; ++i) total_count += overshoot_histogram_us[i];
-  int running_count = 0;
-  for (int us = 0; us < 256; ++us) {
-    const int count = overshoot_histogram_us[us];
-    if (count > 0) {
-      running_count += count;
-      fprintf(stderr, "%s%3dus: %8d %7.3f%%\n", (us == 0) ? "<=" : " +",
-              us, count, 100.0 * running_count / total_count);
-    }
-  }
-}
-#endif
 
 // A PinPulser that uses the PWM hardware to create accurate pulses.
 // It only works on GPIO-12 or 18 though.
@@ -623,14 +642,10 @@ public:
   }
 
   HardwarePinPulser(gpio_bits_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : specs_(specs), triggered_(false) {
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
-#if DEBUG_SLEEP_JITTER
-    atexit(print_overshoot_histogram);
-#endif
-
     if (LinuxHasModuleLoaded("snd_bcm2835")) {
       fprintf(stderr,
               "\n%s=== snd_bcm2835: found that the Pi sound module is loaded. ===%s\n"
@@ -644,11 +659,6 @@ public:
       exit(1);
     }
 
-    for (size_t i = 0; i < specs.size(); ++i) {
-      // Hints how long to nanosleep, already corrected for system overhead.
-      sleep_hints_us_.push_back(specs[i]/1000 - JitterAllowanceMicroseconds());
-    }
-
     const int base = specs[0];
     // Get relevant registers
     fifo_ = s_PWM_registers + PWM_FIFO;
@@ -663,31 +673,33 @@ public:
       assert(false); // should've been caught by CanHandle()
     }
     InitPWMDivider((base/2) / PWM_BASE_TIME_NS);
-    for (size_t i = 0; i < specs.size(); ++i) {
-      pwm_range_.push_back(2 * specs[i] / base);
-    }
+    pwm_range_.resize(specs.size());
+    sleep_hints_us_.resize(specs.size());
+    SetPulseScale(1.0f);
   }
 
   virtual void SendPulse(int c) {
-    if (pwm_range_[c] < 16) {
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c];
+    const uint32_t range = pwm_range_[c];
+    if (range < 16) {
+      s_PWM_registers[PWM_RNG1] = range;
 
-      *fifo_ = pwm_range_[c];
+      *fifo_ = range;
     } else {
       // Keep the actual range as short as possible, as we have to
       // wait for one full period of these in the zero phase.
       // The hardware can't deal with values < 2, so only do this when
-      // have enough of these.
-      s_PWM_registers[PWM_RNG1] = pwm_range_[c] / 8;
-
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
+      // have enough of these. Unless scaled, that is 8 full periods;
+      // otherwise at most 7 and a remainder in a last partial one, to stay
+      // within the same fifo space. That remainder must not be 1 either; a
+      // slightly longer period fixes it (19: 4+4+4+4+3; 31: 7+7+7+7+3).
+      uint32_t period = (range % 8 == 0) ? range / 8 : (range + 6) / 7;
+      while (range % period == 1) ++period;
+      s_PWM_registers[PWM_RNG1] = period;
+
+      for (uint32_t i = 0; i < range / period; ++i) {
+        *fifo_ = period;
+      }
+      if (range % period) *fifo_ = range % period;
     }
 
     /*
@@ -713,6 +725,18 @@ public:
     s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
   }
 
+  virtual void SetPulseScale(float factor) {
+    const int base = specs_[0];
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      const float scaled_ns = specs_[i] * factor;
+      // Hints how long to nanosleep, already corrected for system overhead.
+      sleep_hints_us_[i] = scaled_ns / 1000 - JitterAllowanceMicroseconds();
+      // The shortest pulse the hardware can do is 2; slightly too bright
+      // lowest bitplanes when dimmed a lot are not noticeable.
+      pwm_range_[i] = std::max(2L, lroundf(2 * scaled_ns / base));
+    }
+  }
+
   virtual void WaitPulseFinished() {
     if (!triggered_) return;
     // Determine how long we already spent and sleep to get close to the
@@ -729,18 +753,11 @@ public:
         struct timespec sleep_time = { 0, 1000 * to_sleep_us };
         nanosleep(&sleep_time, NULL);
 
-#if DEBUG_SLEEP_JITTER
-        {
-          // Record histogram of realtime jitter how much longer we actually
-          // took.
-          const int total_us = *s_Timer1Mhz - start_time_;
-          const int nanoslept_us = total_us - already_elapsed_usec;
-          int overshoot = nanoslept_us - (to_sleep_us + JitterAllowanceMicroseconds());
-          if (overshoot < 0) overshoot = 0;
-          if (overshoot > 255) overshoot = 255;
-          overshoot_histogram_us[overshoot]++;
-        }
-#endif
+        // How much longer than expected the realtime jitter made us take.
+        const int total_us = *s_Timer1Mhz - start_time_;
+        const int nanoslept_us = total_us - already_elapsed_usec;
+        RecordOvershoot(nanoslept_us
+                        - (to_sleep_us + JitterAllowanceMicroseconds()));
       }
     }
 
@@ -779,6 +796,7 @@ private:
   }
 
 private:
+  const std::vector<int> specs_;
   std::vector<uint32_t> pwm_range_;
   std::vector<int> sleep_hints_us_;
   volatile uint32_t *fifo_;
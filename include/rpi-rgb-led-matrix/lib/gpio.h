@@ -18,6 +18,10 @@
 
 #include "gpio-bits.h"
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
 // Putting this in our namespace to not collide with other things called like
@@ -32,6 +36,12 @@ public:
   // (e.g. due to a permission problem).
   bool Init(int slowdown);
 
+  // Initialize without any hardware: writes go to memory that is never
+  // looked at, reads return 0. This allows to run the matrix refresh on any
+  // machine, e.g. with an output backend capturing the frames.
+  bool InitHeadless(int slowdown);
+  bool headless() const { return headless_; }
+
   // Initialize outputs.
   // Returns the bits that were available and could be set for output.
   // (never use the optional adafruit_hack_needed parameter, it is used
@@ -104,6 +114,8 @@ private:
   gpio_bits_t input_bits_;
   gpio_bits_t reserved_bits_;
   int slowdown_;
+  bool headless_;
+  uint32_t headless_registers_[6];  // Set, clear and read when headless.
 
   volatile uint32_t *gpio_set_bits_low_;
   volatile uint32_t *gpio_clr_bits_low_;
@@ -138,6 +150,42 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Scale all pulses to "factor" (0..1) times their length in the
+  // nano_wait_spec, e.g. to dim the output without changing the data. Takes
+  // effect with the next SendPulse(); call from the thread sending pulses.
+  virtual void SetPulseScale(float factor) = 0;
+
+  // Histogram of how many microseconds the operating system woke us up
+  // later than asked for while waiting for pulses to end: the number of
+  // waits that overshot by 0, 1, ... and kOvershootBuckets - 1 or more
+  // microseconds. Pulses that are busy-waited for are not counted.
+  // Can be read from any thread.
+  static const int kOvershootBuckets = 64;
+  uint64_t overshoots(int microseconds) const {
+    return overshoots_[microseconds].load(std::memory_order_relaxed);
+  }
+
+  // Start the histogram from scratch; call from the thread sending pulses.
+  void ClearOvershoots() {
+    for (int i = 0; i < kOvershootBuckets; ++i)
+      overshoots_[i].store(0, std::memory_order_relaxed);
+  }
+
+protected:
+  PinPulser() { ClearOvershoots(); }
+
+  // Called by the thread sending pulses.
+  void RecordOvershoot(int microseconds) {
+    std::atomic<uint64_t> &count
+      = overshoots_[std::min(std::max(0, microseconds),
+                             kOvershootBuckets - 1)];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> overshoots_[kOvershootBuckets];
 };
 
 // Get rolling over microsecond counter. We get this from a hardware register
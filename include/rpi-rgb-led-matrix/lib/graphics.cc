@@ -14,6 +14,7 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "graphics.h"
+#include "led-matrix.h"
 #include "utf8-internal.h"
 
 #include <stdlib.h>
@@ -21,10 +22,14 @@
 #include <algorithm>
 
 namespace rgb_matrix {
-bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
-              const uint8_t *buffer, size_t size,
-              const int width, const int height,
-              bool is_bgr) {
+namespace {
+// Clips the image to the canvas and calls "set_row(x, y, width, pixels)"
+// with each of its rows that is visible.
+template <typename RowSetter>
+bool ForEachImageRow(const Canvas *c, int canvas_offset_x, int canvas_offset_y,
+                     const uint8_t *buffer, size_t size,
+                     const int width, const int height,
+                     const RowSetter &set_row) {
   if (3 * width * height != (int)size)   // Sanity check
     return false;
 
@@ -48,34 +53,41 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
   const int w = std::min(c->width(), canvas_offset_x + image_display_w);
   const int h = std::min(c->height(), canvas_offset_y + image_display_h);
 
-  // Bytes to skip for wider than canvas image at the end of a row
-  const size_t skip_end_row = (canvas_offset_x + image_display_w > w)
-    ? (canvas_offset_x + image_display_w - w) * 3
-    : 0;
-
-  // Let's make this a combined skip per row and ajust where we start.
-  const size_t next_row_skip = skip_start_row + skip_end_row;
   buffer += skip_start_row;
-
-  if (is_bgr) {
-    for (int y = canvas_offset_y; y < h; ++y) {
-      for (int x = canvas_offset_x; x < w; ++x) {
-        c->SetPixel(x, y, buffer[2], buffer[1], buffer[0]);
-        buffer += 3;
-      }
-      buffer += next_row_skip;
-    }
-  } else {
-    for (int y = canvas_offset_y; y < h; ++y) {
-      for (int x = canvas_offset_x; x < w; ++x) {
-        c->SetPixel(x, y, buffer[0], buffer[1], buffer[2]);
-        buffer += 3;
-      }
-      buffer += next_row_skip;
-    }
+  for (int y = canvas_offset_y; y < h; ++y) {
+    if (w > canvas_offset_x)
+      set_row(canvas_offset_x, y, w - canvas_offset_x, buffer);
+    buffer += 3 * width;
   }
   return true;
 }
+}  // anonymous namespace
+
+bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
+              const uint8_t *buffer, size_t size,
+              const int width, const int height,
+              bool is_bgr) {
+  const int red_byte = is_bgr ? 2 : 0;
+  const int blue_byte = is_bgr ? 0 : 2;
+  return ForEachImageRow(
+    c, canvas_offset_x, canvas_offset_y, buffer, size, width, height,
+    [&](int x, int y, int row_width, const uint8_t *pixels) {
+      for (int i = 0; i < row_width; ++i, pixels += 3) {
+        c->SetPixel(x + i, y, pixels[red_byte], pixels[1], pixels[blue_byte]);
+      }
+    });
+}
+
+bool SetImage(FrameCanvas *c, int canvas_offset_x, int canvas_offset_y,
+              const uint8_t *buffer, size_t size,
+              const int width, const int height,
+              bool is_bgr) {
+  return ForEachImageRow(
+    c, canvas_offset_x, canvas_offset_y, buffer, size, width, height,
+    [&](int x, int y, int row_width, const uint8_t *pixels) {
+      c->SetPixelRow(x, y, row_width, pixels, is_bgr);
+    });
+}
 
 int DrawText(Canvas *c, const Font &font,
              int x, int y, const Color &color,
@@ -105,6 +117,272 @@ int DrawText(Canvas *c, const Font &font,
   return DrawText(c, font, x, y, color, background_color, utf8_text, 0);
 }
 
+namespace {
+// Collects glyphs to be drawn at once, in the text color and optionally
+// surrounded by their outline in an outline color. On a FrameCanvas, each
+// color is drawn with one FrameCanvas::DrawBitmaps() call, which converts
+// the color only once. All outlines are drawn before the text, so that no
+// text is covered by the outline of its neighbor.
+class GlyphBatch {
+public:
+  // "frame_canvas" is the same as "c" if that is a FrameCanvas, else NULL.
+  GlyphBatch(Canvas *c, FrameCanvas *frame_canvas,
+             const Color &color, const Color *outline_color)
+    : canvas_(c), frame_canvas_(frame_canvas), color_(color),
+      with_outline_(outline_color != NULL),
+      outline_color_(outline_color ? *outline_color : Color()) {}
+  ~GlyphBatch() {
+    Draw(outlines_, outline_color_);
+    Draw(glyphs_, color_);
+  }
+
+  // Queue the glyph with its baseline at "x","y". Returns how much to
+  // advance, or -1 if the font has no packed version of it; then it needs
+  // to be drawn with Font::DrawGlyph().
+  int Add(const Font &font, int x, int y, uint32_t codepoint) {
+    Font::PackedGlyph glyph;
+    if (!font.GetPackedGlyph(codepoint, &glyph))
+      return -1;
+    const FrameCanvas::Bitmap b = { glyph.rows, glyph.row_bits, glyph.height,
+                                    x, y + glyph.top };
+    glyphs_.push_back(b);
+    if (with_outline_ && glyph.outline_rows) {
+      const FrameCanvas::Bitmap o = { glyph.outline_rows,
+                                      glyph.outline_row_bits, glyph.height + 2,
+                                      x - 1, y + glyph.top - 1 };
+      outlines_.push_back(o);
+    }
+    return glyph.advance;
+  }
+
+private:
+  void Draw(const std::vector<FrameCanvas::Bitmap> &bitmaps,
+            const Color &color) {
+    if (bitmaps.empty()) return;
+    if (frame_canvas_) {
+      frame_canvas_->DrawBitmaps(&bitmaps[0], bitmaps.size(),
+                                 color.r, color.g, color.b);
+      return;
+    }
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+      const FrameCanvas::Bitmap &b = bitmaps[i];
+      for (int row = 0; row < b.height; ++row) {
+        uint64_t pixels = GetBitmapRow(b.rows, b.row_bits, row);
+        while (pixels) {
+          const int col = __builtin_clzll(pixels);
+          pixels &= ~(0x8000000000000000ULL >> col);
+          canvas_->SetPixel(b.x + col, b.y + row, color.r, color.g, color.b);
+        }
+      }
+    }
+  }
+
+  Canvas *const canvas_;
+  FrameCanvas *const frame_canvas_;
+  const Color color_;
+  const bool with_outline_;
+  const Color outline_color_;
+  std::vector<FrameCanvas::Bitmap> glyphs_;
+  std::vector<FrameCanvas::Bitmap> outlines_;
+};
+}  // namespace
+
+// Glyphs the batch can't take are drawn right away.
+static int DrawTextBatched(GlyphBatch *batch, Canvas *c, const Font &font,
+                           int x, int y, const Color &color,
+                           const char *utf8_text, int extra_spacing) {
+  const int start_x = x;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    int advance = batch->Add(font, x, y, cp);
+    if (advance < 0) advance = font.DrawGlyph(c, x, y, color, NULL, cp);
+    x += advance + extra_spacing;
+  }
+  return x - start_x;
+}
+
+static void DrawTextLayoutBatched(GlyphBatch *batch, Canvas *c,
+                                  const Font &font, const TextLayout &layout,
+                                  int x, int y, int line_height,
+                                  const Color &color) {
+  const std::vector<TextLayout::Glyph> &glyphs = layout.glyphs();
+  for (size_t i = 0; i < glyphs.size(); ++i) {
+    const TextLayout::Glyph &g = glyphs[i];
+    const int gx = x + g.x;
+    const int gy = y + g.line * line_height;
+    if (batch->Add(font, gx, gy, g.codepoint) < 0)
+      font.DrawGlyph(c, gx, gy, color, NULL, g.codepoint);
+  }
+}
+
+int DrawText(FrameCanvas *c, const Font &font,
+             int x, int y, const Color &color, const Color *background_color,
+             const char *utf8_text, int extra_spacing) {
+  if (background_color) {
+    return DrawText(static_cast<Canvas*>(c), font, x, y, color,
+                    background_color, utf8_text, extra_spacing);
+  }
+  GlyphBatch batch(c, c, color, NULL);
+  return DrawTextBatched(&batch, c, font, x, y, color,
+                         utf8_text, extra_spacing);
+}
+
+int DrawOutlinedText(Canvas *c, const Font &font, int x, int y,
+                     const Color &color, const Color &outline_color,
+                     const char *utf8_text, int kerning_offset) {
+  GlyphBatch batch(c, NULL, color, &outline_color);
+  return DrawTextBatched(&batch, c, font, x, y, color,
+                         utf8_text, kerning_offset);
+}
+
+int DrawOutlinedText(FrameCanvas *c, const Font &font, int x, int y,
+                     const Color &color, const Color &outline_color,
+                     const char *utf8_text, int kerning_offset) {
+  GlyphBatch batch(c, c, color, &outline_color);
+  return DrawTextBatched(&batch, c, font, x, y, color,
+                         utf8_text, kerning_offset);
+}
+
+// How far DrawGlyph() advances for the given character.
+static int GlyphAdvance(const Font &font, uint32_t codepoint) {
+  int width = font.CharacterWidth(codepoint);
+  if (width < 0) width = font.CharacterWidth(0xFFFD);  // Replacement char.
+  return width < 0 ? 0 : width;
+}
+
+int MeasureText(const Font &font, const char *utf8_text, int kerning_offset) {
+  int width = 0;
+  bool first = true;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    width += GlyphAdvance(font, cp) + (first ? 0 : kerning_offset);
+    first = false;
+  }
+  return width;
+}
+
+void TextLayout::Layout(const Font &font, const char *utf8_text, int max_width,
+                        int kerning_offset, Alignment align) {
+  glyphs_.clear();
+  line_widths_.clear();
+
+  // Glyphs of the line being built, placed from x = 0.
+  size_t line_start = 0;   // Index of first glyph of current line.
+  int pen = 0;             // Where the next glyph goes.
+  bool pending_space = false;
+  const int space_advance = GlyphAdvance(font, ' ') + kerning_offset;
+
+  auto finish_line = [&]() {
+    int width = 0;
+    if (glyphs_.size() > line_start) {
+      const Glyph &last = glyphs_.back();
+      width = last.x + GlyphAdvance(font, last.codepoint);
+    }
+    int shift = 0;
+    switch (align) {
+    case ALIGN_LEFT:   shift = 0; break;
+    case ALIGN_CENTER: shift = (max_width - width) / 2; break;
+    case ALIGN_RIGHT:  shift = max_width - width; break;
+    }
+    for (size_t i = line_start; i < glyphs_.size(); ++i) {
+      glyphs_[i].x += shift;
+    }
+    line_widths_.push_back(width);
+    line_start = glyphs_.size();
+    pen = 0;
+    pending_space = false;
+  };
+
+  std::vector<uint32_t> word;
+  auto place_word = [&]() {
+    if (word.empty()) return;
+    int word_width = -kerning_offset;
+    for (size_t i = 0; i < word.size(); ++i) {
+      word_width += GlyphAdvance(font, word[i]) + kerning_offset;
+    }
+    const bool line_empty = (glyphs_.size() == line_start);
+    if (!line_empty) {
+      if (pen + (pending_space ? space_advance : 0) + word_width <= max_width) {
+        if (pending_space) pen += space_advance;
+      } else {
+        finish_line();
+      }
+    }
+    for (size_t i = 0; i < word.size(); ++i) {
+      const int advance = GlyphAdvance(font, word[i]);
+      // Too wide for a line on its own: break between characters.
+      if (pen + advance > max_width && glyphs_.size() > line_start) {
+        finish_line();
+      }
+      const int line = line_widths_.size();
+      Glyph g = { word[i], pen, line };
+      glyphs_.push_back(g);
+      pen += advance + kerning_offset;
+    }
+    word.clear();
+    pending_space = false;
+  };
+
+  bool have_content = false;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    if (cp == '\n') {
+      place_word();
+      finish_line();
+      have_content = false;
+    } else if (cp == ' ' || cp == '\t' || cp == '\r') {
+      place_word();
+      if (glyphs_.size() > line_start) pending_space = true;
+    } else {
+      word.push_back(cp);
+      have_content = true;
+    }
+  }
+  place_word();
+  if (have_content || line_widths_.empty()) {
+    finish_line();
+  }
+}
+
+void DrawTextLayout(Canvas *c, const Font &font, const TextLayout &layout,
+                    int x, int y, int line_height,
+                    const Color &color, const Color *background_color) {
+  const std::vector<TextLayout::Glyph> &glyphs = layout.glyphs();
+  for (size_t i = 0; i < glyphs.size(); ++i) {
+    const TextLayout::Glyph &g = glyphs[i];
+    font.DrawGlyph(c, x + g.x, y + g.line * line_height,
+                   color, background_color, g.codepoint);
+  }
+}
+
+void DrawTextLayout(FrameCanvas *c, const Font &font, const TextLayout &layout,
+                    int x, int y, int line_height,
+                    const Color &color, const Color *background_color) {
+  if (background_color) {
+    DrawTextLayout(static_cast<Canvas*>(c), font, layout, x, y, line_height,
+                   color, background_color);
+    return;
+  }
+  GlyphBatch batch(c, c, color, NULL);
+  DrawTextLayoutBatched(&batch, c, font, layout, x, y, line_height, color);
+}
+
+void DrawOutlinedTextLayout(Canvas *c, const Font &font,
+                            const TextLayout &layout,
+                            int x, int y, int line_height,
+                            const Color &color, const Color &outline_color) {
+  GlyphBatch batch(c, NULL, color, &outline_color);
+  DrawTextLayoutBatched(&batch, c, font, layout, x, y, line_height, color);
+}
+
+void DrawOutlinedTextLayout(FrameCanvas *c, const Font &font,
+                            const TextLayout &layout,
+                            int x, int y, int line_height,
+                            const Color &color, const Color &outline_color) {
+  GlyphBatch batch(c, c, color, &outline_color);
+  DrawTextLayoutBatched(&batch, c, font, layout, x, y, line_height, color);
+}
+
 int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int extra_spacing) {
@@ -100,6 +100,9 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     RT_OPT_COPY_IF_SET(do_gpio_init);
     RT_OPT_COPY_IF_SET(drop_priv_user);
     RT_OPT_COPY_IF_SET(drop_priv_group);
+    RT_OPT_COPY_IF_SET(output_backend);
+    RT_OPT_COPY_IF_SET(refresh_priority);
+    RT_OPT_COPY_IF_SET(refresh_cpu_mask);
 #undef RT_OPT_COPY_IF_SET
   }
 
@@ -145,6 +148,9 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_RT_OPT(do_gpio_init);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_priv_user);
     ACTUAL_VALUE_BACK_TO_RT_OPT(drop_priv_group);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(output_backend);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(refresh_priority);
+    ACTUAL_VALUE_BACK_TO_RT_OPT(refresh_cpu_mask);
 #undef ACTUAL_VALUE_BACK_TO_RT_OPT
   }
 
@@ -205,11 +211,54 @@ struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
   return from_canvas(to_matrix(matrix)->SwapOnVSync(to_canvas(canvas)));
 }
 
+bool led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                            struct LedCanvas *canvas, int64_t present_at_us,
+                            bool drop_if_late) {
+  return to_matrix(matrix)->QueueFrame(
+    to_canvas(canvas), present_at_us,
+    drop_if_late ? rgb_matrix::RGBMatrix::kDropLateFrame
+                 : rgb_matrix::RGBMatrix::kShowLateFrame);
+}
+
+struct LedCanvas *led_matrix_reclaim_frame(struct RGBLedMatrix *matrix,
+                                           int timeout_ms) {
+  return from_canvas(to_matrix(matrix)->ReclaimFrame(timeout_ms));
+}
+
+bool led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                  struct RGBLedRefreshStats *stats,
+                                  bool reset) {
+  static_assert(LED_REFRESH_OVERSHOOT_BUCKETS
+                == rgb_matrix::RGBMatrix::RefreshStats::kOvershootBuckets,
+                "Overshoot histograms need to be the same size");
+  rgb_matrix::RGBMatrix::RefreshStats cpp_stats;
+  const bool result = to_matrix(matrix)->GetRefreshStats(&cpp_stats, reset);
+  stats->refreshes = cpp_stats.refreshes;
+  stats->min_refresh_us = cpp_stats.min_refresh_us;
+  stats->avg_refresh_us = cpp_stats.avg_refresh_us;
+  stats->p99_refresh_us = cpp_stats.p99_refresh_us;
+  stats->max_refresh_us = cpp_stats.max_refresh_us;
+  stats->total_refresh_us = cpp_stats.total_refresh_us;
+  stats->output_us = cpp_stats.output_us;
+  stats->limit_wait_us = cpp_stats.limit_wait_us;
+  stats->slow_refreshes = cpp_stats.slow_refreshes;
+  stats->late_frames = cpp_stats.late_frames;
+  stats->dropped_frames = cpp_stats.dropped_frames;
+  for (int i = 0; i < LED_REFRESH_OVERSHOOT_BUCKETS; ++i)
+    stats->pulse_overshoot[i] = cpp_stats.pulse_overshoot[i];
+  return result;
+}
+
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix,
                                uint8_t brightness) {
   to_matrix(matrix)->SetBrightness(brightness);
 }
 
+void led_matrix_fade_brightness(struct RGBLedMatrix *matrix,
+                                uint8_t brightness, int duration_ms) {
+  to_matrix(matrix)->FadeBrightness(brightness, duration_ms);
+}
+
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix) {
   return to_matrix(matrix)->brightness();
 }
@@ -29,10 +29,14 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
+#include "output-backend.h"
 
 // Leave this in here for a while. Setting things from old defines.
 #if defined(ADAFRUIT_RGBMATRIX_HAT)
@@ -70,10 +74,18 @@ public:
   // these days only used internally.
   void SetGPIO(GPIO *io, bool start_thread = true);
 
+  // Real-time priority and CPU cores of the refresh thread, as in
+  // RuntimeOptions. To be set before it is started.
+  void SetRefreshPlacement(int priority, uint32_t cpu_mask);
+
   bool StartRefresh();
 
   FrameCanvas *CreateFrameCanvas();
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
+  bool QueueFrame(FrameCanvas *frame, int64_t present_at_us,
+                  LateFramePolicy late_policy);
+  FrameCanvas *ReclaimFrame(int timeout_ms);
+  bool GetRefreshStats(RefreshStats *stats, bool reset);
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
   bool SetPWMBits(uint8_t value);
@@ -82,9 +94,10 @@ public:
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
 
-  // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // Set brightness of the output in percent, 1%..100%; right away or
+  // gradually, over "duration_ms".
   void SetBrightness(uint8_t brightness);
+  void FadeBrightness(uint8_t brightness, int duration_ms);
   uint8_t brightness();
 
   uint64_t RequestInputs(uint64_t);
@@ -110,6 +123,9 @@ private:
   GPIO *io_;
   Mutex active_frame_sync_;
   UpdateThread *updater_;
+  int refresh_priority_;
+  uint32_t refresh_cpu_mask_;
+  int queued_frames_;   // Queued and not reclaimed yet.
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
   uint64_t user_output_bits_;
@@ -117,19 +133,172 @@ private:
 
 using namespace internal;
 
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Queue of up to N elements between one thread pushing and one thread
+// popping; neither ever waits for the other.
+template <typename T, uint32_t N>
+class SingleProducerQueue {
+  static_assert((N & (N - 1)) == 0, "Size needs to be a power of two");
+public:
+  SingleProducerQueue() : write_(0), read_(0) {}
+
+  // Producer: 'false' if full.
+  bool Push(const T &value) {
+    const uint32_t write = write_.load(std::memory_order_relaxed);
+    if (write - read_.load(std::memory_order_acquire) >= N) return false;
+    items_[write % N] = value;
+    write_.store(write + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer: the oldest element or NULL if empty. Valid until Pop().
+  const T *Peek() const {
+    const uint32_t read = read_.load(std::memory_order_relaxed);
+    if (write_.load(std::memory_order_acquire) == read) return NULL;
+    return &items_[read % N];
+  }
+
+  // Consumer: remove the oldest element; 'false' if empty.
+  bool Pop(T *value = NULL) {
+    const T *oldest = Peek();
+    if (oldest == NULL) return false;
+    if (value) *value = *oldest;
+    read_.store(read_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+    return true;
+  }
+
+private:
+  T items_[N];
+  std::atomic<uint32_t> write_;   // Both count forever, modulo 2^32.
+  std::atomic<uint32_t> read_;
+};
+
+// Statistics of the refresh passes. Only the refresh thread changes them,
+// so counting is a plain load and store, but they can be read any time.
+class RefreshStatsCollector {
+public:
+  RefreshStatsCollector() { Clear(); }
+
+  // Refresh thread only.
+  void Clear() {
+    refreshes_.store(0, std::memory_order_relaxed);
+    min_refresh_us_.store(UINT32_MAX, std::memory_order_relaxed);
+    max_refresh_us_.store(0, std::memory_order_relaxed);
+    total_refresh_us_.store(0, std::memory_order_relaxed);
+    output_us_.store(0, std::memory_order_relaxed);
+    limit_wait_us_.store(0, std::memory_order_relaxed);
+    slow_refreshes_.store(0, std::memory_order_relaxed);
+    late_frames_.store(0, std::memory_order_relaxed);
+    dropped_frames_.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < kBuckets; ++i)
+      histogram_[i].store(0, std::memory_order_relaxed);
+  }
+
+  void AddRefresh(uint32_t refresh_us, uint32_t output_us,
+                  uint32_t limit_wait_us, bool slow) {
+    Add(&refreshes_, 1);
+    if (refresh_us < min_refresh_us_.load(std::memory_order_relaxed))
+      min_refresh_us_.store(refresh_us, std::memory_order_relaxed);
+    if (refresh_us > max_refresh_us_.load(std::memory_order_relaxed))
+      max_refresh_us_.store(refresh_us, std::memory_order_relaxed);
+    Add(&total_refresh_us_, refresh_us);
+    Add(&output_us_, output_us);
+    Add(&limit_wait_us_, limit_wait_us);
+    if (slow) Add(&slow_refreshes_, 1);
+    Add(&histogram_[Bucket(refresh_us)], 1);
+  }
+  void AddLateFrame() { Add(&late_frames_, 1); }
+  void AddDroppedFrame() { Add(&dropped_frames_, 1); }
+
+  void Get(RGBMatrix::RefreshStats *stats) const {
+    stats->refreshes = refreshes_.load(std::memory_order_relaxed);
+    if (stats->refreshes == 0) return;
+    stats->min_refresh_us = min_refresh_us_.load(std::memory_order_relaxed);
+    stats->max_refresh_us = max_refresh_us_.load(std::memory_order_relaxed);
+    stats->total_refresh_us = total_refresh_us_.load(std::memory_order_relaxed);
+    stats->avg_refresh_us = stats->total_refresh_us / stats->refreshes;
+    stats->output_us = output_us_.load(std::memory_order_relaxed);
+    stats->limit_wait_us = limit_wait_us_.load(std::memory_order_relaxed);
+    stats->slow_refreshes = slow_refreshes_.load(std::memory_order_relaxed);
+    stats->late_frames = late_frames_.load(std::memory_order_relaxed);
+    stats->dropped_frames = dropped_frames_.load(std::memory_order_relaxed);
+
+    // The pass at 99% of all the ones counted in the histogram.
+    uint64_t counts[kBuckets];
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      counts[i] = histogram_[i].load(std::memory_order_relaxed);
+      total += counts[i];
+    }
+    const uint64_t p99_count = (99 * total + 99) / 100;
+    uint64_t running_count = 0;
+    int bucket = 0;
+    while (bucket < kBuckets - 1
+           && (running_count += counts[bucket]) < p99_count) {
+      ++bucket;
+    }
+    stats->p99_refresh_us = std::min(stats->max_refresh_us,
+                                     BucketLimit(bucket));
+  }
+
+private:
+  // Below 16 microseconds one bucket for each, then 16 for each power of 2.
+  static const int kBuckets = 29 * 16;
+  static int Bucket(uint32_t us) {
+    if (us < 16) return us;
+    const int shift = 27 - __builtin_clz(us);  // Leaves 5 bits.
+    return (shift + 1) * 16 + ((us >> shift) & 15);
+  }
+  // Largest value in "bucket".
+  static uint32_t BucketLimit(int bucket) {
+    if (bucket < 16) return bucket;
+    const int shift = bucket / 16 - 1;
+    return (((uint64_t)(16 + bucket % 16) + 1) << shift) - 1;
+  }
+
+  static void Add(std::atomic<uint64_t> *counter, uint64_t value) {
+    counter->store(counter->load(std::memory_order_relaxed) + value,
+                   std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> refreshes_;
+  std::atomic<uint32_t> min_refresh_us_;
+  std::atomic<uint32_t> max_refresh_us_;
+  std::atomic<uint64_t> total_refresh_us_;
+  std::atomic<uint64_t> output_us_;
+  std::atomic<uint64_t> limit_wait_us_;
+  std::atomic<uint64_t> slow_refreshes_;
+  std::atomic<uint64_t> late_frames_;
+  std::atomic<uint64_t> dropped_frames_;
+  std::atomic<uint64_t> histogram_[kBuckets];   // Of the refresh times.
+};
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
+// shows as flicker. So nothing in the refresh loop ever waits for another
+// thread: all exchange with the rest of the program is done with atomics.
 class RGBMatrix::Impl::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
                int pwm_dither_bits, bool show_refresh,
-               int limit_refresh_hz)
+               int limit_refresh_hz, uint8_t brightness,
+               bool luminance_correct)
     : io_(io), show_refresh_(show_refresh),
       target_frame_usec_(limit_refresh_hz < 1 ? 0 : 1e6/limit_refresh_hz),
       running_(true),
+      fade_sequence_(0), fade_from_(brightness), fade_to_(brightness),
+      fade_start_us_(0), fade_duration_us_(0),
+      luminance_correct_(luminance_correct),
+      gpio_inputs_(0),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
-    pthread_cond_init(&frame_done_, NULL);
-    pthread_cond_init(&input_change_, NULL);
+      requested_frame_multiple_(1),
+      stats_reset_requested_(false), last_refresh_us_(0) {
+    ReadFade(&fade_);
     switch (pwm_dither_bits) {
     case 0:
       start_bit_[0] = 0; start_bit_[1] = 0;
@@ -147,8 +316,7 @@ public:
   }
 
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    running_.store(false, std::memory_order_release);
   }
 
   virtual void Run() {
@@ -162,49 +330,82 @@ public:
     static const int kHoldffTimeUs = 2000 * 1000;
     uint32_t initial_holdoff_start = GetMicrosecondCounter();
     bool max_measure_enabled = false;
+    float shown_brightness = -1;
+    bool shown_luminance_correct = false;
 
-    while (running()) {
+    while (running_.load(std::memory_order_acquire)) {
       const uint32_t start_time_us = GetMicrosecondCounter();
 
-      current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+      if (stats_reset_requested_.load(std::memory_order_relaxed)) {
+        stats_reset_requested_.store(false, std::memory_order_relaxed);
+        stats_.Clear();
+        if (Framebuffer::output_enable_pulser())
+          Framebuffer::output_enable_pulser()->ClearOvershoots();
+      }
+
+      // Brightness is applied to the output, so a change or each step of a
+      // fade is just a different pulse length; nothing is re-rendered.
+      // If the fade is being changed right now, we go on with the one we
+      // have and pick up the new one next time.
+      ReadFade(&fade_);
+      const float brightness = fade_.BrightnessAt(start_time_us);
+      if (brightness != shown_brightness
+          || fade_.luminance_correct != shown_luminance_correct) {
+        shown_brightness = brightness;
+        shown_luminance_correct = fade_.luminance_correct;
+        Framebuffer::SetOutputBrightness(brightness, fade_.luminance_correct);
+      }
+
+      FrameCanvas *const frame = current_frame_.load(std::memory_order_relaxed);
+      frame->framebuffer()->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+      const uint32_t output_time_us = GetMicrosecondCounter() - start_time_us;
+
+      // Every refresh is a frame boundary for the presentation queue.
+      ShowQueuedFrame(frame);
 
       // SwapOnVSync() exchange.
-      {
-        MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
-          if (next_frame_ != NULL) {
-            current_frame_ = next_frame_;
-            next_frame_ = NULL;
-          }
-          pthread_cond_signal(&frame_done_);
+      const unsigned frame_multiple
+        = requested_frame_multiple_.load(std::memory_order_relaxed);
+      // Do fast equality test first (likely due to frame_count reset).
+      if (frame_count == frame_multiple
+          || frame_count % frame_multiple == 0) {
+        // We reset to avoid frame hick-up every couple of weeks
+        // run-time iff requested_frame_multiple_ is not a factor of 2^32.
+        frame_count = 0;
+        FrameCanvas *const next = next_frame_.load(std::memory_order_acquire);
+        if (next != NULL) {
+          current_frame_.store(next, std::memory_order_release);
+          // Hands the slot back to SwapOnVSync().
+          next_frame_.store(NULL, std::memory_order_release);
         }
+        frame_done_.Notify();
       }
 
       // Read input bits.
       const gpio_bits_t inputs = io_->Read();
       if (inputs != last_gpio_bits) {
         last_gpio_bits = inputs;
-        MutexLock l(&input_sync_);
-        gpio_inputs_ = inputs;
-        pthread_cond_signal(&input_change_);
+        gpio_inputs_.store(inputs, std::memory_order_release);
+        input_change_.Notify();
       }
 
       ++frame_count;
       ++low_bit_sequence;
 
+      uint32_t wait_start_us = 0;
       if (target_frame_usec_) {
+        wait_start_us = GetMicrosecondCounter();
         while ((GetMicrosecondCounter() - start_time_us) < target_frame_usec_) {
           // busy wait. We have our dedicated core, so ok to burn cycles.
         }
       }
 
       const uint32_t end_time_us = GetMicrosecondCounter();
+      last_refresh_us_ = end_time_us - start_time_us;
+      stats_.AddRefresh(last_refresh_us_, output_time_us,
+                        target_frame_usec_ ? end_time_us - wait_start_us : 0,
+                        target_frame_usec_ && (wait_start_us - start_time_us
+                                               > target_frame_usec_));
       if (show_refresh_) {
         uint32_t usec = end_time_us - start_time_us;
         printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
@@ -221,25 +422,150 @@ public:
     }
   }
 
+  // Only to be called from one thread at a time.
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
+    requested_frame_multiple_.store(frame_fraction, std::memory_order_relaxed);
+    // Only the refresh thread changes it, and only to a frame we hand over.
+    FrameCanvas *const previous
+      = current_frame_.load(std::memory_order_acquire);
+    if (other == NULL) {
+      frame_done_.WaitChange(frame_done_.count());
+      return previous;
+    }
+    next_frame_.store(other, std::memory_order_release);
+    for (;;) {
+      const uint32_t seen = frame_done_.count();
+      if (next_frame_.load(std::memory_order_acquire) == NULL)
+        break;
+      frame_done_.WaitChange(seen);
+    }
     return previous;
   }
 
+  // Presentation queue. Only to be used from one thread at a time.
+  bool QueueFrame(FrameCanvas *frame, int64_t present_at_us,
+                  bool drop_if_late) {
+    const QueuedFrame queued = { frame, present_at_us, drop_if_late };
+    return queue_.Push(queued);
+  }
+
+  FrameCanvas *ReclaimFrame(int timeout_ms) {
+    uint32_t seen = frame_returned_.count();
+    FrameCanvas *frame = NULL;
+    while (!returned_.Pop(&frame) && timeout_ms != 0) {
+      if (!frame_returned_.WaitChange(seen, timeout_ms))
+        return NULL;
+      seen = frame_returned_.count();
+    }
+    return frame;
+  }
+
+  // Go from the current brightness to "brightness" percent, linearly over
+  // "duration_us" of refreshes.
+  void FadeBrightness(float brightness, uint32_t duration_us,
+                      bool luminance_correct) {
+    MutexLock l(&fade_write_sync_);   // Among writers only.
+    const uint32_t now_us = GetMicrosecondCounter();
+    const float from = LoadFade().BrightnessAt(now_us);  // Only writer.
+
+    // Odd sequence while writing.
+    const uint32_t sequence = fade_sequence_.load(std::memory_order_relaxed);
+    fade_sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    fade_from_.store(from, std::memory_order_relaxed);
+    fade_to_.store(brightness, std::memory_order_relaxed);
+    fade_start_us_.store(now_us, std::memory_order_relaxed);
+    fade_duration_us_.store(duration_us, std::memory_order_relaxed);
+    luminance_correct_.store(luminance_correct, std::memory_order_relaxed);
+    fade_sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
   gpio_bits_t AwaitInputChange(int timeout_ms) {
-    MutexLock l(&input_sync_);
-    input_sync_.WaitOn(&input_change_, timeout_ms);
-    return gpio_inputs_;
+    input_change_.WaitChange(input_change_.count(), timeout_ms);
+    return gpio_inputs_.load(std::memory_order_acquire);
+  }
+
+  // Any thread. Resetting is left to the refresh thread, the only one
+  // changing the statistics, at the start of the next pass.
+  void GetStats(RGBMatrix::RefreshStats *stats, bool reset) {
+    stats_.Get(stats);
+    const PinPulser *pulser = Framebuffer::output_enable_pulser();
+    for (int i = 0; pulser && i < PinPulser::kOvershootBuckets; ++i)
+      stats->pulse_overshoot[i] = pulser->overshoots(i);
+    if (reset) stats_reset_requested_.store(true, std::memory_order_relaxed);
   }
 
 private:
-  inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+  struct QueuedFrame {
+    FrameCanvas *frame;
+    int64_t present_at_us;
+    bool drop_if_late;
+  };
+
+  // Replace the "shown" frame with the queued one that is due, if any.
+  void ShowQueuedFrame(FrameCanvas *shown) {
+    if (queue_.Peek() == NULL) return;
+    const int64_t now_us = GetMonotonicMicros();
+    bool returned = false;
+    const QueuedFrame *next;
+    while ((next = queue_.Peek()) != NULL && next->present_at_us <= now_us) {
+      const QueuedFrame due = *next;
+      queue_.Pop();
+      next = queue_.Peek();
+      returned = true;
+      if (due.drop_if_late && next != NULL && next->present_at_us <= now_us) {
+        returned_.Push(due.frame);   // The next one is due as well.
+        stats_.AddDroppedFrame();
+        continue;
+      }
+      // Due before the previous refresh already.
+      if (now_us - due.present_at_us > last_refresh_us_) stats_.AddLateFrame();
+      current_frame_.store(due.frame, std::memory_order_release);
+      // If the producer doesn't reclaim the frames, it doesn't get this one
+      // back; we can't wait for it.
+      returned_.Push(shown);
+      break;
+    }
+    if (returned) frame_returned_.Notify();
+  }
+
+  struct Fade {
+    float from;
+    float to;
+    uint32_t start_us;
+    uint32_t duration_us;
+    bool luminance_correct;
+
+    // Brightness of the fade at the given time.
+    float BrightnessAt(uint32_t now_us) const {
+      const uint32_t elapsed_us = now_us - start_us;
+      if (elapsed_us >= duration_us) return to;
+      return from + (to - from) * elapsed_us / duration_us;
+    }
+  };
+
+  Fade LoadFade() const {
+    Fade result;
+    result.from = fade_from_.load(std::memory_order_relaxed);
+    result.to = fade_to_.load(std::memory_order_relaxed);
+    result.start_us = fade_start_us_.load(std::memory_order_relaxed);
+    result.duration_us = fade_duration_us_.load(std::memory_order_relaxed);
+    result.luminance_correct
+      = luminance_correct_.load(std::memory_order_relaxed);
+    return result;
+  }
+
+  // Read the fade without waiting. Returns 'false' and leaves "fade" as it
+  // was if FadeBrightness() is changing it at the same time.
+  bool ReadFade(Fade *fade) const {
+    const uint32_t sequence = fade_sequence_.load(std::memory_order_acquire);
+    if (sequence & 1) return false;
+    const Fade result = LoadFade();
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (fade_sequence_.load(std::memory_order_relaxed) != sequence)
+      return false;
+    *fade = result;
+    return true;
   }
 
   GPIO *const io_;
@@ -247,18 +573,39 @@ private:
   const uint32_t target_frame_usec_;
   uint32_t start_bit_[4];
 
-  Mutex running_mutex_;
-  bool running_;
-
-  Mutex input_sync_;
-  pthread_cond_t input_change_;
-  gpio_bits_t gpio_inputs_;
-
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
-  unsigned requested_frame_multiple_;
+  std::atomic<bool> running_;
+
+  // The fade, changed by FadeBrightness(). A sequence lock: the refresh
+  // thread only reads it, and never waits for the writer.
+  Mutex fade_write_sync_;
+  std::atomic<uint32_t> fade_sequence_;
+  std::atomic<float> fade_from_;
+  std::atomic<float> fade_to_;
+  std::atomic<uint32_t> fade_start_us_;
+  std::atomic<uint32_t> fade_duration_us_;
+  std::atomic<bool> luminance_correct_;
+  Fade fade_;   // The one last read by the refresh thread.
+
+  EventCounter input_change_;
+  std::atomic<gpio_bits_t> gpio_inputs_;
+
+  // SwapOnVSync() sets next_frame_, the refresh thread takes it over into
+  // current_frame_ at the next frame boundary and sets it back to NULL.
+  EventCounter frame_done_;
+  std::atomic<FrameCanvas*> current_frame_;
+  std::atomic<FrameCanvas*> next_frame_;
+  std::atomic<unsigned> requested_frame_multiple_;
+
+  // QueueFrame() -> queue_ -> shown -> returned_ -> ReclaimFrame().
+  // Besides the frames queued, the frame shown before the first one and
+  // frames handed over with SwapOnVSync() can be returned.
+  SingleProducerQueue<QueuedFrame, RGBMatrix::kMaxQueuedFrames> queue_;
+  SingleProducerQueue<FrameCanvas*, 2 * RGBMatrix::kMaxQueuedFrames> returned_;
+  EventCounter frame_returned_;
+
+  RefreshStatsCollector stats_;
+  std::atomic<bool> stats_reset_requested_;
+  uint32_t last_refresh_us_;   // Refresh thread only.
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -355,7 +702,8 @@ static void PrintOptions(const RGBMatrix::Options &o) {
 #endif  // DEBUG_MATRIX_OPTIONS
 
 RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
+  : params_(options), io_(NULL), updater_(NULL), refresh_priority_(0),
+    refresh_cpu_mask_(0), queued_frames_(0), shared_pixel_mapper_(NULL),
     user_output_bits_(0) {
   assert(params_.Validate(NULL));
 #if DEBUG_MATRIX_OPTIONS
@@ -465,11 +813,18 @@ void RGBMatrix::Impl::SetGPIO(GPIO *io, bool start_thread) {
   }
 }
 
+void RGBMatrix::Impl::SetRefreshPlacement(int priority, uint32_t cpu_mask) {
+  refresh_priority_ = priority;
+  refresh_cpu_mask_ = cpu_mask;
+}
+
 bool RGBMatrix::Impl::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
     updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
                                 params_.show_refresh_rate,
-                                params_.limit_refresh_rate_hz);
+                                params_.limit_refresh_rate_hz,
+                                params_.brightness, do_luminance_correct_);
+    // Unless chosen otherwise:
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
     // So let's tie it to the last CPU available.
@@ -477,7 +832,13 @@ bool RGBMatrix::Impl::StartRefresh() {
     //   core #3 will succeed.
     // The Raspberry Pi1 only has one core, so this affinity
     //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    // Without hardware there is no timing to protect, so don't compete
+    // with the rest of the system.
+    int priority = refresh_priority_;
+    if (priority == 0) priority = io_->headless() ? -1 : 99;
+    uint32_t cpu_mask = refresh_cpu_mask_;
+    if (cpu_mask == 0) cpu_mask = io_->headless() ? 0 : (1<<3);
+    updater_->Start(std::max(0, priority), cpu_mask);
   }
   return updater_ != NULL;
 }
@@ -498,7 +859,7 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
 
   result->framebuffer()->SetPWMBits(params_.pwm_bits);
   result->framebuffer()->set_luminance_correct(do_luminance_correct_);
-  result->framebuffer()->SetBrightness(params_.brightness);
+  // Brightness is applied to the output; see SetBrightness().
 
   created_frames_.push_back(result);
 
@@ -522,11 +883,40 @@ FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other,
                                           unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
   if (!updater_) return NULL;
+  if (other) other->framebuffer()->UpdatePlaneRuns();
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
   if (other) active_ = other;
   return previous;
 }
 
+bool RGBMatrix::Impl::QueueFrame(FrameCanvas *frame, int64_t present_at_us,
+                                 LateFramePolicy late_policy) {
+  if (!updater_ || frame == NULL || queued_frames_ >= kMaxQueuedFrames)
+    return false;
+  frame->framebuffer()->UpdatePlaneRuns();
+  if (!updater_->QueueFrame(frame, present_at_us,
+                            late_policy == kDropLateFrame))
+    return false;
+  ++queued_frames_;
+  active_ = frame;
+  return true;
+}
+
+bool RGBMatrix::Impl::GetRefreshStats(RefreshStats *stats, bool reset) {
+  *stats = RefreshStats();
+  if (!updater_) return false;
+  updater_->GetStats(stats, reset);
+  return true;
+}
+
+FrameCanvas *RGBMatrix::Impl::ReclaimFrame(int timeout_ms) {
+  if (!updater_) return NULL;
+  FrameCanvas *const frame = updater_->ReclaimFrame(timeout_ms);
+  // Not counting the frames returned that were never queued.
+  if (frame != NULL && queued_frames_ > 0) --queued_frames_;
+  return frame;
+}
+
 uint64_t RGBMatrix::Impl::AwaitInputChange(int timeout_ms) {
   if (!updater_) return 0;
   return updater_->AwaitInputChange(timeout_ms);
@@ -545,16 +935,23 @@ uint8_t RGBMatrix::Impl::pwmbits() { return params_.pwm_bits; }
 void RGBMatrix::Impl::set_luminance_correct(bool on) {
   active_->framebuffer()->set_luminance_correct(on);
   do_luminance_correct_ = on;
+  SetBrightness(params_.brightness);   // Same perceived output brightness.
 }
 bool RGBMatrix::Impl::luminance_correct() const {
   return do_luminance_correct_;
 }
 
 void RGBMatrix::Impl::SetBrightness(uint8_t brightness) {
-  for (size_t i = 0; i < created_frames_.size(); ++i) {
-    created_frames_[i]->framebuffer()->SetBrightness(brightness);
+  FadeBrightness(brightness, 0);
+}
+
+void RGBMatrix::Impl::FadeBrightness(uint8_t brightness, int duration_ms) {
+  params_.brightness = std::min(100, std::max(1, (int)brightness));
+  if (updater_) {
+    updater_->FadeBrightness(params_.brightness,
+                             std::max(0, duration_ms) * 1000,
+                             do_luminance_correct_);
   }
-  params_.brightness = brightness;
 }
 
 uint8_t RGBMatrix::Impl::brightness() {
@@ -571,7 +968,7 @@ bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
     return false;
   }
   PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
+    new_width, new_height, *shared_pixel_mapper_);
   for (int y = 0; y < new_height; ++y) {
     for (int x = 0; x < new_width; ++x) {
       int orig_x = -1, orig_y = -1;
@@ -650,9 +1047,26 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
     return NULL;
   }
 
+  if (runtime_options.refresh_priority < -1
+      || runtime_options.refresh_priority > 99) {
+    fprintf(stderr, "--led-refresh-priority=%d is outside usable range\n",
+            runtime_options.refresh_priority);
+    return NULL;
+  }
+
   static GPIO io;  // This static var is a little bit icky.
-  if (runtime_options.do_gpio_init
-      && !io.Init(runtime_options.gpio_slowdown)) {
+  const bool use_backend = runtime_options.output_backend != NULL
+    && strcmp(runtime_options.output_backend, "gpio") != 0;
+  if (runtime_options.do_gpio_init && use_backend) {
+    OutputBackend *backend
+      = OutputBackend::Create(runtime_options.output_backend);
+    if (backend == NULL)
+      return NULL;
+    io.InitHeadless(runtime_options.gpio_slowdown);
+    Framebuffer::SetOutputBackend(backend);
+  }
+  else if (runtime_options.do_gpio_init
+           && !io.Init(runtime_options.gpio_slowdown)) {
     fprintf(stderr, "Must run as root to be able to access /dev/mem\n"
             "Prepend 'sudo' to the command\n");
     return NULL;
@@ -663,6 +1077,8 @@ RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
   }
 
   RGBMatrix::Impl *result = new RGBMatrix::Impl(NULL, options);
+  result->SetRefreshPlacement(runtime_options.refresh_priority,
+                              runtime_options.refresh_cpu_mask);
   // Allowing daemon also means we are allowed to start the thread now.
   const bool allow_daemon = !(runtime_options.daemon < 0);
   if (runtime_options.do_gpio_init)
@@ -717,11 +1133,34 @@ bool RGBMatrix::luminance_correct() const { return impl_->luminance_correct(); }
 void RGBMatrix::SetBrightness(uint8_t brightness) {
   impl_->SetBrightness(brightness);
 }
+void RGBMatrix::FadeBrightness(uint8_t brightness, int duration_ms) {
+  impl_->FadeBrightness(brightness, duration_ms);
+}
 uint8_t RGBMatrix::brightness() { return impl_->brightness(); }
 
 uint64_t RGBMatrix::RequestInputs(uint64_t all_interested_bits) {
   return impl_->RequestInputs(all_interested_bits);
 }
+bool RGBMatrix::QueueFrame(FrameCanvas *frame, int64_t present_at_us,
+                           LateFramePolicy late_policy) {
+  return impl_->QueueFrame(frame, present_at_us, late_policy);
+}
+
+FrameCanvas *RGBMatrix::ReclaimFrame(int timeout_ms) {
+  return impl_->ReclaimFrame(timeout_ms);
+}
+
+RGBMatrix::RefreshStats::RefreshStats()
+  : refreshes(0), min_refresh_us(0), avg_refresh_us(0), p99_refresh_us(0),
+    max_refresh_us(0), total_refresh_us(0), output_us(0), limit_wait_us(0),
+    slow_refreshes(0), late_frames(0), dropped_frames(0) {
+  for (int i = 0; i < kOvershootBuckets; ++i) pulse_overshoot[i] = 0;
+}
+
+bool RGBMatrix::GetRefreshStats(RefreshStats *stats, bool reset) {
+  return impl_->GetRefreshStats(stats, reset);
+}
+
 uint64_t RGBMatrix::AwaitInputChange(int timeout_ms) {
   return impl_->AwaitInputChange(timeout_ms);
 }
@@ -791,4 +1230,17 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+void FrameCanvas::SetPixelRow(int x, int y, int width, const uint8_t *pixels,
+                              bool is_bgr) {
+  frame_->SetPixelRow(x, y, width, pixels, is_bgr);
+}
+void FrameCanvas::DrawBitmaps(const Bitmap *bitmaps, int count,
+                              uint8_t red, uint8_t green, uint8_t blue) {
+  internal::Framebuffer::PlaneColor color;
+  frame_->PreparePlaneColor(red, green, blue, &color);
+  for (int i = 0; i < count; ++i) {
+    const Bitmap &b = bitmaps[i];
+    frame_->DrawBitmap(b.rows, b.row_bits, b.height, b.x, b.y, &color);
+  }
+}
 }  // end namespace rgb_matrix
@@ -41,7 +41,10 @@ RuntimeOptions::RuntimeOptions() :
   drop_privileges(1),   // Encourage good practice: drop privileges by default.
   do_gpio_init(true),
   drop_priv_user("daemon"),
-  drop_priv_group("daemon")
+  drop_priv_group("daemon"),
+  output_backend("gpio"),
+  refresh_priority(0),  // Automatic: real-time if there are panels.
+  refresh_cpu_mask(0)
 {
   // Nothing to see here.
 }
@@ -130,6 +133,45 @@ static bool ConsumeStringFlag(const char *flag_name,
   return true;
 }
 
+// A list of CPU cores such as "2,3" as bitmask; "any" is all of them,
+// "auto" is 0.
+static bool ConsumeCpuListFlag(const char *flag_name,
+                               argv_iterator &pos, const argv_iterator end,
+                               uint32_t *result_value, int *error) {
+  const char *value = NULL;
+  if (!ConsumeStringFlag(flag_name, pos, end, &value, error))
+    return false;  // not consumed.
+  if (value == NULL)
+    return true;   // consumed, but error.
+  if (strcmp(value, "any") == 0) {
+    *result_value = ~(uint32_t)0;
+    return true;
+  }
+  if (strcmp(value, "auto") == 0) {
+    *result_value = 0;
+    return true;
+  }
+  uint32_t mask = 0;
+  const char *s = value;
+  for (;;) {
+    char *end_value = NULL;
+    const long cpu = strtol(s, &end_value, 10);
+    if (end_value == s || cpu < 0 || cpu > 31
+        || (*end_value != ',' && *end_value != '\0')) {
+      fprintf(stderr, "Couldn't parse parameter %s%s=%s "
+              "(Expected comma separated CPU numbers 0..31, 'any' or 'auto')\n",
+              OPTION_PREFIX, flag_name, value);
+      ++*error;
+      return true;  // consumed, but error
+    }
+    mask |= (uint32_t)1 << cpu;
+    if (*end_value == '\0') break;
+    s = end_value + 1;
+  }
+  *result_value = mask;
+  return true;  // consumed.
+}
+
 static bool FlagInit(int &argc, char **&argv,
                      RGBMatrix::Options *mopts,
                      RuntimeOptions *ropts,
@@ -236,6 +278,18 @@ static bool FlagInit(int &argc, char **&argv,
                             &ropts->drop_priv_group, &err)) {
         continue;
       }
+      if (ConsumeStringFlag("backend", it, end,
+                            &ropts->output_backend, &err)) {
+        continue;
+      }
+      if (ConsumeIntFlag("refresh-priority", it, end,
+                         &ropts->refresh_priority, &err)) {
+        continue;
+      }
+      if (ConsumeCpuListFlag("refresh-cpus", it, end,
+                             &ropts->refresh_cpu_mask, &err)) {
+        continue;
+      }
 
       if (strncmp(*it, OPTION_PREFIX, OPTION_PREFIX_LEN) == 0) {
         fprintf(stderr, "Option %s starts with %s but it is unknown. Typo?\n",
@@ -279,6 +333,19 @@ bool ParseOptionsFromFlags(int *argc, char ***argv,
   return FlagInit(*argc, *argv, mopt, ropt, remove_consumed_options);
 }
 
+static std::string FormatCpuList(uint32_t mask) {
+  if (mask == 0) return "auto";
+  if (mask == ~(uint32_t)0) return "any";
+  std::string result;
+  char buffer[8];
+  for (int cpu = 0; cpu < 32; ++cpu) {
+    if ((mask & ((uint32_t)1 << cpu)) == 0) continue;
+    snprintf(buffer, sizeof(buffer), "%s%d", result.empty() ? "" : ",", cpu);
+    result.append(buffer);
+  }
+  return result;
+}
+
 static std::string CreateAvailableMultiplexString(
   const internal::MuxMapperList &m) {
   std::string result;
@@ -355,6 +422,15 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
   fprintf(out, "\t--led-slowdown-gpio=<0..4>: "
           "Slowdown GPIO. Needed for faster Pis/slower panels "
           "(Default: %d (2 on Pi4, 1 other)).\n", r.gpio_slowdown);
+  fprintf(out, "\t--led-backend=<backend>   : Where the output goes: "
+          "'gpio', 'virtual:<dir>' (PPM frames to <dir>) or 'null' "
+          "(Default: '%s').\n", r.output_backend);
+  fprintf(out, "\t--led-refresh-priority=<-1..99>: Real-time priority of "
+          "the refresh thread; -1: normal scheduling, 0: automatic "
+          "(Default: %d).\n", r.refresh_priority);
+  fprintf(out, "\t--led-refresh-cpus=<list> : CPU cores of the refresh "
+          "thread, e.g. '3' or '2,3'; 'any' or 'auto' (Default: '%s').\n",
+          FormatCpuList(r.refresh_cpu_mask).c_str());
   if (r.daemon >= 0) {
     const bool on = (r.daemon > 0);
     fprintf(out,
@@ -0,0 +1,187 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "output-backend.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framebuffer-internal.h"
+#include "gpio.h"
+
+namespace rgb_matrix {
+namespace internal {
+
+static int64_t GetMonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Pulser without a pin. If "keep_time", pulses take as long as they would
+// on the hardware; so that short pulses don't each cost a sleep, the time
+// is accumulated and slept off in larger chunks.
+class EmulatedPinPulser : public PinPulser {
+public:
+  EmulatedPinPulser(const std::vector<int> &nano_specs, bool keep_time)
+    : nano_specs_(nano_specs), scaled_specs_(nano_specs),
+      keep_time_(keep_time), scale_(1.0f), end_ns_(0) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    if (!keep_time_) return;
+    const int64_t now = GetMonotonicNanos();
+    if (end_ns_ < now) end_ns_ = now;
+    end_ns_ += scaled_specs_[time_spec_number];
+  }
+
+  virtual void WaitPulseFinished() {
+    static const int64_t kMinSleepNanos = 200000;
+    if (!keep_time_ || end_ns_ - GetMonotonicNanos() < kMinSleepNanos)
+      return;
+    struct timespec end;
+    end.tv_sec = end_ns_ / 1000000000;
+    end.tv_nsec = end_ns_ % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL)
+           == EINTR) {}
+    RecordOvershoot((GetMonotonicNanos() - end_ns_) / 1000);
+  }
+
+  virtual void SetPulseScale(float factor) {
+    scale_ = factor;
+    for (size_t i = 0; i < nano_specs_.size(); ++i) {
+      scaled_specs_[i] = lroundf(nano_specs_[i] * factor);
+    }
+  }
+
+  float scale() const { return scale_; }
+
+private:
+  const std::vector<int> nano_specs_;
+  std::vector<int> scaled_specs_;
+  const bool keep_time_;
+  float scale_;
+  int64_t end_ns_;    // When the pulses sent so far are done.
+};
+
+namespace {
+class NullOutput : public OutputBackend {
+public:
+  virtual PinPulser *CreatePulser(const std::vector<int> &nano_wait_spec) {
+    return new EmulatedPinPulser(nano_wait_spec, false);
+  }
+  virtual void FrameShown(const Framebuffer &frame) {}
+};
+}  // anonymous namespace
+
+OutputBackend *OutputBackend::Create(const char *spec) {
+  static const char kVirtualPrefix[] = "virtual:";
+  if (strcmp(spec, "null") == 0)
+    return new NullOutput();
+  if (strncmp(spec, kVirtualPrefix, strlen(kVirtualPrefix)) == 0
+      && spec[strlen(kVirtualPrefix)] != '\0') {
+    VirtualOutput *result = new VirtualOutput(spec + strlen(kVirtualPrefix));
+    if (!result->Init()) {
+      delete result;
+      return NULL;
+    }
+    return result;
+  }
+  fprintf(stderr, "Unknown --led-backend=%s. Expected 'gpio', 'null' or "
+          "'virtual:<directory>'\n", spec);
+  return NULL;
+}
+
+VirtualOutput::VirtualOutput(const char *directory)
+  : directory_(directory), frame_list_(NULL), pulser_(NULL), passes_(0),
+    frames_(0), write_failed_(false), shown_scale_(0) {
+}
+
+VirtualOutput::~VirtualOutput() {
+  if (frame_list_ != NULL) fclose(frame_list_);
+}
+
+bool VirtualOutput::Init() {
+  if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Can't create directory '%s' for the virtual output: %s\n",
+            directory_.c_str(), strerror(errno));
+    return false;
+  }
+  const std::string list_name = directory_ + "/frames.txt";
+  frame_list_ = fopen(list_name.c_str(), "w");
+  if (frame_list_ == NULL) {
+    fprintf(stderr, "Can't write '%s': %s\n", list_name.c_str(),
+            strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+PinPulser *VirtualOutput::CreatePulser(const std::vector<int> &nano_wait_spec) {
+  pulser_ = new EmulatedPinPulser(nano_wait_spec, true);
+  return pulser_;
+}
+
+void VirtualOutput::FrameShown(const Framebuffer &frame) {
+  ++passes_;
+  const char *data;
+  size_t len;
+  frame.Serialize(&data, &len);
+  const float scale = pulser_->scale();
+  if (scale == shown_scale_ && len == shown_.size()
+      && memcmp(data, shown_.data(), len) == 0) {
+    return;  // Still the same picture.
+  }
+  shown_.assign(data, len);
+  shown_scale_ = scale;
+
+  rgb_.resize(3 * frame.width() * frame.height());
+  frame.Decode(scale, rgb_.data());
+  if (!WriteFrame(frame.width(), frame.height()) && !write_failed_) {
+    write_failed_ = true;  // Only complain once.
+    fprintf(stderr, "Can't write frame %d to '%s': %s\n", frames_,
+            directory_.c_str(), strerror(errno));
+  }
+}
+
+bool VirtualOutput::WriteFrame(int width, int height) {
+  ++frames_;
+  char name[32];
+  snprintf(name, sizeof(name), "frame-%06d.ppm", frames_);
+  // Write to a temporary file and rename, so that readers never see a
+  // partial frame.
+  const std::string filename = directory_ + "/" + name;
+  const std::string tmp_name = filename + ".tmp";
+  FILE *out = fopen(tmp_name.c_str(), "wb");
+  if (out == NULL) return false;
+  fprintf(out, "P6\n%d %d\n255\n", width, height);
+  bool success = (fwrite(rgb_.data(), 1, rgb_.size(), out) == rgb_.size());
+  success &= (fclose(out) == 0);
+  if (!success || rename(tmp_name.c_str(), filename.c_str()) != 0) {
+    unlink(tmp_name.c_str());
+    return false;
+  }
+  fprintf(frame_list_, "%s %llu %lld\n", name, (unsigned long long)passes_,
+          (long long)(GetMonotonicNanos() / 1000));
+  fflush(frame_list_);
+  return true;
+}
+
+}  // namespace internal
+}  // namespace rgb_matrix
@@ -0,0 +1,94 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_OUTPUT_BACKEND_H
+#define RPI_OUTPUT_BACKEND_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+namespace rgb_matrix {
+class PinPulser;
+namespace internal {
+class EmulatedPinPulser;
+class Framebuffer;
+
+// Where the refresh sends its frames if not to panels on the GPIO pins.
+//
+// With an output backend, the GPIO is initialized headless and the
+// refresh thread runs exactly as it would with hardware: it clocks out every
+// bitplane of every row, just into memory. The backend provides the pin
+// pulser timing the output enable and is told after each pass over the
+// frame.
+class OutputBackend {
+public:
+  // Create a backend from its --led-backend specification:
+  //   "null"                discard all output, as fast as possible, for
+  //                         measuring the refresh throughput.
+  //   "virtual:<directory>" keep the timing of real panels and write each
+  //                         new frame as shown to <directory> as PPM image.
+  // Returns NULL and prints a message if the specification is not valid.
+  static OutputBackend *Create(const char *spec);
+
+  virtual ~OutputBackend() {}
+
+  // Create the pulser for the output enable, with the wait times per
+  // bitplane as PinPulser::Create().
+  virtual PinPulser *CreatePulser(const std::vector<int> &nano_wait_spec) = 0;
+
+  // Called by Framebuffer::DumpToMatrix() after each pass.
+  virtual void FrameShown(const Framebuffer &frame) = 0;
+};
+
+// Writes each frame that differs from the previous one as
+// <directory>/frame-NNNNNN.ppm, colors decoded from the bitplanes with the
+// output brightness applied, so exactly what would be visible. Each frame
+// is listed in <directory>/frames.txt with the number of the pass that first
+// showed it and the CLOCK_MONOTONIC time in microseconds:
+//   frame-000001.ppm 1 123456789
+// The directory can be on a tmpfs like /dev/shm for a cheap shared memory
+// view of the display.
+class VirtualOutput : public OutputBackend {
+public:
+  explicit VirtualOutput(const char *directory);
+  virtual ~VirtualOutput();
+
+  // Create the directory if needed and open the frame list.
+  bool Init();
+
+  virtual PinPulser *CreatePulser(const std::vector<int> &nano_wait_spec);
+  virtual void FrameShown(const Framebuffer &frame);
+
+private:
+  bool WriteFrame(int width, int height);
+
+  const std::string directory_;
+  FILE *frame_list_;
+  EmulatedPinPulser *pulser_;  // Owned by the framebuffer.
+  uint64_t passes_;
+  int frames_;
+  bool write_failed_;
+
+  std::string shown_;   // Bitplanes of the last frame written.
+  float shown_scale_;
+  std::vector<uint8_t> rgb_;
+};
+
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_OUTPUT_BACKEND_H
@@ -0,0 +1,579 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Microbenchmarks of the rendering and refresh hot paths: the FrameCanvas
+// pixel operations, SetImage(), DrawText() and DrawGlyph() with every font,
+// loading fonts from the bdf file and from its cache file, the pixel
+// mappers, reading a content stream and DumpToMatrix() into a headless GPIO.
+// Also lists the memory used by the pixel map, as comment.
+//
+// Runs without hardware access and prints one tab separated line per
+// benchmark, so that results can be kept and compared:
+//   benchmark  geometry  iterations  min_ns  median_ns
+// Times are per operation (per frame, call or pass), the fastest and the
+// median of several batches of a fixed number of iterations. Each geometry
+// is run in a separate process, as the hardware setup of the library is
+// global.
+//
+//   make bench
+//   ./render-benchmark [-f fonts-dir] > baseline.tsv
+//   ./render-benchmark [-f fonts-dir] -c baseline.tsv [-t percent]
+//
+// With -c, the fastest time of each is compared to the baseline (being the
+// least affected by other load on the machine); if any is more than
+// -t percent (default 15) slower, the regressions are listed on stderr and
+// the exit code is 1. Only compare results from the same machine, run
+// without other load.
+
+#include "led-matrix.h"
+#include "content-streamer.h"
+#include "graphics.h"
+#include "pixel-mapper.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "framebuffer-internal.h"
+#include "gpio.h"
+#include "output-backend.h"
+
+using namespace rgb_matrix;
+
+static const int kRepeats = 7;   // Batches per benchmark.
+static const char kTextLine[] = "The door was open all night.";
+
+struct Geometry {
+  int cols, rows, chain, parallel;
+  const char *hardware_mapping;
+};
+static const Geometry kGeometries[] = {
+  { 64, 32, 6, 1, "adafruit-hat" },
+  { 64, 64, 1, 3, "regular" },
+  { 64, 64, 16, 3, "regular" },   // A large wall.
+};
+
+struct LoadedFont {
+  std::string name;
+  Font *font;
+};
+
+static int64_t GetMonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static std::string GeometryName(const Geometry &g) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%dx%d-chain%d-parallel%d",
+           g.cols, g.rows, g.chain, g.parallel);
+  return buffer;
+}
+
+// Print the result of batches of "iterations" operations each.
+static void Report(const std::string &name, const std::string &geometry,
+                   int iterations, std::vector<double> batch_ns) {
+  std::sort(batch_ns.begin(), batch_ns.end());
+  printf("%s\t%s\t%d\t%.1f\t%.1f\n", name.c_str(), geometry.c_str(),
+         iterations, batch_ns.front() / iterations,
+         batch_ns[batch_ns.size() / 2] / iterations);
+}
+
+template <typename Operation>
+static void Measure(const std::string &name, const std::string &geometry,
+                    int iterations, Operation op) {
+  std::vector<double> batch_ns;
+  for (int r = 0; r < kRepeats; ++r) {
+    const int64_t start = GetMonotonicNanos();
+    for (int i = 0; i < iterations; ++i) op(i);
+    batch_ns.push_back(GetMonotonicNanos() - start);
+  }
+  Report(name, geometry, iterations, batch_ns);
+}
+
+// Pulser that doesn't wait, but adds up the pulses, to verify that every
+// DumpToMatrix() pass showed all the rows and bitplanes, also those shown
+// together.
+class CountingPinPulser : public PinPulser {
+public:
+  CountingPinPulser(const std::vector<int> &specs)
+    : specs(specs), pulses(0), nanos(0) {}
+  virtual void SendPulse(int time_spec_number) {
+    ++pulses;
+    nanos += specs[time_spec_number];
+  }
+  virtual void SetPulseScale(float factor) {}
+  const std::vector<int> specs;
+  int64_t pulses;
+  int64_t nanos;
+};
+
+class CountingOutput : public internal::OutputBackend {
+public:
+  CountingOutput() : pulser(NULL), passes(0) {}
+  virtual PinPulser *CreatePulser(const std::vector<int> &nano_wait_spec) {
+    pulser = new CountingPinPulser(nano_wait_spec);
+    return pulser;
+  }
+  virtual void FrameShown(const internal::Framebuffer &frame) { ++passes; }
+  CountingPinPulser *pulser;
+  int64_t passes;
+};
+
+static RGBMatrix *CreateMatrix(const Geometry &g) {
+  RGBMatrix::Options options;
+  options.cols = g.cols;
+  options.rows = g.rows;
+  options.chain_length = g.chain;
+  options.parallel = g.parallel;
+  options.hardware_mapping = g.hardware_mapping;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;   // Only render to memory.
+  runtime.drop_privileges = 0;
+  return RGBMatrix::CreateFromOptions(options, runtime);
+}
+
+static const char *MapperParameter(const std::string &name) {
+  if (name == "Rotate") return "90";
+  if (name == "Mirror") return "H";
+  return NULL;
+}
+
+static bool BenchmarkCanvas(const Geometry &g,
+                            const std::vector<LoadedFont> &fonts) {
+  const std::string geometry = GeometryName(g);
+  RGBMatrix *matrix = CreateMatrix(g);
+  if (matrix == NULL)
+    return false;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  FrameCanvas *other = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+
+  Measure("FrameCanvas::SetPixel/frame", geometry, 20, [&](int i) {
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) canvas->SetPixel(x, y, x, y, i);
+      }
+    });
+  Measure("FrameCanvas::Fill/frame", geometry, 200, [&](int i) {
+      canvas->Fill(i, 255 - i, 128);
+    });
+  Measure("FrameCanvas::Clear/frame", geometry, 200, [&](int i) {
+      canvas->Clear();
+    });
+  other->Fill(10, 20, 30);
+  Measure("FrameCanvas::CopyFrom/frame", geometry, 200, [&](int i) {
+      canvas->CopyFrom(*other);
+    });
+
+  std::vector<Color> colors(width * height);
+  std::vector<uint8_t> image(3 * width * height);
+  for (int i = 0; i < width * height; ++i) {
+    colors[i] = Color(i, i >> 3, i >> 6);
+    image[3 * i] = i;
+    image[3 * i + 1] = i >> 3;
+    image[3 * i + 2] = i >> 6;
+  }
+  Measure("FrameCanvas::SetPixels/frame", geometry, 20, [&](int i) {
+      canvas->SetPixels(0, 0, width, height, colors.data());
+    });
+  Measure("SetImage/frame", geometry, 20, [&](int i) {
+      SetImage(canvas, 0, 0, image.data(), image.size(), width, height,
+               false);
+    });
+
+  for (size_t f = 0; f < fonts.size(); ++f) {
+    const Font &font = *fonts[f].font;
+    canvas->Clear();
+    Measure("DrawText/" + fonts[f].name, geometry, 500, [&](int i) {
+        DrawText(canvas, font, 1 - (i & 7), font.baseline(),
+                 Color(255, 200, 0), NULL, kTextLine, 0);
+      });
+    // Per character, through the generic Canvas path.
+    const int characters = strlen(kTextLine);
+    Measure("Font::DrawGlyph/" + fonts[f].name, geometry, 2000, [&](int i) {
+        font.DrawGlyph(canvas, (i % characters) * 8, font.baseline(),
+                       Color(255, 200, 0), NULL, kTextLine[i % characters]);
+      });
+  }
+
+  // Applying a mapper changes the matrix, so each needs a fresh one.
+  const std::vector<std::string> mappers = GetAvailablePixelMappers();
+  for (size_t m = 0; m < mappers.size(); ++m) {
+    const std::string &name = mappers[m];
+    std::vector<double> batch_ns;
+    for (int r = 0; r < kRepeats; ++r) {
+      const PixelMapper *mapper
+        = FindPixelMapper(name.c_str(), g.chain, g.parallel,
+                          MapperParameter(name));
+      RGBMatrix *fresh = CreateMatrix(g);
+      if (mapper == NULL || fresh == NULL) {
+        delete fresh;
+        break;
+      }
+      const int64_t start = GetMonotonicNanos();
+      const bool success = fresh->ApplyPixelMapper(mapper);
+      batch_ns.push_back(GetMonotonicNanos() - start);
+      delete fresh;
+      if (!success) break;
+    }
+    if (batch_ns.size() == kRepeats) {
+      Report("ApplyPixelMapper/" + name, geometry, 1, batch_ns);
+    } else {
+      printf("# ApplyPixelMapper/%s\t%s\tnot applicable\n", name.c_str(),
+             geometry.c_str());
+    }
+  }
+
+  // A stream of different frames, read over and over again.
+  MemStreamIO stream;
+  StreamWriter writer(&stream);
+  static const int kStreamFrames = 16;
+  for (int i = 0; i < kStreamFrames; ++i) {
+    other->Fill(i * 16, 0, 255 - i * 16);
+    writer.Stream(*other, 40000);
+  }
+  StreamReader reader(&stream);
+  uint32_t hold_time_us;
+  bool stream_ok = true;
+  Measure("StreamReader::GetNext/frame", geometry, 10 * kStreamFrames,
+          [&](int i) {
+            if (!reader.GetNext(canvas, &hold_time_us)) {
+              reader.Rewind();
+              stream_ok &= reader.GetNext(canvas, &hold_time_us);
+            }
+          });
+
+  delete matrix;
+  if (!stream_ok) fprintf(stderr, "Reading the content stream failed\n");
+  return stream_ok;
+}
+
+static bool BenchmarkRefresh(const Geometry &g) {
+  CountingOutput *output = new CountingOutput();
+  internal::Framebuffer::InitHardwareMapping(g.hardware_mapping);
+  internal::Framebuffer::SetOutputBackend(output);
+  GPIO io;
+  io.InitHeadless(1);   // Slowdown as on a Pi 3.
+  internal::Framebuffer::InitGPIO(&io, g.rows, g.parallel, false, 130, 0, 0);
+
+  internal::PixelDesignatorMap *mapper = NULL;
+  internal::Framebuffer *frame
+    = new internal::Framebuffer(g.rows, g.cols * g.chain, g.parallel, 0,
+                                "RGB", false, &mapper);
+  printf("# PixelDesignatorMap\t%s\t%zu bytes\n", GeometryName(g).c_str(),
+         mapper->MemoryUsed());
+  // Bitplanes that are the same are shown together and dark rows are not
+  // clocked in again, but these passes are padded to the length of a full
+  // one, so that the brightness doesn't change; the time should not depend
+  // on the content: a mix, white text on black, where all bitplanes are the
+  // same, a line of subtitle at the bottom, with the other rows dark, and an
+  // image.
+  const int width = frame->width();
+  const int height = frame->height();
+  bool success = true;
+  for (int content = 0; content < 4; ++content) {
+    const char *name = "DumpToMatrix/pass";
+    frame->Fill(255, 128, 0);
+    if (content == 1) {
+      name = "DumpToMatrix/pass-text";
+      frame->Clear();
+      for (int y = height / 2; y < height - 2; ++y) {
+        for (int x = y % 2; x < width; x += 3)
+          frame->SetPixel(x, y, 255, 255, 255);
+      }
+    } else if (content == 2) {
+      name = "DumpToMatrix/pass-subtitle";
+      frame->Clear();
+      for (int y = height - 10; y < height - 2; ++y) {
+        for (int x = y % 2; x < width; x += 3)
+          frame->SetPixel(x, y, 255, 255, 255);
+      }
+    } else if (content == 3) {
+      name = "DumpToMatrix/pass-image";
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x)
+          frame->SetPixel(x, y, random(), random(), random());
+      }
+    }
+    output->passes = 0;
+    output->pulser->pulses = 0;
+    output->pulser->nanos = 0;
+    Measure(name, GeometryName(g), 20, [&](int i) {
+        frame->DumpToMatrix(&io, 0);
+      });
+
+    // Every pass shows each double row for the time of all bitplanes.
+    int64_t row_nanos = 0;
+    for (int b = 0; b < frame->pwmbits(); ++b)
+      row_nanos += output->pulser->specs[b];
+    const int64_t expected = output->passes * (g.rows / 2) * row_nanos;
+    if (output->pulser->nanos != expected) {
+      fprintf(stderr, "%s: %lld ns of pulses in %lld passes, expected "
+              "%lld\n", name, (long long)output->pulser->nanos,
+              (long long)output->passes, (long long)expected);
+      success = false;
+    }
+    printf("# %s\t%s\t%.1f pulses/row\n", name, GeometryName(g).c_str(),
+           (double)output->pulser->pulses / output->passes / (g.rows / 2));
+  }
+
+  // Full white is full light, however many bitplanes show it.
+  std::vector<uint8_t> rgb(3 * width * height);
+  const int pwm_bits[] = { 1, internal::Framebuffer::kBitPlanes };
+  for (int p = 0; p < 2; ++p) {
+    frame->SetPWMBits(pwm_bits[p]);
+    frame->Fill(255, 255, 255);
+    frame->Decode(1.0f, rgb.data());
+    const uint8_t darkest = *std::min_element(rgb.begin(), rgb.end());
+    if (darkest != 255) {
+      fprintf(stderr, "Decode(): white with %d PWM bits is %d, not 255\n",
+              pwm_bits[p], darkest);
+      success = false;
+    }
+  }
+  delete frame;
+  delete mapper;
+  return success;
+}
+
+// The .bdf files in "fonts_dir", sorted.
+static bool FontFiles(const char *fonts_dir, std::vector<std::string> *names) {
+  DIR *dir = opendir(fonts_dir);
+  if (dir == NULL) {
+    fprintf(stderr, "Can't open font directory '%s'\n", fonts_dir);
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const size_t len = strlen(entry->d_name);
+    if (len > 4 && strcmp(entry->d_name + len - 4, ".bdf") == 0)
+      names->push_back(entry->d_name);
+  }
+  closedir(dir);
+  std::sort(names->begin(), names->end());
+  return true;
+}
+
+static bool LoadFonts(const char *fonts_dir, std::vector<LoadedFont> *fonts) {
+  std::vector<std::string> names;
+  if (!FontFiles(fonts_dir, &names))
+    return false;
+  for (size_t f = 0; f < names.size(); ++f) {
+    const std::string path = std::string(fonts_dir) + "/" + names[f];
+    LoadedFont loaded = { names[f], new Font() };
+    if (!loaded.font->LoadFont(path.c_str())) {
+      fprintf(stderr, "Couldn't load font '%s'\n", path.c_str());
+      delete loaded.font;
+      return false;
+    }
+    fonts->push_back(loaded);
+  }
+  return true;
+}
+
+static bool MeasureLoadFont(const std::string &name, const std::string &path) {
+  Font *font = NULL;
+  Measure(name, "-", 2, [&](int i) {
+      delete font;
+      font = new Font();
+      if (!font->LoadFont(path.c_str())) {
+        delete font;
+        font = NULL;
+      }
+    });
+  if (font == NULL) {
+    fprintf(stderr, "Couldn't load font '%s'\n", path.c_str());
+    return false;
+  }
+  delete font;
+  return true;
+}
+
+// Fonts are loaded through links in a temporary directory, so that loading
+// from the bdf file and from its cache file are measured separately,
+// whether there are cache files in "fonts_dir" or not.
+static bool BenchmarkFonts(const char *fonts_dir) {
+  std::vector<std::string> names;
+  if (!FontFiles(fonts_dir, &names))
+    return false;
+  char tmp_dir[] = "/tmp/render-benchmark-XXXXXX";
+  if (mkdtemp(tmp_dir) == NULL) {
+    perror("mkdtemp");
+    return false;
+  }
+  bool success = true;
+  for (size_t f = 0; success && f < names.size(); ++f) {
+    const std::string path = std::string(fonts_dir) + "/" + names[f];
+    const std::string link = std::string(tmp_dir) + "/" + names[f];
+    char *target = realpath(path.c_str(), NULL);
+    success = (target != NULL && symlink(target, link.c_str()) == 0);
+    free(target);
+    if (!success) {
+      perror(path.c_str());
+      break;
+    }
+    success = MeasureLoadFont("Font::LoadFont/" + names[f], link);
+    if (success && !Font::CreateCacheFile(link.c_str())) {
+      fprintf(stderr, "Couldn't create cache for '%s'\n", path.c_str());
+      success = false;
+    }
+    if (success) {
+      success = MeasureLoadFont("Font::LoadFont(cache)/" + names[f], link);
+    }
+    Font font;
+    if (success && font.LoadFont(link.c_str())) {
+      Measure("Font::CreateOutlineFont/" + names[f], "-", 2, [&](int i) {
+          delete font.CreateOutlineFont();
+        });
+    }
+    unlink((link + ".cache").c_str());
+    unlink(link.c_str());
+  }
+  rmdir(tmp_dir);
+  return success;
+}
+
+// Run "benchmark" in a child process, with its output passed through and
+// appended to "results".
+template <typename Benchmark>
+static bool RunInChild(Benchmark benchmark, std::string *results) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    return false;
+  }
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    const bool success = benchmark();
+    fflush(stdout);
+    _exit(success ? 0 : 1);
+  }
+  close(fds[1]);
+  char buffer[4096];
+  ssize_t r;
+  while ((r = read(fds[0], buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, r, stdout);
+    fflush(stdout);
+    results->append(buffer, r);
+  }
+  close(fds[0]);
+  int status;
+  return waitpid(pid, &status, 0) == pid
+    && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Fastest time per benchmark and geometry of result lines.
+typedef std::map<std::string, double> Timings;
+static void ParseResults(const std::string &text, Timings *timings) {
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string::npos) end = text.size();
+    const std::string line = text.substr(pos, end - pos);
+    pos = end + 1;
+    char name[256], geometry[64];
+    int iterations;
+    double min_ns, median_ns;
+    if (line.empty() || line[0] == '#'
+        || sscanf(line.c_str(), "%255s %63s %d %lf %lf", name, geometry,
+                  &iterations, &min_ns, &median_ns) != 5)
+      continue;
+    (*timings)[std::string(name) + " " + geometry] = min_ns;
+  }
+}
+
+static bool ReadFile(const char *filename, std::string *content) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) return false;
+  char buffer[4096];
+  size_t r;
+  while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    content->append(buffer, r);
+  fclose(f);
+  return true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-f fonts-dir] [-c baseline.tsv] "
+          "[-t percent]\n", progname);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *fonts_dir = "../fonts";
+  const char *baseline_file = NULL;
+  double threshold_percent = 15;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:c:t:")) != -1) {
+    switch (opt) {
+    case 'f': fonts_dir = optarg; break;
+    case 'c': baseline_file = optarg; break;
+    case 't': threshold_percent = atof(optarg); break;
+    default: return usage(argv[0]);
+    }
+  }
+
+  std::string baseline;
+  if (baseline_file && !ReadFile(baseline_file, &baseline)) {
+    fprintf(stderr, "Can't read baseline '%s'\n", baseline_file);
+    return 1;
+  }
+
+  printf("# benchmark\tgeometry\titerations\tmin_ns\tmedian_ns\n");
+  std::string results;
+  bool success = RunInChild([&]() { return BenchmarkFonts(fonts_dir); },
+                            &results);
+  std::vector<LoadedFont> fonts;
+  success &= LoadFonts(fonts_dir, &fonts);
+  const int geometries = sizeof(kGeometries) / sizeof(kGeometries[0]);
+  for (int i = 0; success && i < geometries; ++i) {
+    const Geometry &g = kGeometries[i];
+    success &= RunInChild([&]() { return BenchmarkCanvas(g, fonts); },
+                          &results);
+    success &= RunInChild([&]() { return BenchmarkRefresh(g); }, &results);
+  }
+  for (size_t f = 0; f < fonts.size(); ++f) delete fonts[f].font;
+  if (!success) {
+    fprintf(stderr, "Benchmark failed\n");
+    return 1;
+  }
+
+  if (baseline_file) {
+    Timings before, after;
+    ParseResults(baseline, &before);
+    ParseResults(results, &after);
+    int regressions = 0;
+    for (Timings::const_iterator it = after.begin(); it != after.end(); ++it) {
+      Timings::const_iterator found = before.find(it->first);
+      if (found == before.end() || found->second <= 0) continue;
+      const double change = 100 * (it->second / found->second - 1);
+      if (change > threshold_percent) {
+        fprintf(stderr, "REGRESSION %s: %.1f ns -> %.1f ns (+%.0f%%)\n",
+                it->first.c_str(), found->second, it->second, change);
+        ++regressions;
+      }
+    }
+    if (regressions > 0) return 1;
+    fprintf(stderr, "No regressions beyond %.0f%% against %s\n",
+            threshold_percent, baseline_file);
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Benchmark of drawing outlined text into a FrameCanvas: with a separate
+// outline font through the generic Canvas::SetPixel() path, the same through
+// the direct bitplane path of FrameCanvas::DrawBitmaps(), and in a single
+// pass with DrawOutlinedTextLayout(). Also verifies that all of them result
+// in exactly the same frame buffer content.
+//
+// Runs without hardware access:
+//   make bench
+//   ./text-benchmark [bdf-font]
+
+#include "led-matrix.h"
+#include "graphics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+using namespace rgb_matrix;
+
+// A two-line cue of typical length.
+static const char kCueText[] =
+  "I don't know what you mean.\nThe door was open all night.";
+
+static int64_t GetMonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const Color kTextColor(255, 200, 0);
+static const Color kOutlineColor(0, 0, 0);
+
+// The ways to draw a cue that we compare.
+enum DrawMethod {
+  TWO_PASS_GENERIC,     // Outline font, then text; via Canvas::SetPixel()
+  TWO_PASS_DIRECT,      // Same with FrameCanvas::DrawBitmaps()
+  ONE_PASS_GENERIC,     // DrawOutlinedTextLayout() via Canvas::SetPixel()
+  ONE_PASS_DIRECT,      // Same with FrameCanvas::DrawBitmaps()
+  NUM_METHODS
+};
+static const char *const kMethodNames[NUM_METHODS] = {
+  "outline font, Canvas::SetPixel()",
+  "outline font, FrameCanvas::DrawBitmaps()",
+  "single pass, Canvas::SetPixel()",
+  "single pass, FrameCanvas::DrawBitmaps()",
+};
+
+static void DrawCue(DrawMethod method, FrameCanvas *c,
+                    const Font &font, const Font &outline,
+                    const TextLayout &layout, int x, int y) {
+  Canvas *const generic = c;
+  switch (method) {
+  case TWO_PASS_GENERIC:
+    DrawTextLayout(generic, outline, layout, x - 1, y, font.baseline(),
+                   kOutlineColor, NULL);
+    DrawTextLayout(generic, font, layout, x, y, font.baseline(),
+                   kTextColor, NULL);
+    break;
+  case TWO_PASS_DIRECT:
+    DrawTextLayout(c, outline, layout, x - 1, y, font.baseline(),
+                   kOutlineColor, NULL);
+    DrawTextLayout(c, font, layout, x, y, font.baseline(),
+                   kTextColor, NULL);
+    break;
+  case ONE_PASS_GENERIC:
+    DrawOutlinedTextLayout(generic, font, layout, x, y, font.baseline(),
+                           kTextColor, kOutlineColor);
+    break;
+  case ONE_PASS_DIRECT:
+    DrawOutlinedTextLayout(c, font, layout, x, y, font.baseline(),
+                           kTextColor, kOutlineColor);
+    break;
+  default:
+    break;
+  }
+}
+
+static std::string Content(const FrameCanvas *c) {
+  const char *data;
+  size_t len;
+  c->Serialize(&data, &len);
+  return std::string(data, len);
+}
+
+// All methods need to produce the same bits; including clipping at the
+// borders and with different color mappings.
+static bool CheckSame(FrameCanvas *reference, FrameCanvas *test,
+                      const Font &font, const Font &outline,
+                      const TextLayout &layout) {
+  const int offsets[][2] = { {1, 1}, {-20, -5}, {300, 20}, {0, 25} };
+  const int pwm_bits[] = { 11, 7, 1 };
+  for (int lum = 0; lum < 2; ++lum) {
+    for (size_t p = 0; p < sizeof(pwm_bits) / sizeof(pwm_bits[0]); ++p) {
+      for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); ++o) {
+        for (int m = TWO_PASS_DIRECT; m < NUM_METHODS; ++m) {
+          FrameCanvas *canvases[] = { reference, test };
+          for (int i = 0; i < 2; ++i) {
+            canvases[i]->set_luminance_correct(lum);
+            canvases[i]->SetPWMBits(pwm_bits[p]);
+            canvases[i]->SetBrightness(lum ? 100 : 60);
+            canvases[i]->Fill(0, 0, 80);
+          }
+          DrawCue(TWO_PASS_GENERIC, reference, font, outline, layout,
+                  offsets[o][0], offsets[o][1] + font.baseline());
+          DrawCue((DrawMethod)m, test, font, outline, layout,
+                  offsets[o][0], offsets[o][1] + font.baseline());
+          if (Content(reference) != Content(test)) {
+            fprintf(stderr, "MISMATCH: %s; luminance-correct=%d "
+                    "pwm-bits=%d offset=%d,%d\n", kMethodNames[m], lum,
+                    pwm_bits[p], offsets[o][0], offsets[o][1]);
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+  // Plain DrawText() as well.
+  const char *const text = "Hello, W\xc3\xb6rld!";
+  reference->Clear();
+  test->Clear();
+  int a = DrawText(static_cast<Canvas*>(reference), font, 3, 20,
+                   kTextColor, NULL, text, 1);
+  int b = DrawText(test, font, 3, 20, kTextColor, NULL, text, 1);
+  if (a != b || Content(reference) != Content(test)) {
+    fprintf(stderr, "MISMATCH: DrawText()\n");
+    return false;
+  }
+  reference->Clear();
+  test->Clear();
+  DrawText(static_cast<Canvas*>(reference), outline, 2, 20,
+           kOutlineColor, NULL, text, -1);
+  a = DrawText(static_cast<Canvas*>(reference), font, 3, 20,
+               kTextColor, NULL, text, 1);
+  b = DrawOutlinedText(test, font, 3, 20, kTextColor, kOutlineColor, text, 1);
+  if (a != b || Content(reference) != Content(test)) {
+    fprintf(stderr, "MISMATCH: DrawOutlinedText()\n");
+    return false;
+  }
+  return true;
+}
+
+static double NanosPerCue(DrawMethod method, FrameCanvas *c,
+                          const Font &font, const Font &outline,
+                          const TextLayout &layout) {
+  const int kIterations = 2000;
+  const int64_t start = GetMonotonicNanos();
+  for (int i = 0; i < kIterations; ++i) {
+    DrawCue(method, c, font, outline, layout, 1, font.baseline());
+  }
+  return (GetMonotonicNanos() - start) / (double)kIterations;
+}
+
+int main(int argc, char *argv[]) {
+  const char *font_file = argc > 1 ? argv[1] : "../fonts/7x13B.bdf";
+  Font font;
+  if (!font.LoadFont(font_file)) {
+    fprintf(stderr, "Couldn't load font '%s'\n", font_file);
+    return 1;
+  }
+  Font *outline = font.CreateOutlineFont();
+
+  RGBMatrix::Options options;
+  options.cols = 64;
+  options.rows = 32;
+  options.chain_length = 6;
+  RuntimeOptions runtime;
+  runtime.do_gpio_init = false;   // Only render to memory.
+  runtime.drop_privileges = 0;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(options, runtime);
+  if (matrix == NULL)
+    return 1;
+  FrameCanvas *reference = matrix->CreateFrameCanvas();
+  FrameCanvas *test = matrix->CreateFrameCanvas();
+
+  TextLayout layout;
+  layout.Layout(font, kCueText, reference->width() - 2);
+
+  if (!CheckSame(reference, test, font, *outline, layout)) {
+    delete outline;
+    delete matrix;
+    return 1;
+  }
+
+  test->SetPWMBits(11);
+  test->set_luminance_correct(true);
+  printf("%d chars with outline on %dx%d, pwm-bits=11:\n",
+         (int)strlen(kCueText) - 1, test->width(), test->height());
+  double baseline_ns = 0;
+  for (int m = 0; m < NUM_METHODS; ++m) {
+    const double ns = NanosPerCue((DrawMethod)m, test, font, *outline, layout);
+    if (m == 0) baseline_ns = ns;
+    printf("  %-42s %8.1f usec/cue  (%.1fx)\n", kMethodNames[m],
+           ns / 1000, baseline_ns / ns);
+  }
+
+  delete outline;
+  delete matrix;
+  return 0;
+}
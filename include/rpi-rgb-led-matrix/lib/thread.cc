@@ -16,11 +16,16 @@
 #include "thread.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 namespace rgb_matrix {
 void *Thread::PthreadCallRun(void *tobject) {
@@ -97,4 +102,42 @@ bool Mutex::WaitOn(pthread_cond_t *cond, long timeout_ms) {
     return pthread_cond_timedwait(cond, &mutex_, &t) == 0;
   }
 }
+
+static long Futex(std::atomic<uint32_t> *word, int op, uint32_t value,
+                  const struct timespec *timeout) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value,
+                 timeout, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+void EventCounter::Notify() {
+  // Pairs with WaitChange(): either the waiter sees the new count, or we
+  // see the waiter. Both are sequentially consistent.
+  count_.fetch_add(1);
+  if (waiters_.load() != 0)
+    Futex(&count_, FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG, INT_MAX, NULL);
+}
+
+bool EventCounter::WaitChange(uint32_t seen, long timeout_ms) {
+  struct timespec deadline;
+  if (timeout_ms >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+  }
+  waiters_.fetch_add(1);
+  bool changed;
+  while (!(changed = (count_.load() != seen))) {
+    // Returns right away if the count is not "seen" anymore.
+    if (Futex(&count_, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, seen,
+              timeout_ms >= 0 ? &deadline : NULL) != 0
+        && errno == ETIMEDOUT) {
+      changed = (count_.load() != seen);
+      break;
+    }
+  }
+  waiters_.fetch_sub(1);
+  return changed;
+}
 }  // namespace rgb_matrix
@@ -0,0 +1,146 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Watch a text file for changes using inotify.
+
+#include "input-watcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+bool ReadFileContent(const char *filename, std::string *out) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  out->clear();
+  char buffer[4096];
+  ssize_t r;
+  while ((r = read(fd, buffer, sizeof(buffer))) > 0) {
+    out->append(buffer, r);
+  }
+  close(fd);
+  return r == 0;
+}
+
+InputFileWatcher::InputFileWatcher(const char *filename)
+  : filename_(filename), inotify_fd_(-1), stop_fd_(-1),
+    change_fd_(-1) {
+  const size_t slash = filename_.find_last_of('/');
+  basename_ = (slash == std::string::npos)
+    ? filename_ : filename_.substr(slash + 1);
+}
+
+InputFileWatcher::~InputFileWatcher() {
+  Stop();
+  if (inotify_fd_ >= 0) close(inotify_fd_);
+  if (stop_fd_ >= 0) close(stop_fd_);
+  if (change_fd_ >= 0) close(change_fd_);
+}
+
+bool InputFileWatcher::Init() {
+  const size_t slash = filename_.find_last_of('/');
+  const std::string dir = (slash == std::string::npos)
+    ? "." : filename_.substr(0, slash + 1);
+
+  inotify_fd_ = inotify_init1(IN_CLOEXEC);
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  change_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (inotify_fd_ < 0 || stop_fd_ < 0 || change_fd_ < 0) {
+    perror("Can't set up file watching");
+    return false;
+  }
+  if (inotify_add_watch(inotify_fd_, dir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    fprintf(stderr, "Can't watch directory '%s': %s\n",
+            dir.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Initial content.
+  if (!ReadFileContent(filename_.c_str(), &last_content_))
+    return false;
+  PostChange(new std::string(last_content_));
+  return true;
+}
+
+void InputFileWatcher::Stop() {
+  if (stop_fd_ < 0) return;
+  const uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) < 0) {
+    perror("Stopping file watcher");
+  }
+  WaitStopped();
+}
+
+void InputFileWatcher::ReadAndPostIfChanged() {
+  std::string content;
+  if (!ReadFileContent(filename_.c_str(), &content))
+    return;   // Possibly removed in the meantime; wait for the next event.
+  if (content == last_content_)
+    return;
+  last_content_ = content;
+  PostChange(new std::string(content));
+}
+
+void InputFileWatcher::PostChange(std::string *content) {
+  mailbox_.Post(content);
+  const uint64_t one = 1;
+  if (write(change_fd_, &one, sizeof(one)) < 0) {
+    perror("Signalling file change");
+  }
+}
+
+void InputFileWatcher::WaitForChange() {
+  // The content itself is picked up with TakeChange(); here we only consume
+  // the notification. A notification for a change that was already taken
+  // results in one spurious wakeup, which is harmless.
+  struct pollfd pfd;
+  pfd.fd = change_fd_;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, -1) > 0) {
+    uint64_t count;
+    if (read(change_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      perror("Reading file change notification");
+    }
+  }
+}
+
+void InputFileWatcher::Run() {
+  // Events contain the variable length name; make room for a few of them.
+  char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+  fds[0].fd = inotify_fd_;
+  fds[0].events = POLLIN;
+  fds[1].fd = stop_fd_;
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll() on file watch");
+      return;
+    }
+    if (fds[1].revents) return;   // Asked to stop.
+
+    const ssize_t len = read(inotify_fd_, buffer, sizeof(buffer));
+    if (len <= 0) continue;
+    bool relevant = false;
+    for (char *p = buffer; p < buffer + len; ) {
+      const struct inotify_event *event = (const struct inotify_event *) p;
+      if (event->len > 0 && basename_ == event->name) {
+        relevant = true;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+    if (relevant) {
+      ReadAndPostIfChanged();
+    }
+  }
+}
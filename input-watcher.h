@@ -0,0 +1,58 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Watch a text file for changes using inotify and hand the new content to
+// the render loop.
+//
+// The watch is on the containing directory, so that both in-place writes
+// (IN_CLOSE_WRITE) and atomic replacement by rename (IN_MOVED_TO) are
+// seen. Every event is followed by a read of the file, so changes are
+// picked up regardless of timestamp granularity or file length.
+
+#ifndef SUBTITLE_INPUT_WATCHER_H
+#define SUBTITLE_INPUT_WATCHER_H
+
+#include <string>
+
+#include "thread.h"
+#include "mailbox.h"
+
+class InputFileWatcher : public rgb_matrix::Thread {
+public:
+  explicit InputFileWatcher(const char *filename);
+  virtual ~InputFileWatcher();
+
+  // Set up the inotify watch. Returns 'false' if that was not possible.
+  // Call before Start().
+  bool Init();
+
+  // Stop the watching thread. Returns once it is finished.
+  void Stop();
+
+  // Take the latest changed content of the file if there was a change since
+  // the last call; NULL otherwise. Ownership is passed to the caller.
+  // Does not do any I/O and never blocks.
+  std::string *TakeChange() { return mailbox_.Take(); }
+
+  // Block until a change has been posted since the last call or a signal
+  // is received. Use in a render loop that has nothing else to do.
+  void WaitForChange();
+
+  virtual void Run();
+
+private:
+  void ReadAndPostIfChanged();
+  void PostChange(std::string *content);
+
+  const std::string filename_;
+  std::string basename_;
+  int inotify_fd_;
+  int stop_fd_;      // eventfd to wake up the thread to finish.
+  int change_fd_;    // eventfd signalled after each posted change.
+  std::string last_content_;
+  Mailbox<std::string> mailbox_;
+};
+
+// Read the whole content of "filename" into "out". Returns success.
+bool ReadFileContent(const char *filename, std::string *out);
+
+#endif  // SUBTITLE_INPUT_WATCHER_H
@@ -24,8 +24,9 @@ echo " " > "$INPUT_TXT_PATH"
 # Wait a bit to ensure MPV starts before running the parser script
 #sleep 2
 
-# Start the parser script
-python3 "$PARSER_SCRIPT" 54 
+# The LED matrix binary plays the audio itself (-A in command.sh) and times
+# the subtitles by it. Without that, start the audio separately:
+#python3 "$PARSER_SCRIPT" --audio-only
 
 # Optional: wait for the parser script to finish
 wait
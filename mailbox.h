@@ -0,0 +1,35 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Lock-free single-slot mailbox to hand values from one producer thread to
+// one consumer thread. The producer always overwrites whatever is in the
+// slot (the consumer is only interested in the latest value), the consumer
+// takes it out without ever blocking. Neither side takes a lock, so it is
+// safe to be used from the render loop.
+
+#ifndef SUBTITLE_MAILBOX_H
+#define SUBTITLE_MAILBOX_H
+
+#include <atomic>
+
+template <typename T>
+class Mailbox {
+public:
+  Mailbox() : slot_(nullptr) {}
+  ~Mailbox() { delete slot_.exchange(nullptr); }
+
+  // Producer: place new value. Takes ownership. A value that has not been
+  // picked up yet is superseded and discarded.
+  void Post(T *value) { delete slot_.exchange(value); }
+
+  // Consumer: take the latest value if there is one, NULL otherwise.
+  // Ownership is passed to the caller.
+  T *Take() { return slot_.exchange(nullptr); }
+
+private:
+  Mailbox(const Mailbox&) = delete;
+  Mailbox &operator=(const Mailbox&) = delete;
+
+  std::atomic<T*> slot_;
+};
+
+#endif  // SUBTITLE_MAILBOX_H
@@ -15,6 +15,15 @@
 
 #include "led-matrix.h"
 #include "graphics.h"
+#include "content-streamer.h"
+#include "srt-timeline.h"
+#include "input-watcher.h"
+#include "cue-cache.h"
+#include "subtitle-render.h"
+#include "audio-player.h"
+#include "control-server.h"
+#include "scroll-strip.h"
+#include "presentation-stats.h"
 
 #include <algorithm>
 #include <fstream>
@@ -22,6 +31,8 @@
 #include <string>
 #include <iostream>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
 #include <signal.h>
@@ -29,24 +40,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 using namespace rgb_matrix;
 
+// Number of upcoming cues the cue cache keeps prepared.
+static const int kCueCacheLookahead = 8;
+
+// How often the presentation statistics file is updated.
+static const int kStatsIntervalMs = 5000;
+
 volatile bool interrupt_received = false;
 static void InterruptHandler(int signo) {
   interrupt_received = true;
 }
 
+volatile bool stats_requested = false;
+static void StatsHandler(int signo) {
+  stats_requested = true;
+}
+
 static int usage(const char *progname) {
-  fprintf(stderr, "usage: %s [options] [<text>| -i <filename>]\n", progname);
+  fprintf(stderr, "usage: %s [options] [<text>| -i <filename> | -T <srt-file> | -S <stream-file> | -U <socket>]\n", progname);
   fprintf(stderr, "Takes text and scrolls it with speed -s\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr,
           "\t-f <font-file>    : Path to *.bdf-font to be used.\n"
           "\t-i <textfile>     : Input from file.\n"
+          "\t-U <socket>       : Take timed commands (text, clear, color,\n"
+          "\t                    brightness) from producers connecting to this\n"
+          "\t                    Unix socket; see control-server.h.\n"
+          "\t-T <srt-file>     : Play subtitles from *.srt file on its own timeline.\n"
+          "\t-A <wav-file>     : With -T: play audio and time subtitles by it.\n"
+          "\t-D <audio-device> : ALSA device for -A (Default: 'default'). 'sim' or\n"
+          "\t                    'sim:<ppm>' simulates a sound card whose clock is\n"
+          "\t                    <ppm> off, to test without one.\n"
+          "\t-S <stream-file>  : Play show pre-compiled with compile-show. No text\n"
+          "\t                    options needed; just -l and the matrix options.\n"
+          "\t-P <stats-file>   : With -T: write cue presentation statistics\n"
+          "\t                    (lateness, missed cues) to this file every\n"
+          "\t                    few seconds.\n"
+          "\t-M <kbytes>       : Memory budget for pre-rendered cues with -T and\n"
+          "\t                    -s 0. 0 to render each cue when needed. "
+          "(Default: 16384)\n"
           "\t-s <speed>        : Approximate letters per second. \n"
           "\t                    Positive: scroll right to left; Negative: scroll left to right\n"
           "\t                    (Zero for no scrolling)\n"
@@ -77,95 +114,198 @@ static bool FullSaturation(const Color &c) {
     && (c.b == 0 || c.b == 255);
 }
 
-static void add_micros(struct timespec *accumulator, long micros) {
-  const long billion = 1000000000;
-  const int64_t nanos = (int64_t) micros * 1000;
-  accumulator->tv_sec += nanos / billion;
-  accumulator->tv_nsec += nanos % billion;
-  while (accumulator->tv_nsec > billion) {
-    accumulator->tv_nsec -= billion;
-    accumulator->tv_sec += 1;
-  }
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
-std::string centerText(const std::string& text, int max_line_length) {
-    int text_length = text.length();
-    if (text_length >= max_line_length) {
-        // If the text is longer or equal to the max length, return it as is.
-        return text;
-    }
 
-    int padding_total = max_line_length - text_length;
-    int padding_side = padding_total / 2; // Evenly distribute padding on both sides
-
-    // Create a padded string with spaces
-    return std::string(padding_side, ' ') + text + std::string(padding_total - padding_side, ' ');
+// Sleep until the given CLOCK_MONOTONIC time. Returns early on a signal.
+static void SleepUntilMicros(int64_t wakeup_us) {
+  struct timespec ts;
+  ts.tv_sec = wakeup_us / 1000000;
+  ts.tv_nsec = (wakeup_us % 1000000) * 1000;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
 }
-// Read line and return if it changed.
-typedef uint64_t stat_fingerprint_t;
 
-static bool ReadSplitLineOnChange(const char *filename, std::vector<std::string*>& out,
-                                  stat_fingerprint_t *last_file_status, int max_line_length) {
+// Frames displayed is derived from the measured refresh period, as every
+// refresh shows the current frame again whether we rendered it or not.
+static void PrintFrameStats(uint64_t frames_rendered, int64_t elapsed_us,
+                            int64_t frame_period_us) {
+  const uint64_t frames_displayed = (frame_period_us > 0)
+    ? elapsed_us / frame_period_us : 0;
+  fprintf(stderr, "Frames rendered: %llu; frames displayed: %llu "
+          "(%.1f%% rendered, %.1fs, refresh period %lldusec)\n",
+          (unsigned long long)frames_rendered,
+          (unsigned long long)frames_displayed,
+          frames_displayed ? 100.0 * frames_rendered / frames_displayed : 0.0,
+          elapsed_us / 1e6, (long long)frame_period_us);
+}
 
-  struct stat sb;
-  if (stat(filename, &sb) < 0) {
-    perror("Couldn't determine file change");
-    return false;
+// How the refresh thread kept up since the last time, to tell flicker from
+// the output apart from frames rendered too late.
+static void PrintRefreshStats(RGBMatrix *matrix) {
+  RGBMatrix::RefreshStats stats;
+  if (!matrix->GetRefreshStats(&stats, true) || stats.refreshes == 0)
+    return;
+  uint64_t overshoots = 0, late_pulses = 0;
+  for (int us = 0; us < RGBMatrix::RefreshStats::kOvershootBuckets; ++us) {
+    overshoots += stats.pulse_overshoot[us];
+    if (us >= 20) late_pulses += stats.pulse_overshoot[us];
   }
+  // Passes can all take less than a microsecond, e.g. dark on a null backend.
+  const double output_percent = stats.total_refresh_us
+    ? 100.0 * stats.output_us / stats.total_refresh_us : 100.0;
+  fprintf(stderr, "Refresh: %llu passes of min %u, avg %u, p99 %u, max %uusec "
+          "(%.1f%% output); %llu slow passes, %llu late and %llu dropped "
+          "frames; %llu of %llu pulse waits overshot >= 20usec\n",
+          (unsigned long long)stats.refreshes, stats.min_refresh_us,
+          stats.avg_refresh_us, stats.p99_refresh_us, stats.max_refresh_us,
+          output_percent,
+          (unsigned long long)stats.slow_refreshes,
+          (unsigned long long)stats.late_frames,
+          (unsigned long long)stats.dropped_frames,
+          (unsigned long long)late_pulses, (unsigned long long)overshoots);
+}
 
+// Play a show pre-compiled with compile-show. There is no text rendering
+// at all: frames are read ahead into a few canvases and queued with the time
+// they are due; the refresh thread shows each on the first refresh at or
+// after that time, so a slow read doesn't delay the frames already queued.
+// Frame times are accumulated on an absolute start time, so nothing drifts.
+static int PlayStreamFile(const char *stream_file,
+                          const RGBMatrix::Options &matrix_options,
+                          const rgb_matrix::RuntimeOptions &runtime_opt,
+                          int loops) {
+  const int fd = open(stream_file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open stream '%s': %s\n", stream_file,
+            strerror(errno));
+    return 1;
+  }
+  rgb_matrix::FileStreamIO stream_io(fd);
+  rgb_matrix::StreamReader reader(&stream_io);
 
-  const stat_fingerprint_t fp = ((uint64_t)sb.st_mtime << 32) + sb.st_size;
-  if (fp == *last_file_status) {
-    return false; // No change according to stat()
+  RGBMatrix *canvas = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
+  if (canvas == NULL)
+    return 1;
+  static const int kReadAheadFrames = 4;
+  std::vector<FrameCanvas*> free_canvases;
+  for (int i = 0; i < kReadAheadFrames; ++i) {
+    free_canvases.push_back(canvas->CreateFrameCanvas());
   }
 
-  *last_file_status = fp;
-  std::ifstream fs(filename);
-  if (!fs.is_open()) {
-    std::cerr << "Failed to open file: " << filename << std::endl;
-    return false;
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  int64_t frame_due_us = GetMonotonicMicros();
+  uint64_t frames_shown = 0;
+  uint32_t hold_time_us;
+  while (!interrupt_received && loops != 0) {
+    if (free_canvases.empty()) {
+      // Wait for a frame to be shown; wake up now and then for signals.
+      FrameCanvas *shown = canvas->ReclaimFrame(100);
+      if (shown != NULL) free_canvases.push_back(shown);
+      continue;
+    }
+    FrameCanvas *frame = free_canvases.back();
+    if (!reader.GetNext(frame, &hold_time_us)) {
+      if (frames_shown == 0) {
+        fprintf(stderr, "No frames in stream '%s'\n", stream_file);
+        break;
+      }
+      // End of show reached. Start from the beginning.
+      reader.Rewind();
+      if (loops > 0 && --loops == 0) break;
+      continue;
+    }
+    // If we fell behind, catch up rather than showing stale frames.
+    if (!canvas->QueueFrame(frame, frame_due_us, RGBMatrix::kDropLateFrame)) {
+      fprintf(stderr, "Couldn't queue frame\n");
+      break;
+    }
+    free_canvases.pop_back();
+    ++frames_shown;
+    frame_due_us += hold_time_us;
   }
+  // Let the frames still queued play out.
+  if (!interrupt_received && frames_shown > 0)
+    SleepUntilMicros(frame_due_us);
 
-  std::string str((std::istreambuf_iterator<char>(fs)),
-                  std::istreambuf_iterator<char>());
+  fprintf(stderr, "Showed %llu frames from '%s'.\n",
+          (unsigned long long)frames_shown, stream_file);
+  PrintRefreshStats(canvas);
+  canvas->Clear();
+  delete canvas;
+  return 0;
+}
 
-  size_t newline_pos = str.find('\n');
-  if (newline_pos != std::string::npos) {
-    *out[0] = centerText(str.substr(0, newline_pos), max_line_length); // First part until newline
-    std::replace(out[0]->begin(), out[0]->end(), '\n', ' '); 
-    *out[1] = centerText(str.substr(newline_pos + 1), max_line_length); // Rest after the newline
-    std::replace(out[1]->begin(), out[1]->end(), '\n', ' '); 
+// A/V offset of each cue: audio position when the cue became visible minus
+// its start time. Positive: the text came late.
+static const int64_t kNotMeasured = INT64_MIN;
+static void PrintAvOffsets(const std::vector<int64_t> &av_offset_us) {
+  int64_t total_us = 0;
+  int64_t max_abs_us = 0;
+  int count = 0;
+  fprintf(stderr, "A/V offset per cue in msec (+: text late):");
+  for (size_t i = 0; i < av_offset_us.size(); ++i) {
+    const int64_t offset_us = av_offset_us[i];
+    if (offset_us == kNotMeasured) continue;
+    if (count % 8 == 0) fprintf(stderr, "\n ");
+    fprintf(stderr, " #%-3d %+6.1f", (int)i + 1, offset_us / 1000.0);
+    total_us += offset_us;
+    max_abs_us = std::max(max_abs_us, offset_us < 0 ? -offset_us : offset_us);
+    ++count;
+  }
+  if (count > 0) {
+    fprintf(stderr, "\nA/V offset avg %+.1fmsec, max |offset| %.1fmsec\n",
+            total_us / 1000.0 / count, max_abs_us / 1000.0);
   } else {
-    *out[0] = centerText(str, max_line_length); // If no newline, center the whole string
-    std::replace(out[0]->begin(), out[0]->end(), '\n', ' '); 
-    out[1]->clear();
+    fprintf(stderr, " none yet.\n");
   }
-  return true;
 }
 
-
-
-static bool ReadLineOnChange(const char *filename, std::string *out,
-                             stat_fingerprint_t *last_file_status) {
-  struct stat sb;
-  if (stat(filename, &sb) < 0) {
-    perror("Couldn't determine file change");
-    return false;
+// Acknowledge the commands applied to the frame that just became visible.
+// Of several texts in the same frame, only the last one has been seen.
+static void AcknowledgeCommands(ControlServer *server, int64_t presented_us,
+                                std::vector<ControlCommand> *commands) {
+  int last_text = -1;
+  for (size_t i = 0; i < commands->size(); ++i) {
+    const ControlCommand::Type type = (*commands)[i].type;
+    if (type == ControlCommand::SHOW_TEXT || type == ControlCommand::CLEAR)
+      last_text = i;
   }
-  const stat_fingerprint_t fp = ((uint64_t)sb.st_mtime << 32) + sb.st_size;
-  if (fp == *last_file_status) {
-    return false;  // no change according to stat()
+  for (size_t i = 0; i < commands->size(); ++i) {
+    const ControlCommand &command = (*commands)[i];
+    const ControlCommand::Type type = command.type;
+    if ((type == ControlCommand::SHOW_TEXT || type == ControlCommand::CLEAR)
+        && (int)i != last_text) {
+      server->Acknowledge(command, ControlCommand::SUPERSEDED, 0);
+    } else {
+      server->Acknowledge(command, ControlCommand::PRESENTED, presented_us);
+    }
   }
+  commands->clear();
+}
 
-  *last_file_status = fp;
-  std::ifstream fs(filename);
-  std::string str((std::istreambuf_iterator<char>(fs)),
-                  std::istreambuf_iterator<char>());
-  //std::replace(str.begin(), str.end(), '\n', ' '); Removing this line will allow for new lines in the text file
-  if (*out == str) {
-    return false;  // no content change
+// Report the cues between "after" and "before" (exclusive) as missed: they
+// were due, but never visible, e.g. because we were stalled. Cues that are
+// completely covered by the next one never have a chance to be visible.
+static void RecordMissedCues(PresentationStats *stats,
+                             const SrtTimeline &timeline,
+                             int after, int before) {
+  for (int i = after + 1; i < before; ++i) {
+    if (timeline.Seek(timeline.cue(i).start_us) != i) continue;
+    PresentationStats::Record record = {};
+    record.cue = i;
+    record.missed = true;
+    stats->Add(record);
   }
-  *out = str;
-  return true;
+}
+
+// Both lines of a cue as one text to be laid out.
+static std::string CueText(const SrtCue &cue) {
+  return cue.lines[1].empty() ? cue.lines[0] : cue.lines[0] + "\n" + cue.lines[1];
 }
 
 int main(int argc, char *argv[]) {
@@ -196,6 +336,7 @@ int main(int argc, char *argv[]) {
   printf("  GPIO Slowdown: %d\n", runtime_opt.gpio_slowdown);
   printf("  Daemon: %d\n", runtime_opt.daemon);
   printf("  Drop privileges: %d\n", runtime_opt.drop_privileges);
+  printf("  Output backend: %s\n", runtime_opt.output_backend);
 
 
   Color color(255, 255, 255);
@@ -205,6 +346,12 @@ int main(int argc, char *argv[]) {
 
   const char *bdf_font_file = NULL;
   const char *input_file = NULL;
+  const char *srt_file = NULL;
+  const char *stream_file = NULL;
+  const char *audio_file = NULL;
+  const char *audio_device = "default";
+  const char *control_socket = NULL;
+  const char *stats_file = NULL;
   std::string line;
   bool xorigin_configured = false;
   int x_orig = 0;
@@ -214,15 +361,11 @@ int main(int argc, char *argv[]) {
   int loops = -1;
   int blink_on = 0;
   int blink_off = 0;
-  int number_modules = matrix_options.chain_length;
-  int char_per_module = 10;
   int linespace = 0;
-  //Multi-line support
-  std::string firstLine, secondLine;
-  std::vector<std::string*> lines{&firstLine, &secondLine};
+  int cue_cache_kbytes = 16384;
 
   int opt;
-  while ((opt = getopt(argc, argv, "x:y:f:C:B:O:t:s:l:b:i:e:")) != -1) {
+  while ((opt = getopt(argc, argv, "x:y:f:C:B:O:t:s:l:b:i:T:S:A:D:e:M:U:P:")) != -1) {
     switch (opt) {
     case 's': speed = atof(optarg); break;
     case 'b':
@@ -236,8 +379,15 @@ int main(int argc, char *argv[]) {
     case 'y': y_orig = atoi(optarg); break;
     case 'f': bdf_font_file = strdup(optarg); break;
     case 'i': input_file = strdup(optarg); break;
+    case 'T': srt_file = strdup(optarg); break;
+    case 'S': stream_file = strdup(optarg); break;
+    case 'A': audio_file = strdup(optarg); break;
+    case 'D': audio_device = strdup(optarg); break;
+    case 'U': control_socket = strdup(optarg); break;
+    case 'P': stats_file = strdup(optarg); break;
     case 't': letter_spacing = atoi(optarg); break;
     case 'e': linespace = atoi(optarg); break;
+    case 'M': cue_cache_kbytes = atoi(optarg); break;
     case 'C':
       if (!parseColor(&color, optarg)) {
         fprintf(stderr, "Invalid color spec: %s\n", optarg);
@@ -262,17 +412,56 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  int max_line_length = char_per_module * number_modules;
+  if (stream_file) {
+    return PlayStreamFile(stream_file, matrix_options, runtime_opt, loops);
+  }
 
-  stat_fingerprint_t last_change = 0;
+  SrtTimeline timeline;
+  InputFileWatcher *input_watcher = NULL;
+  WavReader wav;
+  AudioPlayer *audio_player = NULL;
 
-  if (input_file) {
-    if (!ReadSplitLineOnChange(input_file, lines, &last_change, max_line_length)) {
+  if (srt_file) {
+    if (!timeline.LoadFile(srt_file)) {
+      fprintf(stderr, "Couldn't read subtitles from '%s'\n", srt_file);
+      return usage(argv[0]);
+    }
+    printf("Loaded %d cues (%.1f seconds) from '%s'.\n", (int)timeline.size(),
+           timeline.duration_us() / 1e6, srt_file);
+    if (audio_file) {
+      AudioSink *sink = CreateAudioSink(audio_device);
+      if (!sink || !wav.Open(audio_file)) {
+        delete sink;
+        return 1;
+      }
+      audio_player = new AudioPlayer(&wav, sink);
+      if (!audio_player->Init())
+        return 1;
+      printf("Playing '%s' (%.1f seconds) on '%s'; subtitles follow "
+             "its clock.\n", audio_file, audio_player->length_us() / 1e6,
+             audio_device);
+      if (audio_player->length_us() < timeline.duration_us()) {
+        fprintf(stderr, "Note: audio is shorter than the subtitles; cues "
+                "after its end are not shown.\n");
+      }
+    }
+  }
+  else if (audio_file) {
+    fprintf(stderr, "Audio playback (-A) needs subtitles from -T\n");
+    return usage(argv[0]);
+  }
+  else if (input_file) {
+    // The file is watched in a separate thread that hands us every change;
+    // the render loop itself does not do any I/O.
+    input_watcher = new InputFileWatcher(input_file);
+    if (!input_watcher->Init()) {
       fprintf(stderr, "Couldn't read file '%s'\n", input_file);
       return usage(argv[0]);
     }
   }
-
+  else if (control_socket) {
+    // Starts out empty; text arrives over the socket.
+  }
   else {
     for (int i = optind; i < argc; ++i) {
       line.append(argv[i]).append(" ");
@@ -297,15 +486,8 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Couldn't load font '%s'\n", bdf_font_file);
     return 1;
   }
-
-  /*
-   * If we want an outline around the font, we create a new font with
-   * the original font as a template that is just an outline font.
-   */
-  rgb_matrix::Font *outline_font = NULL;
-  if (with_outline) {
-    outline_font = font.CreateOutlineFont();
-  }
+  printf("Font '%s' loaded.\n", bdf_font_file);
+  printf("  Font height: %d\n", font.height());
 
   RGBMatrix *canvas = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
 
@@ -320,8 +502,18 @@ int main(int argc, char *argv[]) {
     return 1;  // or handle the error as appropriate
   }
 
+  // Created after the matrix has dropped privileges, so that producers
+  // running as the same user can connect.
+  ControlServer *control_server = NULL;
+  if (control_socket) {
+    control_server = new ControlServer(control_socket);
+    if (!control_server->Init())
+      return 1;
+  }
 
-  const bool all_extreme_colors = (matrix_options.brightness == 100)
+  // Colors from the control socket can be anything. Brightness is applied
+  // to the output, so it does not need any more PWM bits.
+  const bool all_extreme_colors = !control_server
     && FullSaturation(color)
     && FullSaturation(bg_color)
     && FullSaturation(outline_color);
@@ -330,18 +522,15 @@ int main(int argc, char *argv[]) {
 
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
+  signal(SIGUSR1, StatsHandler);
 
-  printf("CTRL-C for exit.\n");
+  printf("CTRL-C for exit. SIGUSR1 to print frame statistics.\n");
 
   // Create a new canvas to be used with led_matrix_swap_on_vsync
   FrameCanvas *offscreen_canvas = canvas->CreateFrameCanvas();
 
   const int scroll_direction = (speed >= 0) ? -1 : 1;
   speed = fabs(speed);
-  int delay_speed_usec = 1000000;
-  if (speed > 0) {
-    delay_speed_usec = 1000000 / speed / font.CharacterWidth('W');
-  }
 
   if (!xorigin_configured) {
     if (speed == 0) {
@@ -356,11 +545,7 @@ int main(int argc, char *argv[]) {
   int y = y_orig;
   //int x = 0;
   //int y = 0;  
-  int length = 0;
-
-  struct timespec next_frame = {0, 0};
 
-  uint64_t frame_counter = 0;
   printf("Text Properties:\n");
   printf("  Color: (%d, %d, %d)\n", color.r, color.g, color.b);
   printf("  Background Color: (%d, %d, %d)\n", bg_color.r, bg_color.g, bg_color.b);
@@ -369,82 +554,340 @@ int main(int argc, char *argv[]) {
   printf("  X Origin: %d, Y Origin: %d\n", x_orig, y_orig);
   printf("  Linespace: %d\n", linespace);
 
-  if (!font.LoadFont(bdf_font_file)) {
-          fprintf(stderr, "Couldn't load font '%s'\n", bdf_font_file);
-          return 1;
-      } else {
-          printf("Font '%s' loaded.\n", bdf_font_file);
-          printf("  Font height: %d\n", font.height());
-      }
-
       if (with_outline) {
-          printf("Outline font created based on '%s'.\n", bdf_font_file);
+          printf("Drawing text with outline.\n");
       }
+
+  // Scrolling follows the clock rather than counting frames, so the speed
+  // does not depend on the refresh rate.
+  const double scroll_pixels_per_sec = speed * font.CharacterWidth('W');
+
+  // Subtitle timeline. The show is anchored to an absolute CLOCK_MONOTONIC
+  // start time, so cue times never accumulate drift. The frame we prepare is
+  // installed with the next SwapOnVSync(), roughly one refresh period from
+  // now; so we pick the cue that is due by then, which switches each cue
+  // on the first vsync following its start time.
+  // With audio, the start time is continuously taken from the audio clock,
+  // and one pass through the show lasts as long as the audio file.
+  int64_t show_start_us = GetMonotonicMicros();
+  int show_passes = 0;
+  const int64_t show_length_us = audio_player
+    ? audio_player->length_us() : timeline.duration_us();
+  AudioClockFollower *audio_clock = NULL;
+  std::vector<int64_t> av_offset_us(timeline.size(), kNotMeasured);
+  int64_t last_swap_us = 0;
+  int64_t frame_period_us = 0;   // Running estimate of time between swaps.
+  int shown_cue = -2;            // Nothing shown yet.
+
+  // Without scrolling, the content only changes with a new cue or at a blink
+  // edge. In this retained mode, we render each change once, swap it in and
+  // then block until the next change instead of re-rendering the identical
+  // frame for every refresh; the matrix keeps refreshing the frame shown.
+  const bool retained_mode = (speed == 0);
+  bool content_changed = true;
+  bool blink_phase_on = true;    // Retained mode: blink phase to render next.
+  int blink_frames_shown = 1;    // Retained mode: refreshes the shown phase lasts.
+  uint64_t frames_rendered = 0;
+  const int64_t loop_start_us = GetMonotonicMicros();
+
+  // Update refresh period estimate after a swap that waited for the given
+  // number of refreshes. Only back-to-back swaps are a valid measurement.
+  auto note_swap = [&](int refreshes) {
+    const int64_t swap_done_us = GetMonotonicMicros();
+    if (last_swap_us > 0) {
+      const int64_t interval = (swap_done_us - last_swap_us) / refreshes;
+      frame_period_us = (frame_period_us == 0)
+        ? interval : (7 * frame_period_us + interval) / 8;
+    }
+    last_swap_us = swap_done_us;
+  };
+
+  SubtitleStyle style;
+  style.font = &font;
+  style.outline = with_outline;
+  style.color = color;
+  style.bg_color = bg_color;
+  style.outline_color = outline_color;
+  style.width = canvas->width() - (with_outline ? 2 : 0);
+  style.x = x;
+  style.y = y;
+  style.letter_spacing = letter_spacing;
+  style.linespace = linespace;
+
+  // Text currently shown. Cues are all laid out up front, so showing one
+  // does not need any measuring; also, the layouts are read-only from then
+  // on, so they can be used from the cue cache thread.
+  TextLayout layout;
+  const TextLayout no_text;
+  const TextLayout *current_layout = &layout;
+  std::vector<TextLayout> cue_layouts(timeline.size());
+  for (size_t i = 0; i < timeline.size(); ++i) {
+    LayoutSubtitle(style, CueText(timeline.cue(i)), &cue_layouts[i]);
+  }
+
+  // When scrolling, the text is shown in a single line. It is rendered into
+  // a strip once, and each frame only draws the part that is visible. A new
+  // text starts over at the origin.
+  std::string text;              // Text currently shown.
+  std::string scroll_text;       // Text in the strip.
+  ScrollStrip scroll_strip;
+  int64_t scroll_start_us = 0;
+  int64_t scroll_pass = 0;
+
+  // Cues are all known in advance: with -T and no scrolling, they are
+  // rendered ahead of time in a background thread and only copied into the
+  // offscreen canvas when due.
+  CueCache *cue_cache = NULL;
+  if (srt_file && retained_mode && cue_cache_kbytes > 0) {
+    cue_cache = new CueCache(
+      timeline.size(), (size_t)cue_cache_kbytes * 1024, kCueCacheLookahead,
+      canvas->CreateFrameCanvas(),
+      [&](FrameCanvas *target, int cue) {
+        DrawSubtitle(target, style, cue_layouts[cue]);
+      });
+    cue_cache->Prefetch(0);
+    cue_cache->Start();
+  }
+
+  // Time from a cue's start to the swap that makes it visible.
+  int64_t switch_due_us = -1;
+  int64_t switch_latency_total_us = 0;
+  int64_t switch_latency_max_us = 0;
+  int switch_count = 0;
+
+  // Detailed record of each cue presentation, written to a file.
+  PresentationStats *presentation_stats = NULL;
+  int last_switched_cue = -1;    // In this pass through the show.
+  if (srt_file && stats_file) {
+    int overlapping = 0;
+    for (size_t i = 0; i + 1 < timeline.size(); ++i) {
+      if (timeline.cue(i).end_us > timeline.cue(i + 1).start_us)
+        ++overlapping;
+    }
+    presentation_stats = new PresentationStats(
+      stats_file, timeline.size(), overlapping, kStatsIntervalMs);
+    presentation_stats->Start();
+  } else if (stats_file) {
+    fprintf(stderr, "-P only has an effect with -T; ignored.\n");
+  }
+
+  auto print_stats = [&]() {
+    PrintFrameStats(frames_rendered, GetMonotonicMicros() - loop_start_us,
+                    frame_period_us);
+    PrintRefreshStats(canvas);
+    if (switch_count > 0) {
+      fprintf(stderr, "Cue switch latency: avg %lldusec, max %lldusec "
+              "(%d switches)\n",
+              (long long)(switch_latency_total_us / switch_count),
+              (long long)switch_latency_max_us, switch_count);
+    }
+    if (cue_cache) cue_cache->PrintStats(stderr);
+    if (audio_player) PrintAvOffsets(av_offset_us);
+  };
+
+  if (audio_player) {
+    audio_clock = new AudioClockFollower(audio_player);
+    audio_player->Start();
+  }
+
+  // Commands from the control socket applied to the frame being prepared;
+  // acknowledged once it is visible.
+  std::vector<ControlCommand> commands_presenting;
+
+  if (input_watcher) {
+    input_watcher->Start();
+  } else if (control_server) {
+    control_server->Start();
+  } else if (!srt_file) {
+    LayoutSubtitle(style, line, &layout);
+    text = line;
+  }
+
   while (!interrupt_received && loops != 0) {
-    if (input_file) {
-      ReadSplitLineOnChange(input_file, lines, &last_change, max_line_length);
-      //x = x_orig;
-      //y = y_orig;
+    if (srt_file) {
+      const int64_t now_us = GetMonotonicMicros();
+      if (audio_clock) {
+        const int64_t audio_start_us = audio_clock->StartTimeUs(now_us);
+        if (audio_start_us < 0) {
+          SleepUntilMicros(now_us + 1000);   // Audio not started yet.
+          continue;
+        }
+        show_start_us = audio_start_us + show_passes * show_length_us;
       }
-    
-//    if (input_file){    //if (input_file && ReadLineOnChange(input_file, &line, &last_change)) {
-//      ReadLineOnChange(input_file, &line, &last_change);
-//      x = x_orig;
-//    }
-    ++frame_counter;
-    offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
-    const bool draw_on_frame = (blink_on <= 0)
-      || (frame_counter % (blink_on + blink_off) < (uint64_t)blink_on);
-    if (draw_on_frame) {
+      int64_t show_time_us = now_us + frame_period_us - show_start_us;
+      if (show_time_us >= show_length_us) {
+        // End of show reached. Start from the beginning.
+        show_start_us += show_length_us;
+        show_time_us -= show_length_us;
+        ++show_passes;
+        if (presentation_stats) {
+          RecordMissedCues(presentation_stats, timeline, last_switched_cue,
+                           timeline.size());
+        }
+        last_switched_cue = -1;
+        if (loops > 0 && --loops == 0) break;
+      }
+      const int cue = timeline.Seek(show_time_us);
+      if (cue != shown_cue) {
+        current_layout = (cue >= 0) ? &cue_layouts[cue] : &no_text;
+        if (!retained_mode) {
+          text = (cue >= 0) ? CueText(timeline.cue(cue)) : std::string();
+        }
+        shown_cue = cue;
+        content_changed = true;
+        if (cue >= 0) {
+          if (presentation_stats) {
+            RecordMissedCues(presentation_stats, timeline, last_switched_cue,
+                             cue);
+          }
+          last_switched_cue = cue;
+          switch_due_us = show_start_us + timeline.cue(cue).start_us;
+          if (cue_cache) cue_cache->Prefetch(cue + 1);
+        }
+      }
+    }
+    else if (input_watcher) {
+      std::string *changed = input_watcher->TakeChange();
+      if (changed) {
+        LayoutSubtitle(style, *changed, &layout);
+        text.swap(*changed);
+        delete changed;
+        content_changed = true;
+      }
+    }
+    else if (control_server) {
+      // Everything due by the next refresh goes into the next frame.
+      const size_t first_new = commands_presenting.size();
+      control_server->TakeDue(GetMonotonicMicros() + frame_period_us,
+                              &commands_presenting);
+      for (size_t i = first_new; i < commands_presenting.size(); ++i) {
+        const ControlCommand &command = commands_presenting[i];
+        switch (command.type) {
+        case ControlCommand::SHOW_TEXT:
+          LayoutSubtitle(style, command.text, &layout);
+          text = command.text;
+          break;
+        case ControlCommand::CLEAR:
+          layout = TextLayout();
+          text.clear();
+          break;
+        case ControlCommand::SET_COLOR:
+          style.color = command.color;
+          if (command.has_bg_color) {
+            style.bg_color = bg_color = command.bg_color;
+          }
+          break;
+        case ControlCommand::SET_BRIGHTNESS:
+          // Done by the refresh thread; started once the frame carrying it
+          // is visible, as acknowledged, see below.
+          break;
+        }
+        content_changed = true;
+      }
+    }
 
-//std::cout << "Line 0: '" << *lines[0] << "'" << std::endl;
-//std::cout << "Line 1: '" << *lines[1] << "'" << (lines[1]->empty() ? " (empty)" : " (non-empty)") << std::endl;
-bool has_two_lines = !lines[1]->empty() && std::find_if(lines[1]->begin(), lines[1]->end(), [](unsigned char c) { return !std::isspace(c); }) != lines[1]->end();
+    if (stats_requested) {
+      stats_requested = false;
+      print_stats();
+    }
 
-//        bool has_two_lines = !lines[1]->empty();
-        int baseline_y;
-//        int linespace = baseline_y / 4;
-        if (has_two_lines){
-          baseline_y = y + font.baseline();
-          int second_line_y = y + 2 * font.baseline() + linespace;
-            if (outline_font) {
-                rgb_matrix::DrawText(offscreen_canvas, *outline_font,
-                                     x - 1, second_line_y,
-                                     outline_color, nullptr,
-                                     lines[1]->c_str(), letter_spacing - 2);
-            }
-            rgb_matrix::DrawText(offscreen_canvas, font,
-                                 x, second_line_y,
-                                 color, nullptr,
-                                 lines[1]->c_str(), letter_spacing);
-
-            if (outline_font) {
-                rgb_matrix::DrawText(offscreen_canvas, *outline_font,
-                                     x - 1, baseline_y,
-                                     outline_color, nullptr,
-                                     lines[0]->c_str(), letter_spacing - 2);
-            }
-            rgb_matrix::DrawText(offscreen_canvas, font,
-                                          x, baseline_y,
-                                          color, nullptr,
-                                          lines[0]->c_str(), letter_spacing);
-
-        
+    if (retained_mode && !content_changed && blink_on <= 0) {
+      // Nothing to render: wait for the next change. All of these return
+      // early on a signal, so we exit promptly.
+      if (srt_file) {
+        const int64_t now_us = GetMonotonicMicros();
+        int64_t next_change_us
+          = timeline.NextChangeAfter(now_us + frame_period_us - show_start_us);
+        if (next_change_us < 0) next_change_us = show_length_us;
+        // Wake up a couple of refreshes early, then follow the vsyncs to
+        // catch the first one after the change. With audio, also wake up
+        // regularly to keep following its clock.
+        int64_t wakeup_us = show_start_us + next_change_us
+          - 3 * frame_period_us;
+        if (audio_clock) {
+          wakeup_us = std::min(wakeup_us, now_us + 100000);
+        }
+        if (frame_period_us > 0 && wakeup_us > now_us + frame_period_us) {
+          SleepUntilMicros(wakeup_us);
+          last_swap_us = 0;   // Next swap interval is not a refresh period.
+        } else {
+          canvas->SwapOnVSync(NULL);
+          note_swap(1);
+        }
+      } else if (input_watcher) {
+        input_watcher->WaitForChange();
+        last_swap_us = 0;
+      } else if (control_server) {
+        // Same for commands scheduled ahead: wake up a couple of refreshes
+        // early and follow the vsyncs from there.
+        const int64_t now_us = GetMonotonicMicros();
+        const int64_t next_due_us = control_server->NextDueUs();
+        const int64_t wakeup_us = next_due_us - 3 * frame_period_us;
+        if (next_due_us < 0) {
+          control_server->WaitForCommand(-1);
+          last_swap_us = 0;
+        } else if (frame_period_us > 0
+                   && wakeup_us > now_us + frame_period_us) {
+          control_server->WaitForCommand(wakeup_us - now_us);
+          last_swap_us = 0;
         } else {
-            //printf("Drawing single line\n");
-            baseline_y = y + 2 * font.baseline() - linespace;
-            //baseline_y = y + 2 * font.baseline() - linespace + 3;
-            if (outline_font) {
-                rgb_matrix::DrawText(offscreen_canvas, *outline_font,
-                                     x - 1, baseline_y,
-                                     outline_color, nullptr,
-                                     lines[0]->c_str(), letter_spacing - 2);
-            }
-            rgb_matrix::DrawText(offscreen_canvas, font,
-                                 x, baseline_y,
-                                 color, nullptr,
-                                 lines[0]->c_str(), letter_spacing);
+          canvas->SwapOnVSync(NULL);
+          note_swap(1);
         }
+      } else {
+        pause();   // Static text: nothing will ever change.
+      }
+      continue;
+    }
+
+    // Scroll position at the time this frame becomes visible.
+    int64_t scrolled = 0;
+    if (!retained_mode) {
+      const int64_t now_us = GetMonotonicMicros();
+      if (content_changed) {
+        if (text != scroll_text) {
+          scroll_text = text;
+          scroll_start_us = now_us + frame_period_us;
+          scroll_pass = 0;
+        }
+        scroll_strip.Render(style, scroll_text);
+      }
+      scrolled = std::max<int64_t>(
+        0, (now_us + frame_period_us - scroll_start_us)
+        * scroll_pixels_per_sec / 1e6);
+      // Enter at the origin, leave on the other side and start over.
+      const int length = scroll_strip.length();
+      int64_t pass;
+      if (scroll_direction < 0) {
+        const int64_t cycle = std::max(1, x_orig + length + 1);
+        pass = scrolled / cycle;
+        x = x_orig - scrolled % cycle;
+      } else {
+        const int64_t cycle
+          = std::max(1, canvas->width() - x_orig + length + 1);
+        pass = (scrolled + length) / cycle;
+        x = x_orig - length + (scrolled + length) % cycle;
+      }
+      if (pass > scroll_pass) {
+        scroll_pass = pass;
+        if (!srt_file && loops > 0) --loops;
+      }
+    }
+    const bool draw_on_frame = (blink_on <= 0)
+      || (retained_mode
+          ? blink_phase_on
+          : scrolled % (blink_on + blink_off) < blink_on);
+    const int64_t prepare_start_us = GetMonotonicMicros();
+    if (!draw_on_frame) {
+      offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
+    } else if (cue_cache && shown_cue >= 0) {
+      cue_cache->Install(shown_cue, offscreen_canvas);
+    } else if (!retained_mode) {
+      offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
+      scroll_strip.Draw(offscreen_canvas, x,
+                        style.y + 2 * font.baseline() - style.linespace);
+    } else {
+      DrawSubtitle(offscreen_canvas, style, *current_layout);
     }
 //    if (draw_on_frame) {
 //
@@ -495,21 +938,57 @@ bool has_two_lines = !lines[1]->empty() && std::find_if(lines[1]->begin(), lines
 //    }
 
 
-    // Make sure render-time delays are not influencing scroll-time
-    if (speed > 0) {
-      if (next_frame.tv_sec == 0 && next_frame.tv_nsec == 0) {
-        // First time. Start timer, but don't wait.
-        clock_gettime(CLOCK_MONOTONIC, &next_frame);
-      } else {
-        add_micros(&next_frame, delay_speed_usec);
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL);
+    const int64_t prepared_us = GetMonotonicMicros();
+    ++frames_rendered;
+    // Swap the offscreen_canvas with canvas on vsync, avoids flickering.
+    // When blinking in retained mode, the previous phase is kept on for its
+    // number of refreshes before the new one is swapped in.
+    const int refreshes = (retained_mode && blink_on > 0)
+      ? std::max(1, blink_frames_shown) : 1;
+    offscreen_canvas = canvas->SwapOnVSync(offscreen_canvas, refreshes);
+    note_swap(refreshes);
+    if (switch_due_us >= 0) {
+      if (audio_player) {
+        av_offset_us[shown_cue] = audio_player->PositionUs(last_swap_us)
+          - show_passes * show_length_us - timeline.cue(shown_cue).start_us;
       }
+      const int64_t latency_us = last_swap_us - switch_due_us;
+      switch_latency_total_us += latency_us;
+      switch_latency_max_us = std::max(switch_latency_max_us, latency_us);
+      ++switch_count;
+      if (presentation_stats) {
+        PresentationStats::Record record;
+        record.cue = shown_cue;
+        record.missed = false;
+        record.scheduled_us = switch_due_us;
+        record.prepare_start_us = prepare_start_us;
+        record.prepared_us = prepared_us;
+        record.presented_us = last_swap_us;
+        presentation_stats->Add(record);
+      }
+      switch_due_us = -1;
+    }
+    if (!commands_presenting.empty() && draw_on_frame) {
+      for (size_t i = 0; i < commands_presenting.size(); ++i) {
+        const ControlCommand &command = commands_presenting[i];
+        if (command.type == ControlCommand::SET_BRIGHTNESS)
+          canvas->FadeBrightness(command.brightness, command.fade_ms);
+      }
+      AcknowledgeCommands(control_server, last_swap_us, &commands_presenting);
+    }
+    content_changed = false;
+    if (retained_mode && blink_on > 0) {
+      blink_frames_shown = draw_on_frame ? blink_on : blink_off;
+      blink_phase_on = !draw_on_frame;
     }
-    // Swap the offscreen_canvas with canvas on vsync, avoids flickering
-    offscreen_canvas = canvas->SwapOnVSync(offscreen_canvas);
-    //if (speed <= 0) pause();  // Nothing to scroll.
   }
 
+  print_stats();
+  delete presentation_stats;   // Writes the final statistics.
+  delete cue_cache;
+  delete audio_player;
+  delete audio_clock;
+
 // Finished. Shut down the RGB matrix.
 
 
@@ -554,6 +1033,8 @@ bool has_two_lines = !lines[1]->empty() && std::find_if(lines[1]->begin(), lines
 //  }
 //
   // Finished. Shut down the RGB matrix.
+  delete input_watcher;
+  delete control_server;
   canvas->Clear();
   delete canvas;
 
@@ -0,0 +1,167 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Statistics on how accurately the cues are presented.
+
+#include "presentation-stats.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using rgb_matrix::MutexLock;
+
+// Upper bounds (exclusive) of the lateness histogram buckets. The first one
+// collects early presentations, the last everything beyond.
+static const int64_t kLatenessBucketsUs[] = {
+  0, 250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000, 256000,
+};
+static const int kLatenessBuckets =
+  sizeof(kLatenessBucketsUs) / sizeof(kLatenessBucketsUs[0]) + 1;
+
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+PresentationStats::PresentationStats(const char *filename, int cue_count,
+                                     int overlapping_cues, int interval_ms)
+  : filename_(filename), overlapping_cues_(overlapping_cues),
+    interval_ms_(interval_ms), head_(0), tail_(0), dropped_(0),
+    running_(true), cues_(cue_count), presented_(0), missed_(0),
+    lateness_min_us_(0), lateness_max_us_(0), lateness_total_us_(0),
+    prepare_max_us_(0), prepare_total_us_(0),
+    histogram_(kLatenessBuckets, 0) {
+  pthread_cond_init(&wakeup_, NULL);
+}
+
+PresentationStats::~PresentationStats() {
+  Stop();
+  pthread_cond_destroy(&wakeup_);
+}
+
+void PresentationStats::Stop() {
+  {
+    MutexLock l(&mutex_);
+    running_ = false;
+    pthread_cond_signal(&wakeup_);
+  }
+  WaitStopped();
+}
+
+void PresentationStats::Add(const Record &record) {
+  const uint32_t head = head_.load(std::memory_order_relaxed);
+  if (head - tail_.load(std::memory_order_acquire) == kRingSize) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  ring_[head % kRingSize] = record;
+  head_.store(head + 1, std::memory_order_release);
+}
+
+void PresentationStats::Collect() {
+  const uint32_t head = head_.load(std::memory_order_acquire);
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  for (; tail != head; ++tail) {
+    const Record &r = ring_[tail % kRingSize];
+    if (r.cue < 0 || r.cue >= (int)cues_.size()) continue;
+    CueStats &cue = cues_[r.cue];
+    if (r.missed) {
+      ++cue.missed;
+      ++missed_;
+      continue;
+    }
+    const int64_t lateness_us = r.presented_us - r.scheduled_us;
+    const int64_t prepare_us = r.prepared_us - r.prepare_start_us;
+    lateness_min_us_ = presented_
+      ? std::min(lateness_min_us_, lateness_us) : lateness_us;
+    lateness_max_us_ = presented_
+      ? std::max(lateness_max_us_, lateness_us) : lateness_us;
+    lateness_total_us_ += lateness_us;
+    prepare_max_us_ = std::max(prepare_max_us_, prepare_us);
+    prepare_total_us_ += prepare_us;
+    ++presented_;
+
+    int bucket = 0;
+    while (bucket < kLatenessBuckets - 1
+           && lateness_us >= kLatenessBucketsUs[bucket]) {
+      ++bucket;
+    }
+    ++histogram_[bucket];
+
+    cue.max_lateness_us = cue.presented
+      ? std::max(cue.max_lateness_us, lateness_us) : lateness_us;
+    cue.last_lateness_us = lateness_us;
+    cue.max_prepare_us = std::max(cue.max_prepare_us, prepare_us);
+    ++cue.presented;
+  }
+  tail_.store(tail, std::memory_order_release);
+}
+
+bool PresentationStats::Write() {
+  // Write to a temporary file and rename, so that readers never see a
+  // partial file.
+  const std::string tmp_name = filename_ + ".tmp";
+  FILE *out = fopen(tmp_name.c_str(), "w");
+  if (out == NULL) {
+    fprintf(stderr, "Can't write statistics to '%s': %s\n",
+            tmp_name.c_str(), strerror(errno));
+    return false;
+  }
+  fprintf(out, "# subtitle presentation statistics, format 1\n");
+  fprintf(out, "time_us %lld\n", (long long)GetMonotonicMicros());
+  fprintf(out, "cues %d\n", (int)cues_.size());
+  fprintf(out, "cues_overlapping %d\n", overlapping_cues_);
+  fprintf(out, "presented %lld\n", (long long)presented_);
+  fprintf(out, "missed %lld\n", (long long)missed_);
+  fprintf(out, "dropped_records %u\n",
+          dropped_.load(std::memory_order_relaxed));
+  fprintf(out, "lateness_us %lld %lld %lld\n", (long long)lateness_min_us_,
+          (long long)(presented_ ? lateness_total_us_ / presented_ : 0),
+          (long long)lateness_max_us_);
+  for (int i = 0; i < kLatenessBuckets; ++i) {
+    if (i == 0) {
+      fprintf(out, "lateness_us_histogram early %lld\n",
+              (long long)histogram_[i]);
+    } else if (i == kLatenessBuckets - 1) {
+      fprintf(out, "lateness_us_histogram inf %lld\n",
+              (long long)histogram_[i]);
+    } else {
+      fprintf(out, "lateness_us_histogram %lld %lld\n",
+              (long long)kLatenessBucketsUs[i], (long long)histogram_[i]);
+    }
+  }
+  fprintf(out, "prepare_us %lld %lld\n",
+          (long long)(presented_ ? prepare_total_us_ / presented_ : 0),
+          (long long)prepare_max_us_);
+  for (size_t i = 0; i < cues_.size(); ++i) {
+    const CueStats &c = cues_[i];
+    fprintf(out, "cue %d %d %d %lld %lld %lld\n", (int)i, c.presented,
+            c.missed, (long long)c.last_lateness_us,
+            (long long)c.max_lateness_us, (long long)c.max_prepare_us);
+  }
+  const bool success = (fclose(out) == 0);
+  if (!success || rename(tmp_name.c_str(), filename_.c_str()) != 0) {
+    fprintf(stderr, "Can't write statistics to '%s': %s\n",
+            filename_.c_str(), strerror(errno));
+    unlink(tmp_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+void PresentationStats::Run() {
+  bool running = true;
+  while (running) {
+    {
+      MutexLock l(&mutex_);
+      if (running_) mutex_.WaitOn(&wakeup_, interval_ms_);
+      running = running_;
+    }
+    Collect();
+    Write();
+  }
+}
@@ -0,0 +1,113 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Statistics on how accurately the cues are presented.
+//
+// For every cue switch, the render loop records when the cue was scheduled,
+// when its frame was prepared and when the swap that made it visible
+// happened. To keep this out of the render path, Add() only copies the
+// record into a lock-free ring buffer; a background thread collects them,
+// aggregates lateness histogram and per-cue numbers, and periodically
+// writes everything to a file.
+//
+// The file is replaced atomically, so it can be polled at any time. It is
+// plain text, one "key value..." per line; the format is stable, new keys
+// are only ever added:
+//
+//   # subtitle presentation statistics, format 1
+//   time_us <now, CLOCK_MONOTONIC>
+//   cues <number of cues in the show>
+//   cues_overlapping <cues cut short because the next starts before the end>
+//   presented <cue switches made visible>
+//   missed <cues that were due, but never visible>
+//   dropped_records <records lost because the ring buffer was full>
+//   lateness_us <min> <avg> <max>
+//   lateness_us_histogram <upper bound|early|inf> <count>   (several lines)
+//   prepare_us <avg> <max>
+//   cue <index> <presented> <missed> <last lateness_us> <max lateness_us> <max prepare_us>
+//
+// Lateness is the time from when the cue was due to the swap that showed
+// it; preparing is the time to render (or take from cache) its frame.
+
+#ifndef SUBTITLE_PRESENTATION_STATS_H
+#define SUBTITLE_PRESENTATION_STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "thread.h"
+
+class PresentationStats : public rgb_matrix::Thread {
+public:
+  struct Record {
+    int cue;
+    bool missed;               // Never visible; the times are not set.
+    int64_t scheduled_us;      // When it was due.
+    int64_t prepare_start_us;
+    int64_t prepared_us;       // Frame ready to be swapped in.
+    int64_t presented_us;      // Swap done, now visible.
+  };
+
+  // Statistics for a show of "cue_count" cues, written to "filename"
+  // every "interval_ms".
+  PresentationStats(const char *filename, int cue_count,
+                    int overlapping_cues, int interval_ms);
+  virtual ~PresentationStats();
+
+  // Stop the background thread, after writing the final statistics.
+  void Stop();
+
+  // Add a record. Only to be called from a single thread, the render loop.
+  // Never blocks; if the background thread falls behind, the record is
+  // dropped and counted.
+  void Add(const Record &record);
+
+  virtual void Run();
+
+private:
+  static const uint32_t kRingSize = 1024;   // Power of two.
+
+  struct CueStats {
+    CueStats() : presented(0), missed(0), last_lateness_us(0),
+                 max_lateness_us(0), max_prepare_us(0) {}
+    int presented;
+    int missed;
+    int64_t last_lateness_us;
+    int64_t max_lateness_us;
+    int64_t max_prepare_us;
+  };
+
+  void Collect();
+  bool Write();
+
+  const std::string filename_;
+  const int overlapping_cues_;
+  const int interval_ms_;
+
+  // Ring buffer. Written at head_ by Add(), read at tail_ by Collect().
+  Record ring_[kRingSize];
+  std::atomic<uint32_t> head_;
+  std::atomic<uint32_t> tail_;
+  std::atomic<uint32_t> dropped_;
+
+  rgb_matrix::Mutex mutex_;
+  pthread_cond_t wakeup_;
+  bool running_;
+
+  // Aggregates; only used by the background thread.
+  std::vector<CueStats> cues_;
+  int64_t presented_;
+  int64_t missed_;
+  int64_t lateness_min_us_;
+  int64_t lateness_max_us_;
+  int64_t lateness_total_us_;
+  int64_t prepare_max_us_;
+  int64_t prepare_total_us_;
+  std::vector<int64_t> histogram_;
+};
+
+#endif  // SUBTITLE_PRESENTATION_STATS_H
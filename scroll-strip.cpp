@@ -0,0 +1,140 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// A subtitle rendered once into a strip, to be scrolled across the display.
+
+#include "scroll-strip.h"
+
+#include <limits.h>
+
+#include <algorithm>
+
+using rgb_matrix::Color;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::TextLayout;
+
+namespace {
+// Canvas to rasterize into the strip with the regular text functions. Each
+// pixel is either text or outline, whatever was drawn last.
+class LayerCanvas : public rgb_matrix::Canvas {
+public:
+  LayerCanvas(int width, int height, int words_per_row, const Color &color,
+              std::vector<uint64_t> *text, std::vector<uint64_t> *outline)
+    : width_(width), height_(height), words_per_row_(words_per_row),
+      color_(color), text_(text), outline_(outline) {}
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+    const int word = y * words_per_row_ + x / 64;
+    const uint64_t bit = (uint64_t)1 << (63 - x % 64);
+    const bool is_text = (red == color_.r && green == color_.g
+                          && blue == color_.b);
+    (*text_)[word] = is_text ? (*text_)[word] | bit : (*text_)[word] & ~bit;
+    (*outline_)[word] = is_text
+      ? (*outline_)[word] & ~bit : (*outline_)[word] | bit;
+  }
+  virtual void Clear() {
+    std::fill(text_->begin(), text_->end(), 0);
+    std::fill(outline_->begin(), outline_->end(), 0);
+  }
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+    for (int y = 0; y < height_; ++y) {
+      for (int x = 0; x < width_; ++x) SetPixel(x, y, red, green, blue);
+    }
+  }
+
+private:
+  const int width_;
+  const int height_;
+  const int words_per_row_;
+  const Color color_;
+  std::vector<uint64_t> *const text_;
+  std::vector<uint64_t> *const outline_;
+};
+}  // namespace
+
+ScrollStrip::ScrollStrip()
+  : outline_(false), length_(0), border_(0), baseline_(0), width_(0),
+    height_(0), words_per_row_(0) {}
+
+void ScrollStrip::Render(const SubtitleStyle &style, const std::string &text) {
+  std::string single_line = text;
+  std::replace(single_line.begin(), single_line.end(), '\n', ' ');
+  TextLayout layout;
+  layout.Layout(*style.font, single_line.c_str(), INT_MAX / 2,
+                style.letter_spacing, TextLayout::ALIGN_LEFT);
+
+  color_ = style.color;
+  outline_color_ = style.outline_color;
+  outline_ = style.outline;
+  length_ = (layout.line_count() > 0) ? layout.line_width(0) : 0;
+  border_ = outline_ ? 1 : 0;
+  baseline_ = border_ + style.font->baseline();
+  width_ = length_ + 2 * border_;
+  height_ = style.font->height() + 2 * border_;
+  words_per_row_ = (width_ + 63) / 64;
+  text_rows_.assign(height_ * words_per_row_, 0);
+  outline_rows_.assign(height_ * words_per_row_, 0);
+
+  LayerCanvas canvas(width_, height_, words_per_row_, color_,
+                     &text_rows_, &outline_rows_);
+  if (outline_) {
+    rgb_matrix::DrawOutlinedTextLayout(&canvas, *style.font, layout,
+                                       border_, baseline_, 0,
+                                       color_, outline_color_);
+  } else {
+    rgb_matrix::DrawTextLayout(&canvas, *style.font, layout,
+                               0, baseline_, 0, color_, NULL);
+  }
+}
+
+uint64_t ScrollStrip::Window(const std::vector<uint64_t> &layer, int row,
+                             int column) const {
+  // Floor division, as the window can start left of the strip.
+  const int word = (column >= 0) ? column / 64 : -((63 - column) / 64);
+  const int shift = column - word * 64;
+  const uint64_t *const row_words = &layer[row * words_per_row_];
+  const uint64_t left = (word >= 0 && word < words_per_row_)
+    ? row_words[word] : 0;
+  if (shift == 0) return left;
+  const uint64_t right = (word + 1 >= 0 && word + 1 < words_per_row_)
+    ? row_words[word + 1] : 0;
+  return (left << shift) | (right >> (64 - shift));
+}
+
+void ScrollStrip::Draw(FrameCanvas *canvas, int x, int y) {
+  const int left = x - border_;       // Canvas position of the strip.
+  const int top = y - baseline_;
+  if (width_ == 0 || left >= canvas->width() || left + width_ <= 0)
+    return;
+
+  // The windows line up with 64 pixel columns of the canvas.
+  const int first = std::max(0, left / 64);
+  const int last = std::min(canvas->width() - 1, left + width_ - 1) / 64;
+  window_rows_.resize(2 * (last - first + 1) * height_);
+  text_bitmaps_.clear();
+  outline_bitmaps_.clear();
+  uint64_t *rows = window_rows_.data();
+  for (int w = first; w <= last; ++w) {
+    FrameCanvas::Bitmap bitmap = { rows, 64, height_, w * 64, top };
+    for (int r = 0; r < height_; ++r) {
+      *rows++ = Window(text_rows_, r, w * 64 - left);
+    }
+    text_bitmaps_.push_back(bitmap);
+    if (!outline_) continue;
+    bitmap.rows = rows;
+    for (int r = 0; r < height_; ++r) {
+      *rows++ = Window(outline_rows_, r, w * 64 - left);
+    }
+    outline_bitmaps_.push_back(bitmap);
+  }
+
+  if (!outline_bitmaps_.empty()) {
+    canvas->DrawBitmaps(outline_bitmaps_.data(), outline_bitmaps_.size(),
+                        outline_color_.r, outline_color_.g, outline_color_.b);
+  }
+  canvas->DrawBitmaps(text_bitmaps_.data(), text_bitmaps_.size(),
+                      color_.r, color_.g, color_.b);
+}
@@ -0,0 +1,69 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// A subtitle rendered once into a strip as wide as the whole text, to be
+// scrolled across the display.
+//
+// Drawing the text with DrawText() for every scroll position costs the same
+// however little of it is visible, and a long cue has to be decoded and
+// rasterized character by character each frame. Instead, the text is
+// rasterized once into two bitmaps of 64 bit words per row; one for the
+// text, one for its outline. Showing it at a position then only needs to
+// shift out the 64 pixel wide windows that fall onto the display and hand
+// them to FrameCanvas::DrawBitmaps(), which sets all bitplanes of a color at
+// once.
+//
+// We don't keep the strip in the internal bitplane layout of the FrameCanvas
+// itself: where a column ends up in there depends on the pixel mapper and
+// multiplexing, so copying columns would only work for plain panel chains.
+
+#ifndef SUBTITLE_SCROLL_STRIP_H
+#define SUBTITLE_SCROLL_STRIP_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "led-matrix.h"
+#include "graphics.h"
+#include "subtitle-render.h"
+
+class ScrollStrip {
+public:
+  ScrollStrip();
+
+  // Render the text in a single line, with font, colors, letter spacing
+  // and outline of the style. Line breaks in the text become spaces.
+  void Render(const SubtitleStyle &style, const std::string &text);
+
+  // Pixels the text advances, as DrawText() would return.
+  int length() const { return length_; }
+
+  // Draw the text with its origin at "x" and the baseline at "y", like
+  // DrawText() would; only the text and outline pixels are set.
+  void Draw(rgb_matrix::FrameCanvas *canvas, int x, int y);
+
+private:
+  // The 64 pixels of "layer" in "row", starting at strip column "column".
+  uint64_t Window(const std::vector<uint64_t> &layer, int row,
+                  int column) const;
+
+  rgb_matrix::Color color_;
+  rgb_matrix::Color outline_color_;
+  bool outline_;
+  int length_;
+  int border_;             // Pixels of outline around the text.
+  int baseline_;           // Row of the baseline in the strip.
+  int width_;
+  int height_;
+  int words_per_row_;
+  std::vector<uint64_t> text_rows_;     // Leftmost pixel is the MSB.
+  std::vector<uint64_t> outline_rows_;  // Same for the outline.
+
+  // Windows passed to DrawBitmaps(); kept to not allocate on each frame.
+  std::vector<uint64_t> window_rows_;
+  std::vector<rgb_matrix::FrameCanvas::Bitmap> text_bitmaps_;
+  std::vector<rgb_matrix::FrameCanvas::Bitmap> outline_bitmaps_;
+};
+
+#endif  // SUBTITLE_SCROLL_STRIP_H
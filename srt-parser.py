@@ -4,7 +4,10 @@ from datetime import datetime, timedelta, time as dt_time
 import time
 import pygame
 import re
+import socket
+import struct
 import sys
+import threading
 import os
 
 os.environ['SDL_AUDIODRIVER'] = 'alsa'
@@ -180,8 +183,80 @@ def main(srt_filename, audio_filename, max_chars):
             out_file.write(' ')
 
 
+def main_audio_only(srt_filename, audio_filename):
+    """Only play the audio; the subtitle binary shows the text itself (-T)."""
+    show_length = max(end_time for _, end_time, _ in parse_srt(srt_filename, 0))
+    while True:
+        play_audio(audio_filename)
+        time.sleep(show_length.total_seconds())
+
+
+# Command types and ack status of the subtitle control socket (-U); see
+# control-server.h
+SHOW_TEXT, CLEAR = 1, 2
+ACK_STATUS = {0: 'presented', 1: 'invalid', 2: 'superseded'}
+
+def monotonic_us():
+    return int(time.clock_gettime(time.CLOCK_MONOTONIC) * 1000000)
+
+scheduled_us = {}   # command id -> time it was scheduled for
+
+def send_command(sock, command_id, command_type, at_us, text=''):
+    scheduled_us[command_id] = at_us
+    payload = text.encode('utf-8')
+    message = struct.pack('=IB3xq', command_id, command_type, at_us) + payload
+    sock.sendall(struct.pack('=I', len(message)) + message)
+
+def print_acks(sock):
+    """Print how late each command was shown, from the acks of the binary."""
+    while True:
+        header = sock.recv(4, socket.MSG_WAITALL)
+        if len(header) < 4:
+            return
+        length, = struct.unpack('=I', header)
+        ack = sock.recv(length, socket.MSG_WAITALL)
+        command_id, status, received_us, presented_us = struct.unpack('=IB3xqq', ack[:24])
+        at_us = max(scheduled_us.pop(command_id, 0), received_us)
+        if presented_us:
+            print(f"Command {command_id} {ACK_STATUS.get(status)}, "
+                  f"{(presented_us - at_us) / 1000:.1f}ms late")
+        else:
+            print(f"Command {command_id} {ACK_STATUS.get(status, status)}")
+
+def main_socket(srt_filename, audio_filename, socket_path):
+    """Send the cues with their display time to 'subtitle -U <socket_path>'.
+
+    The binary shows each one at exactly the scheduled time, so we only need
+    to be a bit ahead and don't have to wake up at the cue changes."""
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(socket_path)
+    threading.Thread(target=print_acks, args=(sock,), daemon=True).start()
+    cues = list(parse_srt(srt_filename, 0))
+    show_length = max(end_time for _, end_time, _ in cues)
+    command_id = 0
+    while True:
+        play_audio(audio_filename)
+        start_us = monotonic_us()
+        for start_time, end_time, text in cues:
+            at_us = start_us + int(start_time.total_seconds() * 1000000)
+            # Send each cue about a second ahead of time.
+            time.sleep(max(0, (at_us - monotonic_us()) / 1000000 - 1))
+            command_id += 1
+            send_command(sock, command_id, SHOW_TEXT, at_us, text.strip())
+            command_id += 1
+            send_command(sock, command_id, CLEAR,
+                         start_us + int(end_time.total_seconds() * 1000000))
+        time.sleep(max(0, (start_us + show_length.total_seconds() * 1000000
+                           - monotonic_us()) / 1000000))
+
+
 if __name__ == "__main__":
     srt_filename = 'files/subtitles.srt'
     audio_filename = 'files/audio.wav'
-    max_chars = int(sys.argv[1])
-    main(srt_filename, audio_filename,max_chars)
+    if sys.argv[1] == '--audio-only':
+        main_audio_only(srt_filename, audio_filename)
+    elif sys.argv[1] == '--socket':
+        main_socket(srt_filename, audio_filename, sys.argv[2])
+    else:
+        max_chars = int(sys.argv[1])
+        main(srt_filename, audio_filename,max_chars)
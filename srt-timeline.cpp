@@ -0,0 +1,163 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// In-memory index of the cues of a SubRip (*.srt) file.
+
+#include "srt-timeline.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <streambuf>
+
+static const char kWhitespace[] = " \t\r\n";
+
+static std::string Trim(const std::string &s) {
+  const size_t start = s.find_first_not_of(kWhitespace);
+  if (start == std::string::npos) return "";
+  const size_t end = s.find_last_not_of(kWhitespace);
+  return s.substr(start, end - start + 1);
+}
+
+// Subtitles sometimes contain <i>..</i> or <font ...> markup. We can't show
+// that, so just remove it.
+static std::string RemoveHtmlTags(const std::string &s) {
+  std::string result;
+  result.reserve(s.size());
+  bool in_tag = false;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '<' && s.find('>', i) != std::string::npos) {
+      in_tag = true;
+    } else if (in_tag && s[i] == '>') {
+      in_tag = false;
+    } else if (!in_tag) {
+      result.push_back(s[i]);
+    }
+  }
+  return result;
+}
+
+// Parse "HH:MM:SS,mmm" (some tools write a '.' instead of ',').
+static bool ParseTimestamp(const char *str, int64_t *result_us) {
+  int h, m, s, ms;
+  if (sscanf(str, "%d:%d:%d%*[,.]%d", &h, &m, &s, &ms) != 4)
+    return false;
+  *result_us = (((int64_t)h * 60 + m) * 60 + s) * 1000000 + (int64_t)ms * 1000;
+  return true;
+}
+
+static bool ParseTimeLine(const std::string &line, SrtCue *cue) {
+  const size_t arrow = line.find("-->");
+  if (arrow == std::string::npos) return false;
+  return ParseTimestamp(line.c_str(), &cue->start_us)
+    && ParseTimestamp(line.c_str() + arrow + 3 + strspn(line.c_str() + arrow + 3,
+                                                        kWhitespace),
+                      &cue->end_us);
+}
+
+bool SrtTimeline::LoadFile(const char *filename) {
+  std::ifstream fs(filename);
+  if (!fs.is_open()) {
+    fprintf(stderr, "Failed to open subtitle file: %s\n", filename);
+    return false;
+  }
+  std::string content((std::istreambuf_iterator<char>(fs)),
+                      std::istreambuf_iterator<char>());
+  return LoadFromString(content);
+}
+
+bool SrtTimeline::LoadFromString(const std::string &content) {
+  cues_.clear();
+  duration_us_ = 0;
+
+  // Skip UTF-8 byte order mark.
+  size_t pos = (content.compare(0, 3, "\xEF\xBB\xBF") == 0) ? 3 : 0;
+
+  // Blocks are separated by (possibly multiple) empty lines. A block is an
+  // optional sequence number, the time line and one or more lines of text.
+  std::vector<std::string> block;
+  bool done = false;
+  while (!done) {
+    std::string line;
+    const size_t eol = content.find('\n', pos);
+    if (eol == std::string::npos) {
+      line = content.substr(pos);
+      done = true;
+    } else {
+      line = content.substr(pos, eol - pos);
+      pos = eol + 1;
+    }
+    line = Trim(line);
+    if (!line.empty()) {
+      block.push_back(line);
+      if (!done) continue;
+    }
+    if (block.empty()) continue;
+
+    size_t time_line = 0;
+    while (time_line < block.size()
+           && block[time_line].find("-->") == std::string::npos) {
+      ++time_line;
+    }
+    SrtCue cue;
+    if (time_line >= block.size() || !ParseTimeLine(block[time_line], &cue)) {
+      fprintf(stderr, "Unexpected format in subtitle block starting with "
+              "'%s'; skipping.\n", block[0].c_str());
+      block.clear();
+      continue;
+    }
+
+    // First line of text is shown on the first row, everything else
+    // is joined on the second.
+    for (size_t i = time_line + 1; i < block.size(); ++i) {
+      const std::string text = Trim(RemoveHtmlTags(block[i]));
+      if (text.empty()) continue;
+      std::string &target = cue.lines[0].empty() ? cue.lines[0] : cue.lines[1];
+      if (!target.empty()) target.append(" ");
+      target.append(text);
+    }
+    if (cue.end_us < cue.start_us) cue.end_us = cue.start_us;
+    cues_.push_back(cue);
+    block.clear();
+  }
+
+  // Files are typically sorted already, but we rely on that for Seek().
+  std::stable_sort(cues_.begin(), cues_.end(),
+                   [](const SrtCue &a, const SrtCue &b) {
+                     return a.start_us < b.start_us;
+                   });
+  for (size_t i = 0; i < cues_.size(); ++i) {
+    duration_us_ = std::max(duration_us_, cues_[i].end_us);
+  }
+  return !cues_.empty();
+}
+
+// Index of the last cue with start_us <= t_us; -1 if there is none.
+static int LastStartedAt(const std::vector<SrtCue> &cues, int64_t t_us) {
+  std::vector<SrtCue>::const_iterator it
+    = std::upper_bound(cues.begin(), cues.end(), t_us,
+                       [](int64_t t, const SrtCue &c) {
+                         return t < c.start_us;
+                       });
+  return (int)(it - cues.begin()) - 1;
+}
+
+int SrtTimeline::Seek(int64_t t_us) const {
+  const int i = LastStartedAt(cues_, t_us);
+  if (i < 0 || t_us >= cues_[i].end_us) return -1;
+  return i;
+}
+
+int64_t SrtTimeline::NextChangeAfter(int64_t t_us) const {
+  const int i = LastStartedAt(cues_, t_us);
+  int64_t result = -1;
+  if ((size_t)(i + 1) < cues_.size()) {
+    result = cues_[i + 1].start_us;
+  }
+  if (i >= 0 && cues_[i].end_us > t_us
+      && (result < 0 || cues_[i].end_us < result)) {
+    result = cues_[i].end_us;
+  }
+  return result;
+}
@@ -0,0 +1,62 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// In-memory index of the cues of a SubRip (*.srt) file.
+//
+// The cues are kept sorted by start time so that finding the cue that is
+// active at any point of the timeline is a binary search. All times are
+// microseconds relative to the beginning of the show; the player maps
+// them onto an absolute CLOCK_MONOTONIC timeline.
+
+#ifndef SRT_TIMELINE_H
+#define SRT_TIMELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+// A single subtitle. Text is already cleaned up (no HTML-tags, no trailing
+// whitespace) and split in at most two lines, as that is what fits on the
+// matrix.
+struct SrtCue {
+  int64_t start_us;
+  int64_t end_us;
+  std::string lines[2];
+};
+
+class SrtTimeline {
+public:
+  SrtTimeline() {}
+
+  // Parse the given *.srt file and replace the current content.
+  // Malformed blocks are reported to stderr and skipped.
+  // Returns 'false' if the file can't be read or contains no cue at all.
+  bool LoadFile(const char *filename);
+
+  // Same, but parse from a string in memory.
+  bool LoadFromString(const std::string &content);
+
+  size_t size() const { return cues_.size(); }
+  bool empty() const { return cues_.empty(); }
+  const SrtCue &cue(size_t i) const { return cues_[i]; }
+
+  // Length of one pass through the show: end of the last cue.
+  int64_t duration_us() const { return duration_us_; }
+
+  // Return index of the cue that is visible at "t_us", or -1 if there is
+  // none (before the first cue or in a gap between cues).
+  // There is only one cue visible at a time: a cue is shown until it ends
+  // or until the next cue starts, whatever comes first.
+  int Seek(int64_t t_us) const;
+
+  // Return the next point in time after "t_us" at which the visible
+  // content changes (a cue starts or ends); -1 if nothing changes anymore.
+  int64_t NextChangeAfter(int64_t t_us) const;
+
+private:
+  std::vector<SrtCue> cues_;   // Sorted by start_us.
+  int64_t duration_us_ = 0;
+};
+
+#endif  // SRT_TIMELINE_H
@@ -0,0 +1,72 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Layout and drawing of a subtitle onto a canvas.
+
+#include "subtitle-render.h"
+
+#include <algorithm>
+#include <vector>
+
+using rgb_matrix::TextLayout;
+
+// Bytes of "text" up to and including its first "glyphs" characters that
+// are not white space; the ones TextLayout places.
+static size_t GlyphsEnd(const std::string &text, size_t glyphs) {
+  size_t pos = 0;
+  while (pos < text.size() && glyphs > 0) {
+    const char c = text[pos++];
+    if (c != ' ' && c != '\t' && c != '\r' && c != '\n') --glyphs;
+    while (pos < text.size() && (text[pos] & 0xC0) == 0x80)
+      ++pos;   // Rest of the UTF-8 sequence.
+  }
+  return pos;
+}
+
+void LayoutSubtitle(const SubtitleStyle &style, const std::string &text,
+                    TextLayout *layout) {
+  layout->Layout(*style.font, text.c_str(), style.width, style.letter_spacing);
+  if (layout->line_count() <= kSubtitleMaxLines) return;
+
+  std::string reflow = text;
+  if (text.find('\n') != std::string::npos) {
+    std::replace(reflow.begin(), reflow.end(), '\n', ' ');
+    layout->Layout(*style.font, reflow.c_str(), style.width,
+                   style.letter_spacing);
+  }
+  if (layout->line_count() <= kSubtitleMaxLines) return;
+
+  // Still too long: cut it off with an ellipsis after what fits, rather than
+  // drawing lines below the display. One character less, until the
+  // ellipsis fits as well.
+  const std::vector<TextLayout::Glyph> &glyphs = layout->glyphs();
+  size_t shown = 0;
+  while (shown < glyphs.size() && glyphs[shown].line < kSubtitleMaxLines)
+    ++shown;
+  for (;;) {
+    const std::string cut = reflow.substr(0, GlyphsEnd(reflow, shown)) + "...";
+    layout->Layout(*style.font, cut.c_str(), style.width,
+                   style.letter_spacing);
+    if (layout->line_count() <= kSubtitleMaxLines || shown == 0) break;
+    --shown;
+  }
+}
+
+void DrawSubtitle(rgb_matrix::FrameCanvas *canvas,
+                  const SubtitleStyle &style, const TextLayout &layout) {
+  canvas->Fill(style.bg_color.r, style.bg_color.g, style.bg_color.b);
+  const int baseline = style.font->baseline();
+  const int line_height = baseline + style.linespace;
+  const int first_baseline = (layout.line_count() > 1)
+    ? style.y + baseline
+    : style.y + 2 * baseline - style.linespace;
+
+  if (style.outline) {
+    rgb_matrix::DrawOutlinedTextLayout(canvas, *style.font, layout,
+                                       style.x, first_baseline, line_height,
+                                       style.color, style.outline_color);
+  } else {
+    rgb_matrix::DrawTextLayout(canvas, *style.font, layout,
+                               style.x, first_baseline, line_height,
+                               style.color, NULL);
+  }
+}
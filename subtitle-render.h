@@ -0,0 +1,48 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Layout and drawing of a subtitle onto a canvas. Shared by the player and
+// the show compiler, so that a pre-compiled show looks exactly like one that
+// is rendered live.
+
+#ifndef SUBTITLE_RENDER_H
+#define SUBTITLE_RENDER_H
+
+#include <string>
+
+#include "led-matrix.h"
+#include "graphics.h"
+
+struct SubtitleStyle {
+  SubtitleStyle()
+    : font(NULL), color(255, 255, 255), outline(false),
+      width(0), x(0), y(0), letter_spacing(0), linespace(0) {}
+
+  const rgb_matrix::Font *font;
+  rgb_matrix::Color color;
+  rgb_matrix::Color bg_color;
+  bool outline;          // Draw an outline around the letters.
+  rgb_matrix::Color outline_color;
+  int width;             // Pixels available for a line.
+  int x;                 // Shift of the centered text.
+  int y;
+  int letter_spacing;
+  int linespace;         // Extra pixels between the two lines.
+};
+
+// The display has room for this many lines.
+static const int kSubtitleMaxLines = 2;
+
+// Lay out the text, lines separated by '\n', word-wrapped and centered in
+// the style's width. If that results in more lines than fit on the display,
+// the line breaks in the text are ignored to make better use of the space;
+// if it still doesn't fit, it is cut off with an ellipsis.
+void LayoutSubtitle(const SubtitleStyle &style, const std::string &text,
+                    rgb_matrix::TextLayout *layout);
+
+// Fill the canvas with the background color and draw the subtitle on top.
+// A single line is drawn vertically centered.
+void DrawSubtitle(rgb_matrix::FrameCanvas *canvas,
+                  const SubtitleStyle &style,
+                  const rgb_matrix::TextLayout &layout);
+
+#endif  // SUBTITLE_RENDER_H
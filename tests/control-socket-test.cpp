@@ -0,0 +1,190 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Runs ./subtitle with the virtual output and talks to it over the control
+// socket, checking that commands become visible when the acknowledgement
+// says they did.
+//
+//   make check
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const int kRefreshHz = 100;   // Fixed, for predictable passes.
+static const int64_t kRefreshUs = 1000000 / kRefreshHz;
+
+static int failures = 0;
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (0)
+
+static int Connect(const std::string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  for (int attempt = 0; attempt < 100; ++attempt) {   // Until it is up.
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+    close(fd);
+    usleep(50000);
+  }
+  return -1;
+}
+
+static bool Send(int fd, uint32_t id, uint8_t type,
+                 const std::string &payload) {
+  std::string msg(4 + 16, '\0');
+  const uint32_t len = 16 + payload.size();
+  const int64_t at_us = 0;
+  memcpy(&msg[0], &len, 4);
+  memcpy(&msg[4], &id, 4);
+  memcpy(&msg[8], &type, 1);
+  memcpy(&msg[12], &at_us, 8);
+  msg += payload;
+  return write(fd, msg.data(), msg.size()) == (ssize_t)msg.size();
+}
+
+// Wait for the ack of "id"; returns its presentation time, -1 on error.
+static int64_t AwaitAck(int fd, uint32_t id) {
+  for (;;) {
+    char ack[28];
+    size_t got = 0;
+    while (got < sizeof(ack)) {
+      const ssize_t r = read(fd, ack + got, sizeof(ack) - got);
+      if (r <= 0) return -1;
+      got += r;
+    }
+    uint32_t ack_id;
+    int64_t presented_us;
+    memcpy(&ack_id, ack + 4, 4);
+    memcpy(&presented_us, ack + 20, 8);
+    if (ack_id == id) return ack[8] == 0 ? presented_us : -1;
+  }
+}
+
+// Brightest value in a PPM frame written by the virtual output.
+static int Brightest(const std::string &filename) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) return -1;
+  int width, height, maxval;
+  int result = -1;
+  if (fscanf(f, "P6 %d %d %d", &width, &height, &maxval) == 3) {
+    fgetc(f);
+    for (int i = 0; i < 3 * width * height; ++i)
+      result = std::max(result, fgetc(f));
+  }
+  fclose(f);
+  return result;
+}
+
+struct ShownFrame {
+  std::string name;
+  int64_t shown_us;   // End of the first refresh pass showing it.
+};
+
+static std::vector<ShownFrame> ReadFrameList(const std::string &dir) {
+  std::vector<ShownFrame> result;
+  FILE *f = fopen((dir + "/frames.txt").c_str(), "r");
+  if (f == NULL) return result;
+  char name[64];
+  unsigned long long passes;
+  long long shown_us;
+  while (fscanf(f, "%63s %llu %lld", name, &passes, &shown_us) == 3) {
+    ShownFrame frame = { name, shown_us };
+    result.push_back(frame);
+  }
+  fclose(f);
+  return result;
+}
+
+// An instant brightness change is visible from the refresh showing the frame
+// that carried it, as acknowledged, or the one right after; never before.
+static void TestBrightnessFollowsAck(const std::string &dir, int fd) {
+  CHECK(Send(fd, 1, 1 /* SHOW_TEXT */, "Hello"));
+  CHECK(AwaitAck(fd, 1) > 0);
+  usleep(100000);
+  CHECK(Send(fd, 2, 4 /* SET_BRIGHTNESS */, std::string(1, 50)));
+  const int64_t presented_us = AwaitAck(fd, 2);
+  CHECK(presented_us > 0);
+  usleep(100000);
+
+  const std::vector<ShownFrame> frames = ReadFrameList(dir);
+  int full = -1;
+  int64_t dimmed_us = -1;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const int brightest = Brightest(dir + "/" + frames[i].name);
+    if (brightest > full) {
+      full = brightest;
+    } else if (brightest > 0 && brightest < full) {
+      dimmed_us = frames[i].shown_us;
+      break;
+    }
+  }
+  CHECK(dimmed_us > 0);
+  CHECK(dimmed_us > presented_us);
+  CHECK(dimmed_us <= presented_us + 2 * kRefreshUs);
+  if (failures) {
+    fprintf(stderr, "Acknowledged at %lld, dimmed pass ended at %lld\n",
+            (long long)presented_us, (long long)dimmed_us);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char dir_template[] = "/tmp/control-socket-test.XXXXXX";
+  const char *dir = mkdtemp(dir_template);
+  if (dir == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string frames_dir = std::string(dir) + "/frames";
+  const std::string socket_path = std::string(dir) + "/control.sock";
+
+  const pid_t pid = fork();
+  if (pid == 0) {
+    const std::string backend = "--led-backend=virtual:" + frames_dir;
+    char refresh[32];
+    snprintf(refresh, sizeof(refresh), "--led-limit-refresh=%d", kRefreshHz);
+    execl("./subtitle", "subtitle", backend.c_str(), refresh,
+          "--led-no-drop-privs", "-f", "fonts/7x13.bdf",
+          "-U", socket_path.c_str(), (char *)NULL);
+    perror("Running ./subtitle");
+    _exit(1);
+  }
+
+  const int fd = Connect(socket_path);
+  CHECK(fd >= 0);
+  if (fd >= 0) {
+    TestBrightnessFollowsAck(frames_dir, fd);
+    close(fd);
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  const std::string cleanup = "rm -rf " + std::string(dir);
+  if (system(cleanup.c_str()) != 0)
+    fprintf(stderr, "Can't remove %s\n", dir);
+
+  if (failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], failures);
+    return 1;
+  }
+  printf("%s: all passed\n", argv[0]);
+  return 0;
+}
@@ -0,0 +1,87 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Layout of subtitles: what doesn't fit on the display.
+//
+//   make check
+
+#include <stdio.h>
+
+#include <string>
+
+#include "graphics.h"
+#include "../subtitle-render.h"
+
+using rgb_matrix::TextLayout;
+
+static int failures = 0;
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,  \
+              #cond);                                                   \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (0)
+
+// The characters of the layout, lines separated by '\n'; spaces are not
+// glyphs, so they are left out.
+static std::string Text(const TextLayout &layout) {
+  std::string result;
+  int line = 0;
+  for (size_t i = 0; i < layout.glyphs().size(); ++i) {
+    const TextLayout::Glyph &g = layout.glyphs()[i];
+    for (/**/; line < g.line; ++line) result += '\n';
+    result += (char)g.codepoint;
+  }
+  return result;
+}
+
+static bool EndsWith(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size()
+    && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  rgb_matrix::Font font;
+  if (!font.LoadFont("fonts/7x13.bdf")) {
+    fprintf(stderr, "Can't load fonts/7x13.bdf\n");
+    return 1;
+  }
+  SubtitleStyle style;
+  style.font = &font;
+  style.width = 64;   // 9 characters of 7x13.
+  TextLayout layout;
+
+  // Fits: unchanged.
+  LayoutSubtitle(style, "Hello\nworld", &layout);
+  CHECK(Text(layout) == "Hello\nworld");
+
+  // Three lines, but the words fit on two: re-flowed.
+  LayoutSubtitle(style, "One\ntwo\nthree", &layout);
+  CHECK(Text(layout) == "Onetwo\nthree");
+
+  // Too long for two lines: cut off after what fits, with an ellipsis.
+  LayoutSubtitle(style, "The door was open all night and nobody noticed",
+                 &layout);
+  CHECK(layout.line_count() == kSubtitleMaxLines);
+  CHECK(EndsWith(Text(layout), "..."));
+  CHECK(Text(layout) == "Thedoor\nwasop...");
+
+  // A single word longer than the display.
+  LayoutSubtitle(style, std::string(100, 'x'), &layout);
+  CHECK(layout.line_count() == kSubtitleMaxLines);
+  CHECK(Text(layout) == std::string(9, 'x') + "\n" + std::string(6, 'x')
+        + "...");
+
+  // A lot of text doesn't take forever.
+  std::string lots;
+  for (int i = 0; i < 10000; ++i) lots += "word ";
+  LayoutSubtitle(style, lots, &layout);
+  CHECK(layout.line_count() == kSubtitleMaxLines);
+
+  if (failures) {
+    fprintf(stderr, "%s: %d checks failed\n", argv[0], failures);
+    return 1;
+  }
+  printf("%s: all passed\n", argv[0]);
+  return 0;
+}